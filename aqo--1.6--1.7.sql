@@ -0,0 +1,143 @@
+/* contrib/aqo/aqo--1.6--1.7.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "ALTER EXTENSION aqo UPDATE TO '1.7'" to load this file. \quit
+
+--
+-- Hit and miss counters of the memo of predictions, made during a planning.
+-- Counters are local to the backend and accumulated since its start.
+--
+CREATE FUNCTION aqo_prediction_memo_stats(OUT hits bigint, OUT misses bigint)
+RETURNS record
+AS 'MODULE_PATHNAME', 'aqo_prediction_memo_stats'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+COMMENT ON FUNCTION aqo_prediction_memo_stats() IS
+'Show how many predictions of this backend were taken from the planning memo';
+
+--
+-- Counters of the queue of the asynchronous learning. Returns NULL if the
+-- queue isn't configured (aqo.learn_queue_size = 0).
+--
+CREATE FUNCTION aqo_learn_queue_stats(
+  OUT enqueued bigint,
+  OUT dropped bigint,
+  OUT learned bigint,
+  OUT pending_bytes bigint
+)
+RETURNS record
+AS 'MODULE_PATHNAME', 'aqo_learn_queue_stats'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+COMMENT ON FUNCTION aqo_learn_queue_stats() IS
+'Show counters of the queue of learning samples';
+
+--
+-- Counters of the eviction from the full storage: feature subspaces evicted
+-- from the ML data (see aqo.fss_max_items), runs of the clock sweep over the ML
+-- data and query classes evicted with all their data (see aqo.fs_max_items).
+--
+CREATE FUNCTION aqo_eviction_stats(
+  OUT fss_evicted bigint,
+  OUT fss_sweeps bigint,
+  OUT classes_evicted bigint
+)
+RETURNS record
+AS 'MODULE_PATHNAME', 'aqo_eviction_stats'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+COMMENT ON FUNCTION aqo_eviction_stats() IS
+'Show how many feature subspaces and query classes were evicted from the full storage';
+
+--
+-- Usage of the DSA memory by the ML data. Chunks of feature subspaces are
+-- allocated with room for more rows, so a new row is mostly stored in place.
+--
+CREATE FUNCTION aqo_data_memory_stats(
+  OUT nentries bigint,
+  OUT used_bytes bigint,
+  OUT allocated_bytes bigint,
+  OUT dsa_bytes bigint,
+  OUT reallocations bigint,
+  OUT inplace_updates bigint
+)
+RETURNS record
+AS 'MODULE_PATHNAME', 'aqo_data_memory_stats'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+COMMENT ON FUNCTION aqo_data_memory_stats() IS
+'Show utilization of the DSA memory by the ML data and counters of reallocations of its chunks';
+
+--
+-- Query texts and ML data are stored in separate DSA areas, limited by
+-- aqo.dsm_qtexts_size_max and aqo.dsm_size_max correspondingly.
+--
+CREATE FUNCTION aqo_dsa_usage(
+  OUT name text,
+  OUT allocated_size bigint,
+  OUT used_size bigint,
+  OUT size_limit bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'aqo_dsa_usage'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+COMMENT ON FUNCTION aqo_dsa_usage() IS
+'Show allocated sizes, used sizes and limits of the DSA areas of AQO';
+
+CREATE OR REPLACE FUNCTION aqo_memory_usage(
+  OUT name text,
+  OUT allocated_size int,
+  OUT used_size int
+)
+RETURNS SETOF record
+AS $$
+  SELECT name, total_bytes, used_bytes FROM pg_backend_memory_contexts
+  WHERE name LIKE 'AQO%'
+  UNION
+  SELECT name, allocated_size, size FROM pg_shmem_allocations
+  WHERE name LIKE 'AQO%'
+  UNION
+  SELECT name, allocated_size, used_size FROM aqo_dsa_usage();
+$$ LANGUAGE SQL;
+
+--
+-- Remove all the query texts, the rest of the knowledge base is kept.
+--
+CREATE FUNCTION aqo_query_texts_reset()
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'aqo_query_texts_reset'
+LANGUAGE C PARALLEL SAFE;
+COMMENT ON FUNCTION aqo_query_texts_reset() IS
+'Remove all the query texts and return the memory of them';
+
+--
+-- Hashes of feature subspaces are 64-bit now.
+--
+DROP VIEW aqo_data;
+DROP FUNCTION aqo_data();
+
+CREATE FUNCTION aqo_data (
+  OUT fs			bigint,
+  OUT fss			bigint,
+  OUT nfeatures		integer,
+  OUT features		double precision[][],
+  OUT targets		double precision[],
+  OUT reliability	double precision[],
+  OUT oids			Oid[]
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'aqo_data'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE VIEW aqo_data AS SELECT * FROM aqo_data();
+
+DROP FUNCTION aqo_data_update(bigint, integer, integer, double precision[][],
+							  double precision[], double precision[], Oid[]);
+
+CREATE FUNCTION aqo_data_update(
+  fs		bigint,
+  fss		bigint,
+  nfeatures	integer,
+  features	double precision[][],
+  targets	double precision[],
+  reliability	double precision[],
+  oids		Oid[])
+RETURNS bool
+AS 'MODULE_PATHNAME', 'aqo_data_update'
+LANGUAGE C VOLATILE;
@@ -23,6 +23,8 @@
 #include "aqo.h"
 #include "aqo_shared.h"
 #include "cardinality_hooks.h"
+#include "checkpointer.h"
+#include "learn_queue.h"
 #include "path_utils.h"
 #include "postmaster/bgworker.h"
 #include "preprocessing.h"
@@ -79,6 +81,8 @@ int			auto_tuning_infinite_loop = 8;
 
 /* The number of nearest neighbors which will be chosen for ML-operations */
 int			aqo_k;
+/* Max number of rows in the matrix of a new feature subspace */
+int			aqo_K = AQO_K_DEFAULT;
 double		log_selectivity_lower_bound = -30;
 
 bool		cleanup_bgworker = false;
@@ -328,6 +332,19 @@ _PG_init(void)
 							 NULL
 	);
 
+	DefineCustomBoolVariable(
+							 "aqo.legacy_clause_hash",
+							 "Compute hashes of clauses and feature subspaces as the previous versions of AQO did.",
+							 "Allows to use the knowledge base learned by these versions.",
+							 &aqo_legacy_clause_hash,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL
+	);
+
 	DefineCustomBoolVariable(
 							 "aqo.wide_search",
 							 "Search ML data in neighbour feature spaces.",
@@ -405,6 +422,30 @@ _PG_init(void)
 							NULL,
 							NULL
 	);
+	DefineCustomIntVariable("aqo.dsm_qtexts_size_max",
+							"Maximum size of dynamic shared memory which AQO could allocate to store query texts.",
+							NULL,
+							&dsm_qtexts_size_max,
+							20,
+							0, INT_MAX,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL
+	);
+	DefineCustomBoolVariable("aqo.compact_storage",
+							 "Store learning data in single precision.",
+							 "Halves memory used by feature subspaces. It is applied to subspaces on their next update.",
+							 &aqo_compact_storage,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL
+	);
+
 	DefineCustomIntVariable("aqo.statement_timeout",
 							"Time limit on learning.",
 							NULL,
@@ -440,6 +481,64 @@ _PG_init(void)
 							NULL,
 							NULL);
 
+	DefineCustomIntVariable("aqo.fss_max_rows",
+							"Max number of learning samples stored for a feature subspace.",
+							"Subspaces which were learned with another value keep their own capacity.",
+							&aqo_K,
+							AQO_K_DEFAULT, 1, AQO_K_MAX,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("aqo.learn_queue_size",
+							"Size of the shared queue of learning samples.",
+							"Zero disables the queue and the background learner. While the queue is full, new samples are dropped.",
+							&learn_queue_size,
+							0,
+							0, MAX_KILOBYTES,
+							PGC_POSTMASTER,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("aqo.async_learning",
+							 "Pass learning samples to the background learner.",
+							 "Requires aqo.learn_queue_size to be set. Samples which don't fit into the queue are dropped.",
+							 &aqo_async_learning,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("aqo.flush_interval",
+							"Time between flushes of the AQO storage by the background checkpointer.",
+							NULL,
+							&aqo_flush_interval,
+							60,
+							1, INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("aqo.flush_dirty_size",
+							"Size of changes of the AQO storage which triggers a flush.",
+							"Zero disables flushing by the size of changes.",
+							&aqo_flush_dirty_size,
+							1024,
+							0, MAX_KILOBYTES,
+							PGC_SIGHUP,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
 	DefineCustomBoolVariable("aqo.predict_with_few_neighbors",
 							"Establish the ability to make predictions with fewer neighbors than were found.",
 							 NULL,
@@ -495,6 +594,8 @@ _PG_init(void)
 	object_access_hook							= aqo_drop_access_hook;
 
 	init_deactivated_queries_storage();
+	learn_queue_register_worker();
+	checkpointer_register_worker();
 
 	/*
 	 * Create own Top memory Context for reporting AQO memory in the future.
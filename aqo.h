@@ -211,7 +211,7 @@ extern bool change_flex_timeout;
 struct StatEntry;
 
 extern double predicted_ppi_rows;
-extern double fss_ppi_hash;
+extern int64 fss_ppi_hash;
 
 /* Parameters of autotuning */
 extern int	aqo_stat_size;
@@ -262,12 +262,16 @@ extern int aqo_statement_timeout;
 /* Hash functions */
 void get_eclasses(List *clauselist, int *nargs, int **args_hash,
 				  int **eclass_hash);
+extern bool aqo_legacy_clause_hash;
 int get_clause_hash(Expr *clause, int nargs, int *args_hash, int *eclass_hash);
 
 
 /* Storage interaction */
-extern bool load_fss_ext(uint64 fs, int fss, OkNNrdata *data, List **reloids);
-extern bool update_fss_ext(uint64 fs, int fss, OkNNrdata *data, List *reloids);
+extern bool load_fss_ext(uint64 fs, int64 fss, OkNNrdata *data, List **reloids);
+extern bool predict_fss_ext(uint64 fs, int64 fss, int ncols, double *features,
+							double *result);
+extern bool update_fss_ext(uint64 fs, int64 fss, OkNNrdata *data,
+						   List *reloids);
 
 /* Query preprocessing hooks */
 extern void print_into_explain(PlannedStmt *plannedstmt, IntoClause *into,
@@ -279,7 +283,7 @@ extern void print_node_explain(ExplainState *es, PlanState *ps, Plan *plan);
 
 /* Cardinality estimation */
 extern double predict_for_relation(List *restrict_clauses, List *selectivities,
-								   List *relsigns, int *fss);
+								   List *relsigns, int64 *fss);
 
 /* Query execution statistics collecting hooks */
 void aqo_ExecutorStart(QueryDesc *queryDesc, int eflags);
@@ -9,6 +9,8 @@
 #include "storage/shmem.h"
 
 #include "aqo_shared.h"
+#include "checkpointer.h"
+#include "learn_queue.h"
 #include "storage.h"
 
 
@@ -24,6 +26,8 @@ aqo_init_shmem(void)
 {
 	bool		found;
 	HASHCTL		info;
+	int			trancheid;
+	int			i;
 
 	if (prev_shmem_startup_hook)
 		prev_shmem_startup_hook();
@@ -32,6 +36,7 @@ aqo_init_shmem(void)
 	stat_htab = NULL;
 	qtexts_htab = NULL;
 	data_htab = NULL;
+	fss_index_htab = NULL;
 	queries_htab = NULL;
 
 	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
@@ -44,17 +49,42 @@ aqo_init_shmem(void)
 		aqo_state->data_dsa_handler = DSM_HANDLE_INVALID;
 
 		aqo_state->qtext_trancheid = LWLockNewTrancheId();
+		aqo_state->data_trancheid = LWLockNewTrancheId();
 
 		aqo_state->qtexts_changed = false;
 		aqo_state->stat_changed = false;
-		aqo_state->data_changed = false;
+		pg_atomic_init_u32(&aqo_state->data_changed, 0);
+		pg_atomic_init_u32(&aqo_state->data_removed, 0);
+		pg_atomic_init_u32(&aqo_state->data_nentries, 0);
+		aqo_state->data_base_size = 0;
+		aqo_state->data_delta_size = 0;
+		aqo_state->data_generation = 0;
+		aqo_state->data_tombstones = InvalidDsaPointer;
+		aqo_state->data_ntombstones = 0;
+		aqo_state->data_maxtombstones = 0;
+		aqo_state->data_file_slots = InvalidDsaPointer;
+		aqo_state->data_file_nrecs = 0;
+		pg_atomic_init_u64(&aqo_state->data_file_pending, 0);
+		aqo_state->data_clock_hand = 0;
+		pg_atomic_init_u64(&aqo_state->data_evicted, 0);
+		pg_atomic_init_u64(&aqo_state->data_sweeps, 0);
+		pg_atomic_init_u64(&aqo_state->data_reallocs, 0);
+		pg_atomic_init_u64(&aqo_state->data_inplace, 0);
 		aqo_state->queries_changed = false;
+		memset(aqo_state->queries_doorkeeper, 0,
+			   sizeof(aqo_state->queries_doorkeeper));
+		pg_atomic_init_u64(&aqo_state->queries_evicted, 0);
+		pg_atomic_init_u32(&aqo_state->queries_evict_requested, 0);
 		aqo_state->bgw_handle = NULL;
 
 		LWLockInitialize(&aqo_state->lock, LWLockNewTrancheId());
 		LWLockInitialize(&aqo_state->stat_lock, LWLockNewTrancheId());
 		LWLockInitialize(&aqo_state->qtexts_lock, LWLockNewTrancheId());
 		LWLockInitialize(&aqo_state->data_lock, LWLockNewTrancheId());
+		trancheid = LWLockNewTrancheId();
+		for (i = 0; i < AQO_DATA_PARTITIONS; i++)
+			LWLockInitialize(&aqo_state->data_partition_locks[i].lock,
+							 trancheid);
 		LWLockInitialize(&aqo_state->queries_lock, LWLockNewTrancheId());
 	}
 
@@ -72,8 +102,16 @@ aqo_init_shmem(void)
 	/* Shared memory hash table for the data */
 	info.keysize = sizeof(data_key);
 	info.entrysize = sizeof(DataEntry);
+	info.num_partitions = AQO_DATA_PARTITIONS;
 	data_htab = ShmemInitHash("AQO Data HTAB", fss_max_items, fss_max_items,
-							  &info, HASH_ELEM | HASH_BLOBS);
+							  &info, HASH_ELEM | HASH_BLOBS | HASH_PARTITION);
+
+	/* Index of the data by feature subspace, see load_aqo_data() */
+	info.keysize = sizeof(((FssIndexEntry *) 0)->fss);
+	info.entrysize = sizeof(FssIndexEntry);
+	fss_index_htab = ShmemInitHash("AQO FSS Index HTAB", fss_max_items,
+								   fss_max_items, &info,
+								   HASH_ELEM | HASH_BLOBS);
 
 	/* Shared memory hash table for queries */
 	info.keysize = sizeof(((QueriesEntry *) 0)->queryid);
@@ -81,12 +119,18 @@ aqo_init_shmem(void)
 	queries_htab = ShmemInitHash("AQO Queries HTAB", fs_max_items, fs_max_items,
 								 &info, HASH_ELEM | HASH_BLOBS);
 
+	learn_queue_init_shmem();
+	checkpointer_init_shmem();
+
 	LWLockRelease(AddinShmemInitLock);
 	LWLockRegisterTranche(aqo_state->lock.tranche, "AQO");
 	LWLockRegisterTranche(aqo_state->stat_lock.tranche, "AQO Stat Lock Tranche");
 	LWLockRegisterTranche(aqo_state->qtexts_lock.tranche, "AQO QTexts Lock Tranche");
 	LWLockRegisterTranche(aqo_state->qtext_trancheid, "AQO Query Texts Tranche");
+	LWLockRegisterTranche(aqo_state->data_trancheid, "AQO Data Tranche");
 	LWLockRegisterTranche(aqo_state->data_lock.tranche, "AQO Data Lock Tranche");
+	LWLockRegisterTranche(aqo_state->data_partition_locks[0].lock.tranche,
+						  "AQO Data Partition Lock Tranche");
 	LWLockRegisterTranche(aqo_state->queries_lock.tranche, "AQO Queries Lock Tranche");
 
 	if (!IsUnderPostmaster && !found)
@@ -127,7 +171,10 @@ aqo_memsize(void)
 	size = add_size(size, hash_estimate_size(fs_max_items, sizeof(StatEntry)));
 	size = add_size(size, hash_estimate_size(fs_max_items, sizeof(QueryTextEntry)));
 	size = add_size(size, hash_estimate_size(fss_max_items, sizeof(DataEntry)));
+	size = add_size(size, hash_estimate_size(fss_max_items, sizeof(FssIndexEntry)));
 	size = add_size(size, hash_estimate_size(fs_max_items, sizeof(QueriesEntry)));
+	size = add_size(size, learn_queue_memsize());
+	size = add_size(size, checkpointer_memsize());
 
 	return size;
 }
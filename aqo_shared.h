@@ -2,6 +2,7 @@
 #define AQO_SHARED_H
 
 #include "lib/dshash.h"
+#include "port/atomics.h"
 #include "postmaster/bgworker.h"
 #include "storage/dsm.h"
 #include "storage/ipc.h"
@@ -10,6 +11,12 @@
 
 #define AQO_SHARED_MAGIC	0x053163
 
+/* Number of partitions of the shared hash table of ML data */
+#define AQO_DATA_PARTITIONS	(16)
+
+/* Number of query classes remembered by the doorkeeper of the full storage */
+#define AQO_DOORKEEPER_SIZE	(1024)
+
 typedef struct AQOSharedState
 {
 	LWLock		lock;			/* mutual exclusion */
@@ -23,12 +30,34 @@ typedef struct AQOSharedState
 	int			qtext_trancheid;
 	bool		qtexts_changed;
 
-	LWLock		data_lock; /* Lock for shared fields below */
-	dsa_handle	data_dsa_handler;
-	bool		data_changed;
+	LWLock		data_lock; /* Lock for shared fields below and the fss index */
+	dsa_handle	data_dsa_handler; /* DSA area for storing of ML data */
+	int			data_trancheid;
+	/* Set under the lock of any partition, so they are atomic */
+	pg_atomic_uint32 data_changed;
+	pg_atomic_uint32 data_removed; /* the delta log isn't enough for a flush */
+	pg_atomic_uint32 data_nentries; /* see data_entry_reserve() */
+	long		data_base_size; /* size of the ML data file */
+	long		data_delta_size; /* size of the delta log of the ML data */
+	uint32		data_generation; /* of the ML data file and its delta log */
+	dsa_pointer	data_tombstones; /* removed keys, see storage.c */
+	int			data_ntombstones;
+	int			data_maxtombstones;
+	dsa_pointer	data_file_slots; /* entries of the file loaded on demand */
+	int64		data_file_nrecs;
+	pg_atomic_uint64 data_file_pending; /* entries of the file not loaded yet */
+	long		data_clock_hand; /* position of the clock sweep, see storage.c */
+	pg_atomic_uint64 data_evicted; /* entries evicted by the clock sweep */
+	pg_atomic_uint64 data_sweeps; /* runs of the clock sweep */
+	pg_atomic_uint64 data_reallocs; /* DSA chunks reallocated by a store */
+	pg_atomic_uint64 data_inplace; /* updates made in the same DSA chunk */
+	LWLockPadded data_partition_locks[AQO_DATA_PARTITIONS]; /* see storage.c */
 
 	LWLock		queries_lock;  /* lock for access to queries storage */
 	bool		queries_changed;
+	uint64		queries_doorkeeper[AQO_DOORKEEPER_SIZE]; /* see storage.c */
+	pg_atomic_uint64 queries_evicted; /* query classes evicted */
+	pg_atomic_uint32 queries_evict_requested; /* see aqo_queries_admit() */
 
 	BackgroundWorkerHandle	*bgw_handle;
 } AQOSharedState;
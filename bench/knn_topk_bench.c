@@ -0,0 +1,155 @@
+/*
+ *******************************************************************************
+ *
+ *	MICRO-BENCHMARK OF NEAREST NEIGHBORS SELECTION
+ *
+ * Compares the bounded heap selection used by compute_weights() with the
+ * insertion scheme it replaced, for aqo_k from 3 to 30 and different numbers
+ * of rows in the matrix. Both selectors must return the same indexes in the
+ * same order, otherwise the benchmark fails.
+ *
+ * It doesn't need the DBMS, build and run it from this directory:
+ *
+ *	cc -O2 -I.. -o knn_topk_bench knn_topk_bench.c && ./knn_topk_bench
+ *
+ *******************************************************************************
+ *
+ * Copyright (c) 2016-2022, Postgres Professional
+ *
+ * IDENTIFICATION
+ *	  aqo/bench/knn_topk_bench.c
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "knn_topk.h"
+
+#define MAX_ROWS	(1000)
+#define NSAMPLES	(64)
+
+/*
+ * The former selector of compute_weights(): O(nrows * k), unfilled positions
+ * of idx[] are set to -1.
+ */
+static int
+insertion_select(const double *distances, int nrows, int k, int *idx)
+{
+	int		i,
+			j;
+	int		to_insert,
+			tmp;
+	int		n = 0;
+
+	for (i = 0; i < k; ++i)
+		idx[i] = -1;
+
+	for (i = 0; i < nrows; ++i)
+		for (j = 0; j < k; ++j)
+			if (idx[j] == -1 || distances[i] < distances[idx[j]])
+			{
+				to_insert = i;
+				for (; j < k; ++j)
+				{
+					tmp = idx[j];
+					idx[j] = to_insert;
+					to_insert = tmp;
+				}
+				break;
+			}
+
+	while (n < k && idx[n] != -1)
+		n++;
+	return n;
+}
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+int
+main(void)
+{
+	static const int rows_set[] = {10, 30, 100, 1000};
+	static double distances[NSAMPLES][MAX_ROWS];
+	int		idx1[MAX_ROWS];
+	int		idx2[MAX_ROWS];
+	int		r;
+	int		k;
+	int		s;
+	int		i;
+	volatile int sink = 0;
+
+	srand(42);
+
+	/*
+	 * Distances are rounded to make ties frequent: both selectors have to
+	 * resolve them the same way.
+	 */
+	for (s = 0; s < NSAMPLES; s++)
+		for (i = 0; i < MAX_ROWS; i++)
+			distances[s][i] = (double) (rand() % 200) / 10.;
+
+	printf("%6s %4s %14s %14s %8s\n",
+		   "rows", "k", "insertion, ns", "heap, ns", "speedup");
+
+	for (r = 0; r < (int) (sizeof(rows_set) / sizeof(rows_set[0])); r++)
+	{
+		int		nrows = rows_set[r];
+		int		niters = 2000000 / nrows;
+
+		for (k = 3; k <= 30; k++)
+		{
+			double	start;
+			double	t_ins;
+			double	t_heap;
+			int		iter;
+
+			/* Check correctness first */
+			for (s = 0; s < NSAMPLES; s++)
+			{
+				int		n1 = insertion_select(distances[s], nrows, k, idx1);
+				int		n2 = knn_select_nearest(distances[s], nrows, k, idx2);
+
+				if (n1 != n2)
+				{
+					fprintf(stderr, "rows=%d k=%d: %d != %d neighbors\n",
+							nrows, k, n1, n2);
+					return 1;
+				}
+				for (i = 0; i < n1; i++)
+					if (idx1[i] != idx2[i])
+					{
+						fprintf(stderr, "rows=%d k=%d: mismatch at %d\n",
+								nrows, k, i);
+						return 1;
+					}
+			}
+
+			start = now_ns();
+			for (iter = 0; iter < niters; iter++)
+				sink += insertion_select(distances[iter % NSAMPLES],
+										 nrows, k, idx1);
+			t_ins = (now_ns() - start) / niters;
+
+			start = now_ns();
+			for (iter = 0; iter < niters; iter++)
+				sink += knn_select_nearest(distances[iter % NSAMPLES],
+										   nrows, k, idx2);
+			t_heap = (now_ns() - start) / niters;
+
+			printf("%6d %4d %14.1f %14.1f %8.2f\n",
+				   nrows, k, t_ins, t_heap, t_ins / t_heap);
+		}
+	}
+
+	(void) sink;
+	return 0;
+}
@@ -17,6 +17,8 @@
 
 #include "postgres.h"
 
+#include "common/hashfn.h"
+#include "funcapi.h"
 #include "optimizer/optimizer.h"
 
 #include "aqo.h"
@@ -27,16 +29,18 @@
 
 bool use_wide_search = false;
 
+PG_FUNCTION_INFO_V1(aqo_prediction_memo_stats);
+
 #ifdef AQO_DEBUG_PRINT
 static void
 predict_debug_output(List *clauses, List *selectivities,
-					 List *reloids, int fss, double result)
+					 List *reloids, int64 fss, double result)
 {
 	StringInfoData debug_str;
 	ListCell *lc;
 
 	initStringInfo(&debug_str);
-	appendStringInfo(&debug_str, "fss: %d, clausesNum: %d, ",
+	appendStringInfo(&debug_str, "fss: "INT64_FORMAT", clausesNum: %d, ",
 					 fss, list_length(clauses));
 
 	appendStringInfoString(&debug_str, ", selectivities: { ");
@@ -58,17 +62,246 @@ predict_debug_output(List *clauses, List *selectivities,
 }
 #endif
 
+/*
+ * Learning data of feature subspaces requested during the current planning.
+ *
+ * The planner asks for the same subspace many times while it enumerates join
+ * orders and parameterizations. The first request is served right from the
+ * shared storage. If the subspace is requested again, its data are copied into
+ * the backend memory once and all the next predictions don't touch the shared
+ * storage at all. Absence of the data is remembered too.
+ *
+ * The table lives in the AQOPredictMemCtx and vanishes with its reset at the
+ * end of the planning.
+ */
+typedef struct FssModelKey
+{
+	uint64		fs;
+	int64		fss;
+	int			ncols;		/* differs in the case of hash collision */
+} FssModelKey;
+
+typedef struct FssModelEntry
+{
+	FssModelKey	key;
+
+	int			nrequests;
+	bool		missing;	/* no data in the storage */
+	OkNNrdata  *data;		/* NULL, if not loaded */
+} FssModelEntry;
+
+static HTAB *fss_models = NULL;
+
+/*
+ * Memo of predictions made during the current planning.
+ *
+ * The parameterized size hooks are called repeatedly for the same inputs. The
+ * memo is keyed by the feature subspace and a hash of the feature vector; the
+ * vector itself is stored in the entry and compared to be sure.
+ * It shares the lifetime of the table above.
+ */
+typedef struct PredictMemoKey
+{
+	uint64		fs;
+	int64		fss;
+	int			ncols;
+	uint32		features_hash;
+} PredictMemoKey;
+
+typedef struct PredictMemoEntry
+{
+	PredictMemoKey	key;
+
+	double		   *features;
+	double			result;
+} PredictMemoEntry;
+
+static HTAB *predict_memo = NULL;
+
+/* Backend-local statistics of the memo, see aqo_prediction_memo_stats() */
+static uint64 predict_memo_hits = 0;
+static uint64 predict_memo_misses = 0;
+
+static void
+planning_cache_reset(void *arg)
+{
+	fss_models = NULL;
+	predict_memo = NULL;
+}
+
+static void
+planning_cache_init(void)
+{
+	HASHCTL					ctl;
+	MemoryContextCallback  *cb;
+
+	if (fss_models != NULL)
+		return;
+
+	Assert(predict_memo == NULL);
+
+	ctl.keysize = sizeof(FssModelKey);
+	ctl.entrysize = sizeof(FssModelEntry);
+	ctl.hcxt = AQOPredictMemCtx;
+	fss_models = hash_create("AQO planning models", 64, &ctl,
+							 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	ctl.keysize = sizeof(PredictMemoKey);
+	ctl.entrysize = sizeof(PredictMemoEntry);
+	ctl.hcxt = AQOPredictMemCtx;
+	predict_memo = hash_create("AQO prediction memo", 256, &ctl,
+							   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	/* Forget the tables when their memory is released */
+	cb = MemoryContextAlloc(AQOPredictMemCtx, sizeof(MemoryContextCallback));
+	cb->func = planning_cache_reset;
+	cb->arg = NULL;
+	MemoryContextRegisterResetCallback(AQOPredictMemCtx, cb);
+}
+
+/*
+ * Find memo entry for the feature vector. Returns NULL if the prediction isn't
+ * memorized. In this case *key is filled to store it later.
+ */
+static PredictMemoEntry *
+predict_memo_lookup(uint64 fs, int64 fss, int ncols, double *features,
+					PredictMemoKey *key)
+{
+	PredictMemoEntry   *entry;
+
+	planning_cache_init();
+
+	memset(key, 0, sizeof(PredictMemoKey));
+	key->fs = fs;
+	key->fss = fss;
+	key->ncols = ncols;
+	key->features_hash = (ncols > 0) ?
+		hash_bytes((unsigned char *) features, sizeof(double) * ncols) : 0;
+
+	entry = (PredictMemoEntry *) hash_search(predict_memo, key, HASH_FIND, NULL);
+	if (entry != NULL && ncols > 0 &&
+		memcmp(entry->features, features, sizeof(double) * ncols) != 0)
+		/* Hash collision of the vectors */
+		entry = NULL;
+
+	return entry;
+}
+
+static void
+predict_memo_store(PredictMemoKey *key, double *features, double result)
+{
+	PredictMemoEntry   *entry;
+
+	entry = (PredictMemoEntry *) hash_search(predict_memo, key, HASH_ENTER,
+											 NULL);
+
+	/* On collision the previous vector is replaced */
+	entry->features = MemoryContextAlloc(AQOPredictMemCtx,
+										 sizeof(double) * Max(key->ncols, 1));
+	if (key->ncols > 0)
+		memcpy(entry->features, features, sizeof(double) * key->ncols);
+	entry->result = result;
+}
+
+static FssModelEntry *
+fss_model_lookup(uint64 fs, int64 fss, int ncols)
+{
+	FssModelKey		key;
+	FssModelEntry  *entry;
+	bool			found;
+
+	planning_cache_init();
+
+	memset(&key, 0, sizeof(FssModelKey));
+	key.fs = fs;
+	key.fss = fss;
+	key.ncols = ncols;
+	entry = (FssModelEntry *) hash_search(fss_models, &key, HASH_ENTER, &found);
+
+	if (!found)
+	{
+		entry->nrequests = 0;
+		entry->missing = false;
+		entry->data = NULL;
+	}
+
+	return entry;
+}
+
+/*
+ * Predict by learning data of the feature subspace.
+ * Returns false, if the subspace doesn't have learning data.
+ */
+static bool
+predict_fss(uint64 fs, int64 fss, int ncols, double *features, double *result)
+{
+	FssModelEntry  *model = fss_model_lookup(fs, fss, ncols);
+	bool			found;
+
+	if (model->missing)
+		return false;
+
+	if (model->data == NULL && ++model->nrequests > 1)
+	{
+		/* The subspace is in demand. Load it into the backend memory. */
+		MemoryContext	oldctx = MemoryContextSwitchTo(AQOPredictMemCtx);
+		OkNNrdata	   *data = OkNNr_allocate(ncols);
+
+		if (load_fss_ext(fs, fss, data, NULL))
+			model->data = data;
+		else
+			OkNNr_free(data);
+		MemoryContextSwitchTo(oldctx);
+	}
+
+	if (model->data != NULL)
+	{
+		*result = OkNNr_predict(model->data, features);
+		return true;
+	}
+
+	found = predict_fss_ext(fs, fss, ncols, features, result);
+	if (!found)
+		model->missing = true;
+	return found;
+}
+
+/*
+ * Return hit and miss counters of the prediction memo of this backend.
+ */
+Datum
+aqo_prediction_memo_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupDesc;
+	HeapTuple	tuple;
+	Datum		values[2];
+	bool		nulls[2] = {0, 0};
+
+	if (get_call_result_type(fcinfo, NULL, &tupDesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	Assert(tupDesc->natts == 2);
+
+	values[0] = Int64GetDatum((int64) predict_memo_hits);
+	values[1] = Int64GetDatum((int64) predict_memo_misses);
+
+	tuple = heap_form_tuple(tupDesc, values, nulls);
+	PG_RETURN_DATUM(HeapTupleGetDatum(tuple));
+}
+
 /*
  * General method for prediction the cardinality of given relation.
+ * Objects, predicted earlier during this planning, are taken from the memo.
  */
 double
 predict_for_relation(List *clauses, List *selectivities, List *relsigns,
-					 int *fss)
+					 int64 *fss)
 {
 	double	   *features;
 	double		result;
 	int			ncols;
-	OkNNrdata  *data;
+	PredictMemoKey		key;
+	PredictMemoEntry   *entry;
 
 	if (relsigns == NIL)
 		/*
@@ -79,11 +312,18 @@ predict_for_relation(List *clauses, List *selectivities, List *relsigns,
 
 	*fss = get_fss_for_object(relsigns, clauses, selectivities,
 							  &ncols, &features);
-	data = OkNNr_allocate(ncols);
 
-	if (load_fss_ext(query_context.fspace_hash, *fss, data, NULL))
-		result = OkNNr_predict(data, features);
-	else
+	entry = predict_memo_lookup(query_context.fspace_hash, *fss, ncols,
+								features, &key);
+	if (entry != NULL)
+	{
+		predict_memo_hits++;
+		return entry->result;
+	}
+	predict_memo_misses++;
+
+	if (!predict_fss(query_context.fspace_hash, *fss, ncols, features,
+					 &result))
 	{
 		/*
 		 * Due to planning optimizer tries to build many alternate paths. Many
@@ -91,13 +331,16 @@ predict_for_relation(List *clauses, List *selectivities, List *relsigns,
 		 * small part of paths was used for AQO learning and stored into
 		 * the AQO knowledge base.
 		 */
+		OkNNrdata  *data = OkNNr_allocate(ncols);
 
 		/* Try to search in surrounding feature spaces for the same node */
-		if (!load_aqo_data(query_context.fspace_hash, *fss, data, NULL, use_wide_search, features))
+		if (!use_wide_search ||
+			!load_aqo_data(query_context.fspace_hash, *fss, data, NULL, true,
+						   features))
 			result = -1;
 		else
 		{
-			elog(DEBUG5, "[AQO] Make prediction for fss %d by a neighbour "
+			elog(DEBUG5, "[AQO] Make prediction for fss "INT64_FORMAT" by a neighbour "
 				 "includes %d feature(s) and %d fact(s).",
 				 *fss, data->cols, data->rows);
 			result = OkNNr_predict(data, features);
@@ -109,7 +352,10 @@ predict_for_relation(List *clauses, List *selectivities, List *relsigns,
 #endif
 
 	if (result < 0)
-		return -1;
+		result = -1;
 	else
-		return clamp_row_est(exp(result));
+		result = clamp_row_est(exp(result));
+
+	predict_memo_store(&key, features, result);
+	return result;
 }
@@ -36,7 +36,7 @@
 estimate_num_groups_hook_type prev_estimate_num_groups_hook = NULL;
 
 double predicted_ppi_rows;
-double fss_ppi_hash;
+int64 fss_ppi_hash;
 
 
 /*
@@ -143,7 +143,7 @@ aqo_set_baserel_rows_estimate(PlannerInfo *root, RelOptInfo *rel)
 	RelSortOut		rels = {NIL, NIL};
 	List		   *selectivities = NULL;
 	List		   *clauses;
-	int				fss = 0;
+	int64			fss = 0;
 	MemoryContext old_ctx_m;
 
 	if (IsQueryDisabled())
@@ -222,7 +222,7 @@ aqo_get_parameterized_baserel_size(PlannerInfo *root,
 	int		   *args_hash;
 	int		   *eclass_hash;
 	int			current_hash;
-	int			fss = 0;
+	int64		fss = 0;
 	MemoryContext oldctx;
 
 	if (IsQueryDisabled())
@@ -308,7 +308,7 @@ aqo_set_joinrel_size_estimates(PlannerInfo *root, RelOptInfo *rel,
 	List	   *inner_selectivities;
 	List	   *outer_selectivities;
 	List	   *current_selectivities = NULL;
-	int			fss = 0;
+	int64		fss = 0;
 	MemoryContext old_ctx_m;
 
 	if (IsQueryDisabled())
@@ -381,7 +381,7 @@ aqo_get_parameterized_joinrel_size(PlannerInfo *root,
 	List	   *inner_selectivities;
 	List	   *outer_selectivities;
 	List	   *current_selectivities = NULL;
-	int			fss = 0;
+	int64		fss = 0;
 	MemoryContext old_ctx_m;
 
 	if (IsQueryDisabled())
@@ -428,11 +428,11 @@ default_estimator:
 
 static double
 predict_num_groups(PlannerInfo *root, Path *subpath, List *group_exprs,
-				   int *fss)
+				   int64 *fss)
 {
-	int			child_fss = 0;
+	int64		child_fss = 0;
 	double		prediction;
-	OkNNrdata	data;
+	OkNNrdata  *data;
 
 	if (subpath->parent->predicted_cardinality > 0.)
 		/* A fast path. Here we can use a fss hash of a leaf. */
@@ -450,13 +450,17 @@ predict_num_groups(PlannerInfo *root, Path *subpath, List *group_exprs,
 	}
 
 	*fss = get_grouped_exprs_hash(child_fss, group_exprs);
-	memset(&data, 0, sizeof(OkNNrdata));
+	data = OkNNr_allocate(0);
 
-	if (!load_fss_ext(query_context.fspace_hash, *fss, &data, NULL))
+	if (!load_fss_ext(query_context.fspace_hash, *fss, data, NULL))
+	{
+		OkNNr_free(data);
 		return -1;
+	}
 
-	Assert(data.rows == 1);
-	prediction = exp(data.targets[0]);
+	Assert(data->rows == 1);
+	prediction = exp(data->targets[0]);
+	OkNNr_free(data);
 	return (prediction <= 0) ? -1 : prediction;
 }
 
@@ -465,7 +469,7 @@ aqo_estimate_num_groups_hook(PlannerInfo *root, List *groupExprs,
 							 Path *subpath, RelOptInfo *grouped_rel,
 							 List **pgset, EstimationInfo *estinfo)
 {
-	int fss;
+	int64 fss;
 	double predicted;
 	MemoryContext old_ctx_m;
 
@@ -0,0 +1,265 @@
+/*
+ *******************************************************************************
+ *
+ *	BACKGROUND FLUSHING OF THE AQO STORAGE
+ *
+ * The checkpointer background worker writes changed AQO storages (statistics,
+ * query classes, query texts and ML data) to the disk each aqo.flush_interval
+ * seconds, or earlier if more than aqo.flush_dirty_size of changes were made
+ * since the last flush. While it is running, backends don't flush anything at
+ * exit, so the cost of writing doesn't land on client connections, and a crash
+ * loses only changes of the last interval.
+ *
+ * Between flushes, the checkpointer loads entries of the ML data file which
+ * haven't been looked up yet, so a backend rarely waits for reading of the
+ * file after a restart. It also evicts query classes when a backend asks for
+ * room in the full storage (see aqo_queries_admit()).
+ *
+ *******************************************************************************
+ *
+ * Copyright (c) 2016-2022, Postgres Professional
+ *
+ * IDENTIFICATION
+ *	  aqo/checkpointer.c
+ *
+ */
+
+#include "postgres.h"
+
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/shmem.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+#include "utils/wait_event.h"
+
+#include "aqo.h"
+#include "checkpointer.h"
+#include "storage.h"
+
+
+/* Flush interval (s) */
+int		aqo_flush_interval = 60;
+
+/* Size of changes (kB) which wakes the checkpointer up. Zero disables it */
+int		aqo_flush_dirty_size = 1024;
+
+/* Number of entries of the ML data file loaded at once */
+#define CHECKPOINTER_PREFETCH_BATCH	(1024)
+
+typedef struct CheckpointerState
+{
+	/*
+	 * NULL if the checkpointer isn't running. Read without a lock: latches of
+	 * processes live in the shared memory all the time, so a late SetLatch()
+	 * is harmless.
+	 */
+	Latch	   *latch;
+
+	/* Estimated size of changes since the last flush */
+	pg_atomic_uint64	dirty_bytes;
+} CheckpointerState;
+
+static CheckpointerState *checkpointer = NULL;
+
+Size
+checkpointer_memsize(void)
+{
+	return MAXALIGN(sizeof(CheckpointerState));
+}
+
+void
+checkpointer_init_shmem(void)
+{
+	bool	found;
+
+	checkpointer = ShmemInitStruct("AQO Checkpointer",
+								   checkpointer_memsize(), &found);
+	if (!found)
+	{
+		checkpointer->latch = NULL;
+		pg_atomic_init_u64(&checkpointer->dirty_bytes, 0);
+	}
+}
+
+/*
+ * Account a change of an AQO storage. Wake the checkpointer up if the size of
+ * changes has just crossed the threshold.
+ */
+void
+checkpointer_note_dirty(Size nbytes)
+{
+	uint64		threshold = (uint64) aqo_flush_dirty_size * 1024;
+	uint64		dirty;
+	Latch	   *latch;
+
+	if (checkpointer == NULL)
+		return;
+
+	dirty = pg_atomic_add_fetch_u64(&checkpointer->dirty_bytes, nbytes);
+
+	if (threshold == 0 || dirty < threshold || dirty - nbytes >= threshold)
+		return;
+
+	latch = checkpointer->latch;
+	if (latch != NULL)
+		SetLatch(latch);
+}
+
+/*
+ * Does the checkpointer take care of flushing the AQO storage?
+ */
+bool
+checkpointer_is_active(void)
+{
+	return checkpointer != NULL && checkpointer->latch != NULL;
+}
+
+/*
+ * Wake the checkpointer up to do a work requested by a backend.
+ * Return false if it isn't running.
+ */
+bool
+checkpointer_wakeup(void)
+{
+	Latch	   *latch;
+
+	if (checkpointer == NULL)
+		return false;
+
+	latch = checkpointer->latch;
+	if (latch == NULL)
+		return false;
+
+	SetLatch(latch);
+	return true;
+}
+
+void
+checkpointer_register_worker(void)
+{
+	BackgroundWorker	worker;
+
+	MemSet(&worker, 0, sizeof(worker));
+
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = 10;
+	worker.bgw_main_arg = Int32GetDatum(0);
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "aqo");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "aqo_checkpointer_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "aqo checkpointer");
+	snprintf(worker.bgw_type, BGW_MAXLEN, "aqo checkpointer");
+
+	RegisterBackgroundWorker(&worker);
+}
+
+static void
+checkpointer_detach(int code, Datum arg)
+{
+	checkpointer->latch = NULL;
+	pg_write_barrier();
+}
+
+/*
+ * Is it time to flush?
+ */
+static bool
+checkpointer_flush_due(TimestampTz last_flush)
+{
+	uint64	threshold = (uint64) aqo_flush_dirty_size * 1024;
+
+	if (threshold > 0 &&
+		pg_atomic_read_u64(&checkpointer->dirty_bytes) >= threshold)
+		return true;
+
+	return TimestampDifferenceExceeds(last_flush, GetCurrentTimestamp(),
+									  aqo_flush_interval * 1000);
+}
+
+/*
+ * Write all the changed storages. Changes made during the flush are counted
+ * for the next one.
+ */
+static void
+checkpointer_flush(void)
+{
+	pg_atomic_write_u64(&checkpointer->dirty_bytes, 0);
+
+	aqo_stat_flush();
+	aqo_queries_flush();
+	aqo_qtexts_flush();
+	aqo_data_flush();
+}
+
+/*
+ * Entry point of the checkpointer process.
+ */
+void
+aqo_checkpointer_main(Datum main_arg)
+{
+	MemoryContext	flush_ctx;
+	TimestampTz		last_flush = 0;
+	bool			prefetch = true;
+
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, SignalHandlerForShutdownRequest);
+	BackgroundWorkerUnblockSignals();
+
+	Assert(checkpointer != NULL);
+
+	flush_ctx = AllocSetContextCreate(AQOTopMemCtx,
+									  "AQO checkpointer",
+									  ALLOCSET_DEFAULT_SIZES);
+
+	checkpointer->latch = MyLatch;
+	pg_write_barrier();
+	before_shmem_exit(checkpointer_detach, (Datum) 0);
+
+	for (;;)
+	{
+		MemoryContext	oldctx;
+		long			timeout = aqo_flush_interval * 1000L;
+
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+
+		if (ConfigReloadPending)
+		{
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		oldctx = MemoryContextSwitchTo(flush_ctx);
+		if (ShutdownRequestPending || checkpointer_flush_due(last_flush))
+		{
+			checkpointer_flush();
+			last_flush = GetCurrentTimestamp();
+		}
+
+		/* The last flush is done above */
+		if (ShutdownRequestPending)
+			break;
+
+		(void) aqo_queries_evict_pending();
+
+		if (prefetch)
+			prefetch = aqo_data_prefetch(CHECKPOINTER_PREFETCH_BATCH);
+		MemoryContextSwitchTo(oldctx);
+		MemoryContextReset(flush_ctx);
+
+		if (prefetch)
+			/* Don't sleep until the file is loaded, just check interrupts */
+			timeout = 0;
+
+		(void) WaitLatch(MyLatch,
+						 WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 timeout, PG_WAIT_EXTENSION);
+	}
+
+	proc_exit(0);
+}
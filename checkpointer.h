@@ -0,0 +1,17 @@
+#ifndef CHECKPOINTER_H
+#define CHECKPOINTER_H
+
+extern int	aqo_flush_interval;
+extern int	aqo_flush_dirty_size;
+
+extern Size checkpointer_memsize(void);
+extern void checkpointer_init_shmem(void);
+extern void checkpointer_register_worker(void);
+
+extern void checkpointer_note_dirty(Size nbytes);
+extern bool checkpointer_is_active(void);
+extern bool checkpointer_wakeup(void);
+
+PGDLLEXPORT void aqo_checkpointer_main(Datum main_arg);
+
+#endif /* CHECKPOINTER_H */
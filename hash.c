@@ -22,20 +22,122 @@
 
 #include "access/htup.h"
 #include "common/fe_memutils.h"
+#include "miscadmin.h"
 
 #include "math.h"
 
 #include "aqo.h"
 #include "hash.h"
 
+/*
+ * Hash clauses by the old way: serialize a clause by nodeToString() and hash
+ * the text without constants and locations. Allows to use a knowledge base
+ * learned by previous versions: hashes of the two ways are different.
+ */
+bool		aqo_legacy_clause_hash = false;
+
+/*
+ * State of the structural hash of an expression tree. Node tags and fields
+ * are appended into the buffer, which is hashed down when it is full, like
+ * the core query jumbler does.
+ */
+#define NODE_HASH_BUFSIZE	(256)
+
+typedef struct NodeHashState
+{
+	unsigned char	buf[NODE_HASH_BUFSIZE];
+	Size			len;
+
+	/*
+	 * Arguments of the clause which are replaced by their equivalence classes
+	 * (see get_clause_hash()).
+	 */
+	List		   *eclass_args;
+	int				nargs;
+	int			   *args_hash;
+	int			   *eclass_hash;
+} NodeHashState;
+
+/*
+ * Planner-scoped cache of clause features, keyed by a RestrictInfo pointer.
+ * During the join search AQO passes the same clauses to get_fss_for_object()
+ * again and again: each joinrel gathers the clauses of its whole subtree. The
+ * cache allows to walk each clause tree once per planning.
+ *
+ * Only clauses allocated in the memory context of the planner are cached
+ * (see clause_cache_owns()): GEQO frees its short-lived contexts, so pointers
+ * into them can be reused by another RestrictInfo.
+ *
+ * A planning nested into another one (a function called through SPI during
+ * constant folding, for example) isn't cached at all: it falls back to walking
+ * the clauses each time, and the cache of the outer planning stays intact.
+ */
+typedef struct ClauseCacheEntry
+{
+	RestrictInfo   *rinfo;		/* hash key, must be first */
+
+	/* Copy of the clause with mutated subplans (see aqo_get_clauses()) */
+	RestrictInfo   *copy;
+
+	bool			filled;		/* are the fields below computed? */
+	int				hash;		/* clause hash without equivalence classes */
+	bool			has_consts;
+	bool			is_eq;
+	int				nargs;		/* number of non-constant arguments */
+	int			   *args_hash;	/* hashes of non-constant arguments */
+} ClauseCacheEntry;
+
+/*
+ * Clauses and selectivities gathered from the cheapest path of a scan or join
+ * relation (see get_path_clauses()). Lives in the same planner-scoped cache.
+ */
+typedef struct RelClausesEntry
+{
+	RelOptInfo	   *rel;		/* hash key, must be first */
+	Path		   *path;		/* cheapest path the lists are gathered from */
+	List		   *clauses;
+	List		   *selectivities;
+} RelClausesEntry;
+
+static MemoryContext AQOClauseCacheMemCtx = NULL;
+static MemoryContext clause_cache_owner = NULL;
+static int	clause_cache_depth = 0;	/* number of plannings in progress */
+static HTAB *clause_cache = NULL;
+static HTAB *rel_clauses_cache = NULL;
+
 static int	get_str_hash(const char *str);
 static int	get_node_hash(Node *node);
+static int	get_legacy_node_hash(Node *node);
+static int	get_legacy_clause_hash(Expr *clause, int nargs, int *args_hash,
+								   int *eclass_hash);
+static void node_hash_init(NodeHashState *state);
+static int	node_hash_final(NodeHashState *state);
+static void node_hash_append(NodeHashState *state, const void *item,
+							 Size size);
+static void node_hash_eclass(NodeHashState *state, int eclass);
+static void node_hash_walk(NodeHashState *state, Node *node);
+static HTAB *clause_cache_create(const char *name, Size keysize,
+								 Size entrysize);
+static ClauseCacheEntry *clause_cache_enter(RestrictInfo *rinfo);
+static ClauseCacheEntry *clause_cache_lookup(RestrictInfo *rinfo,
+											 ClauseCacheEntry *tmp);
+static void clause_cache_fill(ClauseCacheEntry *entry, Expr *clause);
+static int	get_cached_clause_hash(ClauseCacheEntry *entry, Expr *clause,
+								   int nargs, int *args_hash,
+								   int *eclass_hash);
+static int	get_eq_clause_hash(int arg_hash, int nargs, int *args_hash,
+							   int *eclass_hash);
+static ClauseCacheEntry **get_clauselist_entries(List *clauselist);
+static void get_entries_eclasses(ClauseCacheEntry **entries, int n,
+								 int *nargs, int **args_hash,
+								 int **eclass_hash);
 static int	get_unsorted_unsafe_int_array_hash(int *arr, int len);
 static int	get_unordered_int_list_hash(List *lst);
 
-static int get_relations_hash(List *relsigns);
-static int get_fss_hash(int clauses_hash, int eclasses_hash,
-			 int relidslist_hash);
+static int64 get_subspace_hash(int *arr, int len);
+static int64 get_relations_hash(List *relsigns);
+static int64 get_fss_hash(int64 clauses_hash, int64 eclasses_hash,
+			 int64 relidslist_hash);
 
 static char *replace_patterns(const char *str, const char *start_pattern,
 				 bool (*end_pattern) (char ch));
@@ -46,10 +148,12 @@ static int	get_id_in_sorted_int_array(int val, int n, int *arr);
 static int get_arg_eclass(int arg_hash, int nargs,
 			   int *args_hash, int *eclass_hash);
 
-static void get_clauselist_args(List *clauselist, int *nargs, int **args_hash);
+static void get_clauselist_args(ClauseCacheEntry **entries, int n,
+								int *nargs, int **args_hash);
 static int	disjoint_set_get_parent(int *p, int v);
 static void disjoint_set_merge_eclasses(int *p, int v1, int v2);
-static int *perform_eclasses_join(List *clauselist, int nargs, int *args_hash);
+static int *perform_eclasses_join(ClauseCacheEntry **entries, int n,
+								  int nargs, int *args_hash);
 
 static bool is_brace(char ch);
 static bool has_consts(List *lst);
@@ -135,13 +239,13 @@ ldelete_uint64(List *list, uint64 datum)
 
 /********************************************************************************/
 
-int
-get_grouped_exprs_hash(int child_fss, List *group_exprs)
+int64
+get_grouped_exprs_hash(int64 child_fss, List *group_exprs)
 {
 	ListCell	*lc;
 	int			*hashes = palloc(list_length(group_exprs) * sizeof(int));
 	int			i = 0;
-	int			final_hashes[2];
+	int64		final_hashes[2];
 
 	/* Calculate hash of each grouping expression. */
 	foreach(lc, group_exprs)
@@ -154,10 +258,20 @@ get_grouped_exprs_hash(int child_fss, List *group_exprs)
 	/* Sort to get rid of expressions permutation. */
 	qsort(hashes, i, sizeof(int), int_cmp);
 
+	if (aqo_legacy_clause_hash)
+	{
+		int		legacy_hashes[2];
+
+		legacy_hashes[0] = (int) child_fss;
+		legacy_hashes[1] = get_int_array_hash(hashes, i);
+		return get_int_array_hash(legacy_hashes, 2);
+	}
+
 	final_hashes[0] = child_fss;
-	final_hashes[1] = get_int_array_hash(hashes, i);
+	final_hashes[1] = get_subspace_hash(hashes, i);
 
-	return get_int_array_hash(final_hashes, 2);
+	return DatumGetInt64(hash_any_extended((const unsigned char *) final_hashes,
+										   sizeof(final_hashes), 0));
 }
 
 /*
@@ -169,11 +283,12 @@ get_grouped_exprs_hash(int child_fss, List *group_exprs)
  *
  * Special case for nfeatures == NULL: don't calculate features.
  */
-int
+int64
 get_fss_for_object(List *relsigns, List *clauselist,
 				   List *selectivities, int *nfeatures, double **features)
 {
 	int			n;
+	ClauseCacheEntry **entries;
 	int		   *clause_hashes;
 	int		   *sorted_clauses;
 	int		   *idx;
@@ -182,10 +297,9 @@ get_fss_for_object(List *relsigns, List *clauselist,
 	int			nargs;
 	int		   *args_hash;
 	int		   *eclass_hash;
-	int			clauses_hash;
-	int			eclasses_hash;
-	int			relations_hash;
-	List	  **args;
+	int64		clauses_hash;
+	int64		eclasses_hash;
+	int64		relations_hash;
 	ListCell   *lc;
 	int			i,
 				j,
@@ -193,7 +307,7 @@ get_fss_for_object(List *relsigns, List *clauselist,
 				m;
 	int			sh = 0,
 				old_sh;
-	int			fss_hash;
+	int64		fss_hash;
 
 	n = list_length(clauselist);
 
@@ -208,7 +322,8 @@ get_fss_for_object(List *relsigns, List *clauselist,
 	if (nfeatures != NULL)
 		*features = palloc0(sizeof(**features) * n);
 
-	get_eclasses(clauselist, &nargs, &args_hash, &eclass_hash);
+	entries = get_clauselist_entries(clauselist);
+	get_entries_eclasses(entries, n, &nargs, &args_hash, &eclass_hash);
 	clause_hashes = palloc(sizeof(*clause_hashes) * n);
 	clause_has_consts = palloc(sizeof(*clause_has_consts) * n);
 	sorted_clauses = palloc(sizeof(*sorted_clauses) * n);
@@ -218,10 +333,10 @@ get_fss_for_object(List *relsigns, List *clauselist,
 	{
 		RestrictInfo *rinfo = lfirst_node(RestrictInfo, lc);
 
-		clause_hashes[i] = get_clause_hash(rinfo->clause,
-										   nargs, args_hash, eclass_hash);
-		args = get_clause_args_ptr(rinfo->clause);
-		clause_has_consts[i] = (args != NULL && has_consts(*args));
+		clause_hashes[i] = get_cached_clause_hash(entries[i], rinfo->clause,
+												  nargs, args_hash,
+												  eclass_hash);
+		clause_has_consts[i] = entries[i]->has_consts;
 		i++;
 	}
 
@@ -277,8 +392,8 @@ get_fss_for_object(List *relsigns, List *clauselist,
 	 * Generate feature subspace hash.
 	 */
 
-	clauses_hash = get_int_array_hash(sorted_clauses, n - sh);
-	eclasses_hash = get_int_array_hash(eclass_hash, nargs);
+	clauses_hash = get_subspace_hash(sorted_clauses, n - sh);
+	eclasses_hash = get_subspace_hash(eclass_hash, nargs);
 	relations_hash = get_relations_hash(relsigns);
 	fss_hash = get_fss_hash(clauses_hash, eclasses_hash, relations_hash);
 
@@ -294,9 +409,336 @@ get_fss_for_object(List *relsigns, List *clauselist,
  * Computes hash for given clause.
  * Hash is supposed to be constant-insensitive.
  * Also args-order-insensitiveness for equal clause is required.
+ *
+ * Arguments which belong to an equivalence class are hashed as the class, so
+ * clauses over equal expressions get the same hash.
  */
 int
 get_clause_hash(Expr *clause, int nargs, int *args_hash, int *eclass_hash)
+{
+	List	  **args;
+	NodeHashState state;
+
+	if (aqo_legacy_clause_hash)
+		return get_legacy_clause_hash(clause, nargs, args_hash, eclass_hash);
+
+	args = get_clause_args_ptr(clause);
+	if (args == NULL)
+		return get_node_hash((Node *) clause);
+
+	if (clause_is_eq_clause(clause) && !has_consts(*args))
+		/* All the arguments are in one class: hash the first of them */
+		return get_eq_clause_hash(get_node_hash((Node *) linitial(*args)),
+								  nargs, args_hash, eclass_hash);
+
+	node_hash_init(&state);
+	state.eclass_args = *args;
+	state.nargs = nargs;
+	state.args_hash = args_hash;
+	state.eclass_hash = eclass_hash;
+	node_hash_walk(&state, (Node *) clause);
+	return node_hash_final(&state);
+}
+
+/*
+ * Hash of an equivalence clause without constants by the hash of its first
+ * argument.
+ */
+static int
+get_eq_clause_hash(int arg_hash, int nargs, int *args_hash, int *eclass_hash)
+{
+	NodeHashState	state;
+	int				arg_eclass;
+
+	arg_eclass = get_arg_eclass(arg_hash, nargs, args_hash, eclass_hash);
+	if (arg_eclass == 0)
+		return arg_hash;
+
+	node_hash_init(&state);
+	node_hash_eclass(&state, arg_eclass);
+	return node_hash_final(&state);
+}
+
+/*
+ * Computes hash for the clause by its cache entry. The tree of the clause is
+ * walked again only if some of its arguments are replaced by their equivalence
+ * classes.
+ */
+static int
+get_cached_clause_hash(ClauseCacheEntry *entry, Expr *clause,
+					   int nargs, int *args_hash, int *eclass_hash)
+{
+	int		i;
+
+	if (entry->is_eq && !entry->has_consts)
+	{
+		if (aqo_legacy_clause_hash)
+			return get_clause_hash(clause, nargs, args_hash, eclass_hash);
+		return get_eq_clause_hash(entry->args_hash[0],
+								  nargs, args_hash, eclass_hash);
+	}
+
+	for (i = 0; i < entry->nargs; i++)
+		if (get_arg_eclass(entry->args_hash[i],
+						   nargs, args_hash, eclass_hash) != 0)
+			return get_clause_hash(clause, nargs, args_hash, eclass_hash);
+
+	return entry->hash;
+}
+
+/*
+ * Start caching of clauses allocated in the current memory context. A nested
+ * planning only counts itself: it isn't cached.
+ *
+ * Each call must be paired with clause_cache_reset(), even on an error.
+ */
+void
+clause_cache_init(void)
+{
+	Assert(clause_cache_depth >= 0);
+
+	if (clause_cache_depth++ > 0)
+		return;
+
+	Assert(clause_cache_owner == NULL);
+	clause_cache_owner = CurrentMemoryContext;
+}
+
+/*
+ * Finish the planning started by clause_cache_init(). At the end of the
+ * outermost planning, forget all the cached clauses: the cache is keyed by
+ * pointers into the planner memory.
+ */
+void
+clause_cache_reset(void)
+{
+	Assert(clause_cache_depth > 0);
+
+	if (--clause_cache_depth > 0)
+		return;
+
+	clause_cache_owner = NULL;
+	clause_cache = NULL;
+	rel_clauses_cache = NULL;
+
+	if (AQOClauseCacheMemCtx != NULL)
+		MemoryContextReset(AQOClauseCacheMemCtx);
+}
+
+/*
+ * Can the planner node be cached? Only the outermost planning is cached.
+ */
+static inline bool
+clause_cache_owns(const void *node)
+{
+	return clause_cache_depth == 1 &&
+		   GetMemoryChunkContext((void *) node) == clause_cache_owner;
+}
+
+static HTAB *
+clause_cache_create(const char *name, Size keysize, Size entrysize)
+{
+	HASHCTL		ctl;
+
+	if (AQOClauseCacheMemCtx == NULL)
+		AQOClauseCacheMemCtx = AllocSetContextCreate(AQOTopMemCtx,
+													 "AQOClauseCacheMemCtx",
+													 ALLOCSET_DEFAULT_SIZES);
+
+	ctl.keysize = keysize;
+	ctl.entrysize = entrysize;
+	ctl.hcxt = AQOClauseCacheMemCtx;
+	return hash_create(name, 256, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+}
+
+/*
+ * Find or create the cache entry for the clause. Returns NULL if the clause
+ * can't be cached.
+ */
+static ClauseCacheEntry *
+clause_cache_enter(RestrictInfo *rinfo)
+{
+	ClauseCacheEntry   *entry;
+	bool				found;
+
+	if (!clause_cache_owns(rinfo))
+		return NULL;
+
+	if (clause_cache == NULL)
+		clause_cache = clause_cache_create("AQO clause cache",
+										   sizeof(RestrictInfo *),
+										   sizeof(ClauseCacheEntry));
+
+	entry = (ClauseCacheEntry *) hash_search(clause_cache, &rinfo,
+											 HASH_ENTER, &found);
+	if (!found)
+	{
+		entry->copy = NULL;
+		entry->filled = false;
+	}
+	return entry;
+}
+
+/*
+ * Returns the cache entry of the clause. If the clause can't be cached, tmp is
+ * filled and returned.
+ */
+static ClauseCacheEntry *
+clause_cache_lookup(RestrictInfo *rinfo, ClauseCacheEntry *tmp)
+{
+	ClauseCacheEntry   *entry = clause_cache_enter(rinfo);
+	MemoryContext		oldctx;
+
+	if (entry == NULL)
+	{
+		tmp->rinfo = rinfo;
+		tmp->copy = NULL;
+		clause_cache_fill(tmp, rinfo->clause);
+		return tmp;
+	}
+
+	if (!entry->filled)
+	{
+		oldctx = MemoryContextSwitchTo(AQOClauseCacheMemCtx);
+		clause_cache_fill(entry, rinfo->clause);
+		MemoryContextSwitchTo(oldctx);
+	}
+	return entry;
+}
+
+static void
+clause_cache_fill(ClauseCacheEntry *entry, Expr *clause)
+{
+	List	  **args = get_clause_args_ptr(clause);
+	ListCell   *lc;
+
+	/* Hash of the clause if no argument is replaced by an equivalence class */
+	entry->hash = get_node_hash((Node *) clause);
+	entry->is_eq = (args != NULL && clause_is_eq_clause(clause));
+	entry->has_consts = (args != NULL && has_consts(*args));
+	entry->nargs = 0;
+	entry->args_hash = NULL;
+
+	if (args != NULL)
+	{
+		entry->args_hash = palloc(list_length(*args) * sizeof(int));
+		foreach(lc, *args)
+			if (!IsA(lfirst(lc), Const))
+				entry->args_hash[entry->nargs++] = get_node_hash(lfirst(lc));
+	}
+	entry->filled = true;
+}
+
+/*
+ * Returns the copy of the clause made earlier in this planning, or NULL. In
+ * the last case copycxt is set to the memory context for a new copy: the
+ * cached copy must live as long as the clause itself.
+ */
+RestrictInfo *
+clause_cache_get_copy(RestrictInfo *rinfo, MemoryContext *copycxt)
+{
+	ClauseCacheEntry   *entry = clause_cache_enter(rinfo);
+
+	if (entry == NULL)
+	{
+		*copycxt = CurrentMemoryContext;
+		return NULL;
+	}
+
+	*copycxt = clause_cache_owner;
+	return entry->copy;
+}
+
+void
+clause_cache_set_copy(RestrictInfo *rinfo, RestrictInfo *copy)
+{
+	ClauseCacheEntry   *entry = clause_cache_enter(rinfo);
+
+	if (entry != NULL)
+		entry->copy = copy;
+}
+
+/*
+ * Returns copies of the clause and selectivity lists, gathered earlier from
+ * the given cheapest path of the relation.
+ */
+bool
+clause_cache_get_rel(RelOptInfo *rel, Path *path, List **clauses,
+					 List **selectivities)
+{
+	RelClausesEntry	   *entry;
+
+	if (rel_clauses_cache == NULL || !clause_cache_owns(rel))
+		return false;
+
+	entry = (RelClausesEntry *) hash_search(rel_clauses_cache, &rel,
+											HASH_FIND, NULL);
+	if (entry == NULL || entry->path != path)
+		return false;
+
+	*clauses = list_copy(entry->clauses);
+	*selectivities = list_copy(entry->selectivities);
+	return true;
+}
+
+/*
+ * Remember clauses and selectivities of the relation's cheapest path. The
+ * clauses are the shared copies made by aqo_get_clauses() or the planner's
+ * own RestrictInfos, so only the lists and selectivities are copied.
+ */
+void
+clause_cache_set_rel(RelOptInfo *rel, Path *path, List *clauses,
+					 List *selectivities)
+{
+	RelClausesEntry	   *entry;
+	MemoryContext		oldctx;
+	ListCell		   *lc;
+
+	if (!clause_cache_owns(rel))
+		return;
+
+	if (rel_clauses_cache == NULL)
+		rel_clauses_cache = clause_cache_create("AQO relation clauses cache",
+												sizeof(RelOptInfo *),
+												sizeof(RelClausesEntry));
+
+	entry = (RelClausesEntry *) hash_search(rel_clauses_cache, &rel,
+											HASH_ENTER, NULL);
+	oldctx = MemoryContextSwitchTo(AQOClauseCacheMemCtx);
+	entry->path = path;
+	entry->clauses = list_copy(clauses);
+	entry->selectivities = NIL;
+	foreach(lc, selectivities)
+	{
+		double	   *sel = palloc(sizeof(*sel));
+
+		*sel = *((double *) lfirst(lc));
+		entry->selectivities = lappend(entry->selectivities, sel);
+	}
+	MemoryContextSwitchTo(oldctx);
+}
+
+static ClauseCacheEntry **
+get_clauselist_entries(List *clauselist)
+{
+	int					n = list_length(clauselist);
+	ClauseCacheEntry  **entries = palloc(n * sizeof(*entries));
+	ClauseCacheEntry   *tmp = palloc(n * sizeof(*tmp));
+	ListCell		   *lc;
+	int					i = 0;
+
+	foreach(lc, clauselist)
+	{
+		entries[i] = clause_cache_lookup(lfirst_node(RestrictInfo, lc),
+										 &tmp[i]);
+		i++;
+	}
+	return entries;
+}
+
+static int
+get_legacy_clause_hash(Expr *clause, int nargs, int *args_hash,
+					   int *eclass_hash)
 {
 	Expr	   *cclause;
 	List	  **args = get_clause_args_ptr(clause);
@@ -304,13 +746,13 @@ get_clause_hash(Expr *clause, int nargs, int *args_hash, int *eclass_hash)
 	ListCell   *l;
 
 	if (args == NULL)
-		return get_node_hash((Node *) clause);
+		return get_legacy_node_hash((Node *) clause);
 
 	cclause = copyObject(clause);
 	args = get_clause_args_ptr(cclause);
 	foreach(l, *args)
 	{
-		arg_eclass = get_arg_eclass(get_node_hash(lfirst(l)),
+		arg_eclass = get_arg_eclass(get_legacy_node_hash(lfirst(l)),
 									nargs, args_hash, eclass_hash);
 		if (arg_eclass != 0)
 		{
@@ -319,8 +761,8 @@ get_clause_hash(Expr *clause, int nargs, int *args_hash, int *eclass_hash)
 		}
 	}
 	if (!clause_is_eq_clause(clause) || has_consts(*args))
-		return get_node_hash((Node *) cclause);
-	return get_node_hash((Node *) linitial(*args));
+		return get_legacy_node_hash((Node *) cclause);
+	return get_legacy_node_hash((Node *) linitial(*args));
 }
 
 /*
@@ -338,6 +780,22 @@ get_str_hash(const char *str)
  */
 static int
 get_node_hash(Node *node)
+{
+	NodeHashState	state;
+
+	if (aqo_legacy_clause_hash)
+		return get_legacy_node_hash(node);
+
+	node_hash_init(&state);
+	node_hash_walk(&state, node);
+	return node_hash_final(&state);
+}
+
+/*
+ * Computes hash for given node by its text representation.
+ */
+static int
+get_legacy_node_hash(Node *node)
 {
 	char	   *str;
 	int			hash;
@@ -348,6 +806,475 @@ get_node_hash(Node *node)
 	return hash;
 }
 
+static void
+node_hash_init(NodeHashState *state)
+{
+	state->len = 0;
+	state->eclass_args = NIL;
+	state->nargs = 0;
+	state->args_hash = NULL;
+	state->eclass_hash = NULL;
+}
+
+static int
+node_hash_final(NodeHashState *state)
+{
+	return DatumGetInt32(hash_any(state->buf, state->len));
+}
+
+/*
+ * Append the item into the buffer. If the buffer is full, it is replaced by
+ * its hash.
+ */
+static void
+node_hash_append(NodeHashState *state, const void *item, Size size)
+{
+	const unsigned char *ptr = (const unsigned char *) item;
+
+	while (size > 0)
+	{
+		Size	part;
+
+		if (state->len >= NODE_HASH_BUFSIZE)
+		{
+			uint32	hash = DatumGetUInt32(hash_any(state->buf, state->len));
+
+			memcpy(state->buf, &hash, sizeof(hash));
+			state->len = sizeof(hash);
+		}
+
+		part = Min(size, NODE_HASH_BUFSIZE - state->len);
+		memcpy(state->buf + state->len, ptr, part);
+		state->len += part;
+		ptr += part;
+		size -= part;
+	}
+}
+
+#define HASH_FIELD(item) \
+	node_hash_append(state, &(item), sizeof(item))
+#define HASH_STRING(str) \
+	node_hash_append(state, (str), strlen(str) + 1)
+#define HASH_NODE(item) \
+	node_hash_walk(state, (Node *) (item))
+
+/*
+ * Marks an argument replaced by its equivalence class. It follows T_Invalid,
+ * which otherwise stands for a NULL node, and is not a node tag, so the class
+ * never aliases a real node, like a Param with the same id.
+ */
+#define NODE_HASH_ECLASS_MARKER	(PG_UINT32_MAX)
+
+/*
+ * Argument of a clause which is replaced by its equivalence class.
+ */
+static void
+node_hash_eclass(NodeHashState *state, int eclass)
+{
+	NodeTag		tag = T_Invalid;
+	uint32		marker = NODE_HASH_ECLASS_MARKER;
+
+	HASH_FIELD(tag);
+	HASH_FIELD(marker);
+	HASH_FIELD(eclass);
+}
+
+/*
+ * Append tags and fields of the expression tree into the hash. Only fields
+ * which define the semantics of an expression are used: values of constants,
+ * locations and cached lookups (like opfuncid) are skipped. Nodes which can't
+ * be met in clauses of a plan are hashed by the legacy way.
+ */
+static void
+node_hash_walk(NodeHashState *state, Node *node)
+{
+	NodeTag		tag;
+	ListCell   *lc;
+
+	check_stack_depth();
+
+	if (node == NULL)
+	{
+		tag = T_Invalid;
+		HASH_FIELD(tag);
+		return;
+	}
+
+	tag = nodeTag(node);
+	HASH_FIELD(tag);
+
+	switch (tag)
+	{
+		case T_List:
+			foreach(lc, (List *) node)
+			{
+				Node   *arg = (Node *) lfirst(lc);
+				int		arg_eclass = 0;
+
+				if ((List *) node == state->eclass_args)
+					arg_eclass = get_arg_eclass(get_node_hash(arg),
+												state->nargs, state->args_hash,
+												state->eclass_hash);
+
+				if (arg_eclass != 0)
+					node_hash_eclass(state, arg_eclass);
+				else
+					HASH_NODE(arg);
+			}
+			break;
+		case T_IntList:
+			foreach(lc, (List *) node)
+				HASH_FIELD(lfirst_int(lc));
+			break;
+		case T_OidList:
+			foreach(lc, (List *) node)
+				HASH_FIELD(lfirst_oid(lc));
+			break;
+		case T_Var:
+			{
+				Var		   *var = (Var *) node;
+
+				HASH_FIELD(var->varno);
+				HASH_FIELD(var->varattno);
+				HASH_FIELD(var->vartype);
+				HASH_FIELD(var->varcollid);
+				HASH_FIELD(var->varlevelsup);
+			}
+			break;
+		case T_Const:
+			/* The value and even the type of a constant don't matter */
+			break;
+		case T_Param:
+			{
+				Param	   *param = (Param *) node;
+
+				HASH_FIELD(param->paramkind);
+				HASH_FIELD(param->paramid);
+				HASH_FIELD(param->paramtype);
+			}
+			break;
+		case T_Aggref:
+			{
+				Aggref	   *expr = (Aggref *) node;
+
+				HASH_FIELD(expr->aggfnoid);
+				HASH_NODE(expr->aggdirectargs);
+				HASH_NODE(expr->args);
+				HASH_NODE(expr->aggorder);
+				HASH_NODE(expr->aggdistinct);
+				HASH_NODE(expr->aggfilter);
+			}
+			break;
+		case T_GroupingFunc:
+			{
+				GroupingFunc *grpnode = (GroupingFunc *) node;
+
+				HASH_NODE(grpnode->refs);
+				HASH_FIELD(grpnode->agglevelsup);
+			}
+			break;
+		case T_WindowFunc:
+			{
+				WindowFunc *expr = (WindowFunc *) node;
+
+				HASH_FIELD(expr->winfnoid);
+				HASH_FIELD(expr->winref);
+				HASH_NODE(expr->args);
+				HASH_NODE(expr->aggfilter);
+			}
+			break;
+		case T_SubscriptingRef:
+			{
+				SubscriptingRef *sbsref = (SubscriptingRef *) node;
+
+				HASH_FIELD(sbsref->refcontainertype);
+				HASH_NODE(sbsref->refupperindexpr);
+				HASH_NODE(sbsref->reflowerindexpr);
+				HASH_NODE(sbsref->refexpr);
+				HASH_NODE(sbsref->refassgnexpr);
+			}
+			break;
+		case T_FuncExpr:
+			{
+				FuncExpr   *expr = (FuncExpr *) node;
+
+				HASH_FIELD(expr->funcid);
+				HASH_NODE(expr->args);
+			}
+			break;
+		case T_NamedArgExpr:
+			{
+				NamedArgExpr *nae = (NamedArgExpr *) node;
+
+				HASH_FIELD(nae->argnumber);
+				HASH_NODE(nae->arg);
+			}
+			break;
+		case T_OpExpr:
+		case T_DistinctExpr:	/* struct-equivalent to OpExpr */
+		case T_NullIfExpr:		/* struct-equivalent to OpExpr */
+			{
+				OpExpr	   *expr = (OpExpr *) node;
+
+				HASH_FIELD(expr->opno);
+				HASH_NODE(expr->args);
+			}
+			break;
+		case T_ScalarArrayOpExpr:
+			{
+				ScalarArrayOpExpr *expr = (ScalarArrayOpExpr *) node;
+
+				HASH_FIELD(expr->opno);
+				HASH_FIELD(expr->useOr);
+				HASH_NODE(expr->args);
+			}
+			break;
+		case T_BoolExpr:
+			{
+				BoolExpr   *expr = (BoolExpr *) node;
+
+				HASH_FIELD(expr->boolop);
+				HASH_NODE(expr->args);
+			}
+			break;
+		case T_SubPlan:
+			{
+				SubPlan    *subplan = (SubPlan *) node;
+
+				HASH_FIELD(subplan->subLinkType);
+				HASH_FIELD(subplan->plan_id);
+				HASH_NODE(subplan->testexpr);
+				HASH_NODE(subplan->paramIds);
+				HASH_NODE(subplan->setParam);
+				HASH_NODE(subplan->parParam);
+				HASH_NODE(subplan->args);
+			}
+			break;
+		case T_AlternativeSubPlan:
+			HASH_NODE(((AlternativeSubPlan *) node)->subplans);
+			break;
+		case T_FieldSelect:
+			{
+				FieldSelect *fs = (FieldSelect *) node;
+
+				HASH_FIELD(fs->fieldnum);
+				HASH_FIELD(fs->resulttype);
+				HASH_NODE(fs->arg);
+			}
+			break;
+		case T_FieldStore:
+			{
+				FieldStore *fstore = (FieldStore *) node;
+
+				HASH_NODE(fstore->arg);
+				HASH_NODE(fstore->newvals);
+				HASH_NODE(fstore->fieldnums);
+			}
+			break;
+		case T_RelabelType:
+			{
+				RelabelType *rt = (RelabelType *) node;
+
+				HASH_FIELD(rt->resulttype);
+				HASH_NODE(rt->arg);
+			}
+			break;
+		case T_CoerceViaIO:
+			{
+				CoerceViaIO *cio = (CoerceViaIO *) node;
+
+				HASH_FIELD(cio->resulttype);
+				HASH_NODE(cio->arg);
+			}
+			break;
+		case T_ArrayCoerceExpr:
+			{
+				ArrayCoerceExpr *acexpr = (ArrayCoerceExpr *) node;
+
+				HASH_FIELD(acexpr->resulttype);
+				HASH_NODE(acexpr->arg);
+				HASH_NODE(acexpr->elemexpr);
+			}
+			break;
+		case T_ConvertRowtypeExpr:
+			{
+				ConvertRowtypeExpr *crexpr = (ConvertRowtypeExpr *) node;
+
+				HASH_FIELD(crexpr->resulttype);
+				HASH_NODE(crexpr->arg);
+			}
+			break;
+		case T_CollateExpr:
+			{
+				CollateExpr *ce = (CollateExpr *) node;
+
+				HASH_FIELD(ce->collOid);
+				HASH_NODE(ce->arg);
+			}
+			break;
+		case T_CaseExpr:
+			{
+				CaseExpr   *caseexpr = (CaseExpr *) node;
+
+				HASH_FIELD(caseexpr->casetype);
+				HASH_NODE(caseexpr->arg);
+				HASH_NODE(caseexpr->args);
+				HASH_NODE(caseexpr->defresult);
+			}
+			break;
+		case T_CaseWhen:
+			{
+				CaseWhen   *when = (CaseWhen *) node;
+
+				HASH_NODE(when->expr);
+				HASH_NODE(when->result);
+			}
+			break;
+		case T_CaseTestExpr:
+			HASH_FIELD(((CaseTestExpr *) node)->typeId);
+			break;
+		case T_ArrayExpr:
+			{
+				ArrayExpr  *arrayexpr = (ArrayExpr *) node;
+
+				HASH_FIELD(arrayexpr->array_typeid);
+				HASH_NODE(arrayexpr->elements);
+			}
+			break;
+		case T_RowExpr:
+			{
+				RowExpr    *rowexpr = (RowExpr *) node;
+
+				HASH_FIELD(rowexpr->row_typeid);
+				HASH_NODE(rowexpr->args);
+			}
+			break;
+		case T_RowCompareExpr:
+			{
+				RowCompareExpr *rcexpr = (RowCompareExpr *) node;
+
+				HASH_FIELD(rcexpr->rctype);
+				HASH_NODE(rcexpr->opnos);
+				HASH_NODE(rcexpr->largs);
+				HASH_NODE(rcexpr->rargs);
+			}
+			break;
+		case T_CoalesceExpr:
+			{
+				CoalesceExpr *coalesce = (CoalesceExpr *) node;
+
+				HASH_FIELD(coalesce->coalescetype);
+				HASH_NODE(coalesce->args);
+			}
+			break;
+		case T_MinMaxExpr:
+			{
+				MinMaxExpr *mmexpr = (MinMaxExpr *) node;
+
+				HASH_FIELD(mmexpr->minmaxtype);
+				HASH_FIELD(mmexpr->op);
+				HASH_NODE(mmexpr->args);
+			}
+			break;
+		case T_SQLValueFunction:
+			{
+				SQLValueFunction *svf = (SQLValueFunction *) node;
+
+				HASH_FIELD(svf->op);
+				HASH_FIELD(svf->typmod);
+			}
+			break;
+		case T_NullTest:
+			{
+				NullTest   *nt = (NullTest *) node;
+
+				HASH_FIELD(nt->nulltesttype);
+				HASH_FIELD(nt->argisrow);
+				HASH_NODE(nt->arg);
+			}
+			break;
+		case T_BooleanTest:
+			{
+				BooleanTest *bt = (BooleanTest *) node;
+
+				HASH_FIELD(bt->booltesttype);
+				HASH_NODE(bt->arg);
+			}
+			break;
+		case T_CoerceToDomain:
+			{
+				CoerceToDomain *cd = (CoerceToDomain *) node;
+
+				HASH_FIELD(cd->resulttype);
+				HASH_NODE(cd->arg);
+			}
+			break;
+		case T_CoerceToDomainValue:
+			HASH_FIELD(((CoerceToDomainValue *) node)->typeId);
+			break;
+		case T_SetToDefault:
+			HASH_FIELD(((SetToDefault *) node)->typeId);
+			break;
+		case T_CurrentOfExpr:
+			{
+				CurrentOfExpr *ce = (CurrentOfExpr *) node;
+
+				HASH_FIELD(ce->cvarno);
+				if (ce->cursor_name)
+					HASH_STRING(ce->cursor_name);
+				HASH_FIELD(ce->cursor_param);
+			}
+			break;
+		case T_NextValueExpr:
+			{
+				NextValueExpr *nve = (NextValueExpr *) node;
+
+				HASH_FIELD(nve->seqid);
+				HASH_FIELD(nve->typeId);
+			}
+			break;
+		case T_PlaceHolderVar:
+			{
+				PlaceHolderVar *phv = (PlaceHolderVar *) node;
+
+				HASH_FIELD(phv->phid);
+				HASH_FIELD(phv->phlevelsup);
+				HASH_NODE(phv->phexpr);
+			}
+			break;
+		case T_RestrictInfo:
+			HASH_NODE(((RestrictInfo *) node)->clause);
+			break;
+		case T_SortGroupClause:
+			{
+				SortGroupClause *sgc = (SortGroupClause *) node;
+
+				HASH_FIELD(sgc->tleSortGroupRef);
+				HASH_FIELD(sgc->eqop);
+				HASH_FIELD(sgc->sortop);
+				HASH_FIELD(sgc->nulls_first);
+			}
+			break;
+		case T_TargetEntry:
+			{
+				TargetEntry *tle = (TargetEntry *) node;
+
+				HASH_FIELD(tle->resno);
+				HASH_FIELD(tle->ressortgroupref);
+				HASH_NODE(tle->expr);
+			}
+			break;
+		default:
+			{
+				/* Rare node: hash its text */
+				int		hash = get_legacy_node_hash(node);
+
+				HASH_FIELD(hash);
+			}
+			break;
+	}
+}
+
 /*
  * Computes hash for given array of ints.
  */
@@ -429,17 +1356,47 @@ replace_patterns(const char *str, const char *start_pattern,
 /*
  * Computes hash for given feature subspace.
  * Hash is supposed to be clause-order-insensitive.
+ *
+ * The hash has 64 bits: with hundreds of thousands of subspaces in a knowledge
+ * base, 32-bit hashes collide, and a collision silently mixes the data of two
+ * subspaces. In the legacy mode the hash is computed by 32 bits, as the
+ * previous versions did, to find the data learned by them.
  */
-int
-get_fss_hash(int clauses_hash, int eclasses_hash, int relidslist_hash)
+int64
+get_fss_hash(int64 clauses_hash, int64 eclasses_hash, int64 relidslist_hash)
 {
-	int			hashes[3];
+	int64		hashes[3];
+
+	if (aqo_legacy_clause_hash)
+	{
+		int		legacy_hashes[3];
+
+		legacy_hashes[0] = (int) clauses_hash;
+		legacy_hashes[1] = (int) eclasses_hash;
+		legacy_hashes[2] = (int) relidslist_hash;
+		return DatumGetInt32(hash_any((const unsigned char *) legacy_hashes,
+									  3 * sizeof(*legacy_hashes)));
+	}
 
 	hashes[0] = clauses_hash;
 	hashes[1] = eclasses_hash;
 	hashes[2] = relidslist_hash;
-	return DatumGetInt32(hash_any((const unsigned char *) hashes,
-								  3 * sizeof(*hashes)));
+	return DatumGetInt64(hash_any_extended((const unsigned char *) hashes,
+										   3 * sizeof(*hashes), 0));
+}
+
+/*
+ * Computes hash for given array of ints, which is a part of a feature subspace
+ * hash (see get_fss_hash()).
+ */
+static int64
+get_subspace_hash(int *arr, int len)
+{
+	if (aqo_legacy_clause_hash)
+		return get_int_array_hash(arr, len);
+
+	return DatumGetInt64(hash_any_extended((const unsigned char *) arr,
+										   len * sizeof(*arr), 0));
 }
 
 /*
@@ -447,13 +1404,13 @@ get_fss_hash(int clauses_hash, int eclasses_hash, int relidslist_hash)
  * Hash is supposed to be relations-order-insensitive.
  * Each element of a list must have a String type,
  */
-static int
+static int64
 get_relations_hash(List *relsigns)
 {
 	int			nhashes = 0;
 	uint32	   *hashes = palloc(list_length(relsigns) * sizeof(uint32));
 	ListCell   *lc;
-	int			result;
+	int64		result;
 
 	foreach(lc, relsigns)
 	{
@@ -465,8 +1422,7 @@ get_relations_hash(List *relsigns)
 
 	/* Make a final hash value */
 
-	result = DatumGetInt32(hash_any((const unsigned char *) hashes,
-									nhashes * sizeof(uint32)));
+	result = get_subspace_hash((int *) hashes, nhashes);
 
 	return result;
 }
@@ -534,36 +1490,24 @@ get_arg_eclass(int arg_hash, int nargs, int *args_hash, int *eclass_hash)
  * of given clauselist.
  */
 void
-get_clauselist_args(List *clauselist, int *nargs, int **args_hash)
+get_clauselist_args(ClauseCacheEntry **entries, int n,
+					int *nargs, int **args_hash)
 {
-	RestrictInfo *rinfo;
-	List	  **args;
-	ListCell   *l;
-	ListCell   *l2;
 	int			i = 0;
+	int			j;
+	int			k;
 	int			sh = 0;
 	int			cnt = 0;
 
-	foreach(l, clauselist)
-	{
-		rinfo = (RestrictInfo *) lfirst(l);
-		args = get_clause_args_ptr(rinfo->clause);
-		if (args != NULL && clause_is_eq_clause(rinfo->clause))
-			foreach(l2, *args)
-				if (!IsA(lfirst(l2), Const))
-				cnt++;
-	}
+	for (j = 0; j < n; j++)
+		if (entries[j]->is_eq)
+			cnt += entries[j]->nargs;
 
 	*args_hash = palloc(cnt * sizeof(**args_hash));
-	foreach(l, clauselist)
-	{
-		rinfo = (RestrictInfo *) lfirst(l);
-		args = get_clause_args_ptr(rinfo->clause);
-		if (args != NULL && clause_is_eq_clause(rinfo->clause))
-			foreach(l2, *args)
-				if (!IsA(lfirst(l2), Const))
-				(*args_hash)[i++] = get_node_hash(lfirst(l2));
-	}
+	for (j = 0; j < n; j++)
+		if (entries[j]->is_eq)
+			for (k = 0; k < entries[j]->nargs; k++)
+				(*args_hash)[i++] = entries[j]->args_hash[k];
 	qsort(*args_hash, cnt, sizeof(**args_hash), int_cmp);
 
 	for (i = 1; i < cnt; ++i)
@@ -612,38 +1556,31 @@ disjoint_set_merge_eclasses(int *p, int v1, int v2)
  * Constructs disjoint set on arguments.
  */
 int *
-perform_eclasses_join(List *clauselist, int nargs, int *args_hash)
+perform_eclasses_join(ClauseCacheEntry **entries, int n,
+					  int nargs, int *args_hash)
 {
-	RestrictInfo *rinfo;
 	int		   *p;
-	ListCell   *l,
-			   *l2;
-	List	  **args;
-	int			h2;
+	int			j,
+				k;
 	int			i2,
 				i3;
 
 	p = palloc(nargs * sizeof(*p));
 	memset(p, -1, nargs * sizeof(*p));
 
-	foreach(l, clauselist)
+	for (j = 0; j < n; j++)
 	{
-		rinfo = (RestrictInfo *) lfirst(l);
-		args = get_clause_args_ptr(rinfo->clause);
-		if (args != NULL && clause_is_eq_clause(rinfo->clause))
+		if (!entries[j]->is_eq)
+			continue;
+
+		i3 = -1;
+		for (k = 0; k < entries[j]->nargs; k++)
 		{
-			i3 = -1;
-			foreach(l2, *args)
-			{
-				if (!IsA(lfirst(l2), Const))
-				{
-					h2 = get_node_hash(lfirst(l2));
-					i2 = get_id_in_sorted_int_array(h2, nargs, args_hash);
-					if (i3 != -1)
-						disjoint_set_merge_eclasses(p, i2, i3);
-					i3 = i2;
-				}
-			}
+			i2 = get_id_in_sorted_int_array(entries[j]->args_hash[k],
+											nargs, args_hash);
+			if (i3 != -1)
+				disjoint_set_merge_eclasses(p, i2, i3);
+			i3 = i2;
 		}
 	}
 
@@ -656,6 +1593,15 @@ perform_eclasses_join(List *clauselist, int nargs, int *args_hash)
  */
 void
 get_eclasses(List *clauselist, int *nargs, int **args_hash, int **eclass_hash)
+{
+	get_entries_eclasses(get_clauselist_entries(clauselist),
+						 list_length(clauselist),
+						 nargs, args_hash, eclass_hash);
+}
+
+static void
+get_entries_eclasses(ClauseCacheEntry **entries, int n,
+					 int *nargs, int **args_hash, int **eclass_hash)
 {
 	int		   *p;
 	List	  **lsts;
@@ -663,10 +1609,10 @@ get_eclasses(List *clauselist, int *nargs, int **args_hash, int **eclass_hash)
 				v;
 	int		   *e_hashes;
 
-	get_clauselist_args(clauselist, nargs, args_hash);
+	get_clauselist_args(entries, n, nargs, args_hash);
 	*eclass_hash = palloc((*nargs) * sizeof(**eclass_hash));
 
-	p = perform_eclasses_join(clauselist, *nargs, *args_hash);
+	p = perform_eclasses_join(entries, n, *nargs, *args_hash);
 	lsts = palloc((*nargs) * sizeof(*lsts));
 	e_hashes = palloc((*nargs) * sizeof(*e_hashes));
 
@@ -1,16 +1,27 @@
 #ifndef AQO_HASH_H
 #define AQO_HASH_H
 
+#include "nodes/pathnodes.h"
 #include "nodes/pg_list.h"
 
 extern bool list_member_uint64(const List *list, uint64 datum);
 extern List *list_copy_uint64(List *list);
 extern List *lappend_uint64(List *list, uint64 datum);
 extern List *ldelete_uint64(List *list, uint64 datum);
-extern int get_fss_for_object(List *relsigns, List *clauselist,
-							  List *selectivities, int *nfeatures,
-							  double **features);
+extern int64 get_fss_for_object(List *relsigns, List *clauselist,
+								List *selectivities, int *nfeatures,
+								double **features);
 extern int get_int_array_hash(int *arr, int len);
-extern int get_grouped_exprs_hash(int fss, List *group_exprs);
+extern int64 get_grouped_exprs_hash(int64 fss, List *group_exprs);
+
+extern void clause_cache_init(void);
+extern void clause_cache_reset(void);
+extern RestrictInfo *clause_cache_get_copy(RestrictInfo *rinfo,
+										   MemoryContext *copycxt);
+extern void clause_cache_set_copy(RestrictInfo *rinfo, RestrictInfo *copy);
+extern bool clause_cache_get_rel(RelOptInfo *rel, Path *path, List **clauses,
+								 List **selectivities);
+extern void clause_cache_set_rel(RelOptInfo *rel, Path *path, List *clauses,
+								 List *selectivities);
 
 #endif							/* AQO_HASH_H */
\ No newline at end of file
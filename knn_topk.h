@@ -0,0 +1,125 @@
+/*
+ *******************************************************************************
+ *
+ *	SELECTION OF NEAREST NEIGHBORS
+ *
+ * Bounded max-heap selection of k smallest distances. It is kept apart from
+ * machine_learning.c and doesn't depend on the DBMS headers, so it can be
+ * compiled into the standalone micro-benchmark (see bench/knn_topk_bench.c).
+ *
+ *******************************************************************************
+ *
+ * Copyright (c) 2016-2022, Postgres Professional
+ *
+ * IDENTIFICATION
+ *	  aqo/knn_topk.h
+ *
+ */
+#ifndef KNN_TOPK_H
+#define KNN_TOPK_H
+
+/*
+ * Order of rows in the heap: the row a is "farther" than the row b if it has
+ * larger distance or the same distance, but larger index. So, of two rows on
+ * equal distance the earlier one is preferred.
+ */
+static inline int
+knn_farther(const double *distances, int a, int b)
+{
+	return distances[a] > distances[b] ||
+		(distances[a] == distances[b] && a > b);
+}
+
+static inline void
+knn_sift_down(const double *distances, int *heap, int size, int pos)
+{
+	for (;;)
+	{
+		int		largest = pos;
+		int		left = 2 * pos + 1;
+		int		right = left + 1;
+		int		tmp;
+
+		if (left < size && knn_farther(distances, heap[left], heap[largest]))
+			largest = left;
+		if (right < size && knn_farther(distances, heap[right], heap[largest]))
+			largest = right;
+		if (largest == pos)
+			break;
+
+		tmp = heap[pos];
+		heap[pos] = heap[largest];
+		heap[largest] = tmp;
+		pos = largest;
+	}
+}
+
+/*
+ * Find k nearest rows by the array of distances.
+ *
+ * Stores indexes of the rows into idx[] sorted by ascending distance (ties are
+ * resolved in favour of the lower index) and returns the number of stored
+ * indexes, which is min(k, nrows). Costs O(nrows * log(k)) if k < nrows.
+ */
+static inline int
+knn_select_nearest(const double *distances, int nrows, int k, int *idx)
+{
+	int		n = (k < nrows) ? k : nrows;
+	int		i;
+
+	if (n <= 0)
+		return 0;
+
+	if (n == nrows)
+	{
+		/*
+		 * All rows are selected, just sort them. Insertion sort is stable and
+		 * has the lowest overhead at the sizes of the matrix we deal with.
+		 */
+		for (i = 0; i < n; ++i)
+		{
+			int		j = i;
+
+			while (j > 0 && distances[idx[j - 1]] > distances[i])
+			{
+				idx[j] = idx[j - 1];
+				j--;
+			}
+			idx[j] = i;
+		}
+		return n;
+	}
+
+	/* Build max-heap from the first n rows */
+	for (i = 0; i < n; ++i)
+		idx[i] = i;
+	for (i = n / 2 - 1; i >= 0; --i)
+		knn_sift_down(distances, idx, n, i);
+
+	/*
+	 * The rest of rows can only replace the farthest selected one. The row
+	 * with the same distance isn't closer, because it has larger index.
+	 */
+	for (i = n; i < nrows; ++i)
+	{
+		if (distances[i] < distances[idx[0]])
+		{
+			idx[0] = i;
+			knn_sift_down(distances, idx, n, 0);
+		}
+	}
+
+	/* Sort the heap in-place: the farthest row goes to the end */
+	for (i = n - 1; i > 0; --i)
+	{
+		int		tmp = idx[0];
+
+		idx[0] = idx[i];
+		idx[i] = tmp;
+		knn_sift_down(distances, idx, i, 0);
+	}
+
+	return n;
+}
+
+#endif /* KNN_TOPK_H */
@@ -0,0 +1,440 @@
+/*
+ *******************************************************************************
+ *
+ *	ASYNCHRONOUS LEARNING
+ *
+ * With aqo.async_learning a backend doesn't learn at the end of a query
+ * execution. It only puts learning samples (feature subspace, features,
+ * target and reliability) into a queue in shared memory and returns to the
+ * client. The learner background worker drains the queue and applies samples
+ * of the same feature subspace with one load and one store of its data.
+ *
+ * The queue is a ring buffer of a fixed size (aqo.learn_queue_size). If it is
+ * full, new samples are dropped and counted: learning is a best-effort
+ * activity and must not slow down the client.
+ *
+ *******************************************************************************
+ *
+ * Copyright (c) 2016-2022, Postgres Professional
+ *
+ * IDENTIFICATION
+ *	  aqo/learn_queue.c
+ *
+ */
+
+#include "postgres.h"
+
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "tcop/tcopprot.h"
+#include "utils/wait_event.h"
+
+#include "aqo.h"
+#include "learn_queue.h"
+#include "machine_learning.h"
+
+
+/* Size of the queue in kB. Zero disables the queue and the learner */
+int		learn_queue_size = 0;
+bool	aqo_async_learning = false;
+
+/* Max number of samples the learner takes from the queue at once */
+#define LEARN_QUEUE_BATCH	(256)
+
+/* Learner sleeps so long if nothing to do (ms) */
+#define LEARN_QUEUE_NAPTIME	(1000L)
+
+typedef struct LearnQueueState
+{
+	LWLock		lock;			/* protects fields below and the ring */
+	Latch	   *worker_latch;	/* NULL, if the learner isn't running */
+	uint64		head;			/* position of the first unread byte */
+	uint64		tail;			/* position of the first free byte */
+	Size		size;			/* size of the ring */
+
+	pg_atomic_uint64	nenqueued;
+	pg_atomic_uint64	ndropped;
+	pg_atomic_uint64	nlearned;
+
+	char		ring[FLEXIBLE_ARRAY_MEMBER];
+} LearnQueueState;
+
+/*
+ * Header of a sample in the ring. It is followed by ncols features and nrels
+ * relation oids.
+ */
+typedef struct LearnSampleHeader
+{
+	uint64		fs;
+	int64		fss;
+	int			ncols;
+	int			nrels;
+	double		target;
+	double		rfactor;
+} LearnSampleHeader;
+
+/* Sample, read from the queue by the learner */
+typedef struct LearnSample
+{
+	LearnSampleHeader	hdr;
+	int					seqno;		/* keeps order of the samples on sorting */
+	double			   *features;
+	List			   *reloids;
+} LearnSample;
+
+static LearnQueueState *learn_queue = NULL;
+
+PG_FUNCTION_INFO_V1(aqo_learn_queue_stats);
+
+
+Size
+learn_queue_memsize(void)
+{
+	if (learn_queue_size <= 0)
+		return 0;
+
+	return add_size(offsetof(LearnQueueState, ring),
+					(Size) learn_queue_size * 1024);
+}
+
+void
+learn_queue_init_shmem(void)
+{
+	bool	found;
+
+	learn_queue = NULL;
+
+	if (learn_queue_size <= 0)
+		return;
+
+	learn_queue = ShmemInitStruct("AQO Learn Queue", learn_queue_memsize(),
+								  &found);
+	if (!found)
+	{
+		LWLockInitialize(&learn_queue->lock, LWLockNewTrancheId());
+		learn_queue->worker_latch = NULL;
+		learn_queue->head = 0;
+		learn_queue->tail = 0;
+		learn_queue->size = (Size) learn_queue_size * 1024;
+		pg_atomic_init_u64(&learn_queue->nenqueued, 0);
+		pg_atomic_init_u64(&learn_queue->ndropped, 0);
+		pg_atomic_init_u64(&learn_queue->nlearned, 0);
+	}
+
+	LWLockRegisterTranche(learn_queue->lock.tranche, "AQO Learn Queue Lock Tranche");
+}
+
+/*
+ * Copy data into the ring at the position, wrapping around its end.
+ */
+static void
+ring_write(uint64 pos, const void *src, Size len)
+{
+	Size	off = pos % learn_queue->size;
+	Size	n = Min(len, learn_queue->size - off);
+
+	memcpy(learn_queue->ring + off, src, n);
+	if (n < len)
+		memcpy(learn_queue->ring, (const char *) src + n, len - n);
+}
+
+static void
+ring_read(uint64 pos, void *dst, Size len)
+{
+	Size	off = pos % learn_queue->size;
+	Size	n = Min(len, learn_queue->size - off);
+
+	memcpy(dst, learn_queue->ring + off, n);
+	if (n < len)
+		memcpy((char *) dst + n, learn_queue->ring, len - n);
+}
+
+/*
+ * Put the learning sample into the queue.
+ *
+ * Returns false if the sample should be learned by the caller: asynchronous
+ * learning is disabled or the learner isn't running. Sample, which doesn't fit
+ * into the queue, is dropped.
+ */
+bool
+learn_queue_push(uint64 fs, int64 fss, int ncols, double *features,
+				 double target, double rfactor, List *reloids)
+{
+	LearnSampleHeader	hdr;
+	Size				len;
+	uint64				pos;
+	Latch			   *latch;
+	ListCell		   *lc;
+
+	if (!aqo_async_learning || learn_queue == NULL)
+		return false;
+
+	hdr.fs = fs;
+	hdr.fss = fss;
+	hdr.ncols = ncols;
+	hdr.nrels = list_length(reloids);
+	hdr.target = target;
+	hdr.rfactor = rfactor;
+	len = sizeof(LearnSampleHeader) + sizeof(double) * ncols +
+		  sizeof(Oid) * hdr.nrels;
+
+	LWLockAcquire(&learn_queue->lock, LW_EXCLUSIVE);
+
+	latch = learn_queue->worker_latch;
+	if (latch == NULL)
+	{
+		LWLockRelease(&learn_queue->lock);
+		return false;
+	}
+
+	if (learn_queue->size - (learn_queue->tail - learn_queue->head) < len)
+	{
+		/* The learner is behind. Don't wait for it */
+		LWLockRelease(&learn_queue->lock);
+		pg_atomic_fetch_add_u64(&learn_queue->ndropped, 1);
+		return true;
+	}
+
+	pos = learn_queue->tail;
+	ring_write(pos, &hdr, sizeof(LearnSampleHeader));
+	pos += sizeof(LearnSampleHeader);
+	if (ncols > 0)
+	{
+		ring_write(pos, features, sizeof(double) * ncols);
+		pos += sizeof(double) * ncols;
+	}
+	foreach(lc, reloids)
+	{
+		Oid		reloid = lfirst_oid(lc);
+
+		ring_write(pos, &reloid, sizeof(Oid));
+		pos += sizeof(Oid);
+	}
+	learn_queue->tail = pos;
+
+	LWLockRelease(&learn_queue->lock);
+
+	pg_atomic_fetch_add_u64(&learn_queue->nenqueued, 1);
+	SetLatch(latch);
+	return true;
+}
+
+/*
+ * Take up to max samples from the queue. Samples are allocated in the current
+ * memory context.
+ */
+static int
+learn_queue_pop(LearnSample *samples, int max)
+{
+	int		n = 0;
+
+	LWLockAcquire(&learn_queue->lock, LW_EXCLUSIVE);
+
+	while (n < max && learn_queue->head < learn_queue->tail)
+	{
+		LearnSample	   *sample = &samples[n];
+		uint64			pos = learn_queue->head;
+		int				i;
+
+		ring_read(pos, &sample->hdr, sizeof(LearnSampleHeader));
+		pos += sizeof(LearnSampleHeader);
+
+		sample->seqno = n;
+		sample->features = NULL;
+		if (sample->hdr.ncols > 0)
+		{
+			sample->features = palloc(sizeof(double) * sample->hdr.ncols);
+			ring_read(pos, sample->features,
+					  sizeof(double) * sample->hdr.ncols);
+			pos += sizeof(double) * sample->hdr.ncols;
+		}
+
+		sample->reloids = NIL;
+		for (i = 0; i < sample->hdr.nrels; i++)
+		{
+			Oid		reloid;
+
+			ring_read(pos, &reloid, sizeof(Oid));
+			pos += sizeof(Oid);
+			sample->reloids = lappend_oid(sample->reloids, reloid);
+		}
+
+		learn_queue->head = pos;
+		n++;
+	}
+
+	LWLockRelease(&learn_queue->lock);
+	return n;
+}
+
+/*
+ * Group samples by feature subspace, keeping the order of their arrival inside
+ * a group.
+ */
+static int
+sample_cmp(const void *a, const void *b)
+{
+	const LearnSample  *sa = (const LearnSample *) a;
+	const LearnSample  *sb = (const LearnSample *) b;
+
+	if (sa->hdr.fs != sb->hdr.fs)
+		return (sa->hdr.fs < sb->hdr.fs) ? -1 : 1;
+	if (sa->hdr.fss != sb->hdr.fss)
+		return (sa->hdr.fss < sb->hdr.fss) ? -1 : 1;
+	if (sa->hdr.ncols != sb->hdr.ncols)
+		return (sa->hdr.ncols < sb->hdr.ncols) ? -1 : 1;
+	return sa->seqno - sb->seqno;
+}
+
+/*
+ * Learn the batch of samples: data of a feature subspace is loaded and stored
+ * once for all its samples.
+ */
+static void
+learn_samples(LearnSample *samples, int nsamples)
+{
+	int		i;
+	int		j;
+
+	qsort(samples, nsamples, sizeof(LearnSample), sample_cmp);
+
+	for (i = 0; i < nsamples; i = j)
+	{
+		LearnSampleHeader  *hdr = &samples[i].hdr;
+		OkNNrdata		   *data = OkNNr_allocate(hdr->ncols);
+
+		if (!load_fss_ext(hdr->fs, hdr->fss, data, NULL))
+			data->rows = 0;
+
+		for (j = i; j < nsamples && samples[j].hdr.fs == hdr->fs &&
+			 samples[j].hdr.fss == hdr->fss &&
+			 samples[j].hdr.ncols == hdr->ncols; j++)
+			data->rows = OkNNr_learn(data, samples[j].features,
+									 samples[j].hdr.target,
+									 samples[j].hdr.rfactor);
+
+		update_fss_ext(hdr->fs, hdr->fss, data, samples[i].reloids);
+		pg_atomic_fetch_add_u64(&learn_queue->nlearned, j - i);
+	}
+}
+
+void
+learn_queue_register_worker(void)
+{
+	BackgroundWorker	worker;
+
+	if (learn_queue_size <= 0)
+		return;
+
+	MemSet(&worker, 0, sizeof(worker));
+
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = 10;
+	worker.bgw_main_arg = Int32GetDatum(0);
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "aqo");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "aqo_learn_worker_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "aqo learner");
+	snprintf(worker.bgw_type, BGW_MAXLEN, "aqo learner");
+
+	RegisterBackgroundWorker(&worker);
+}
+
+static void
+learn_worker_detach(int code, Datum arg)
+{
+	LWLockAcquire(&learn_queue->lock, LW_EXCLUSIVE);
+	learn_queue->worker_latch = NULL;
+	LWLockRelease(&learn_queue->lock);
+}
+
+/*
+ * Entry point of the learner process.
+ */
+void
+aqo_learn_worker_main(Datum main_arg)
+{
+	LearnSample	   *samples;
+
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	Assert(learn_queue != NULL);
+
+	samples = MemoryContextAlloc(AQOTopMemCtx,
+								 sizeof(LearnSample) * LEARN_QUEUE_BATCH);
+
+	LWLockAcquire(&learn_queue->lock, LW_EXCLUSIVE);
+	learn_queue->worker_latch = MyLatch;
+	LWLockRelease(&learn_queue->lock);
+	before_shmem_exit(learn_worker_detach, (Datum) 0);
+
+	for (;;)
+	{
+		MemoryContext	oldctx;
+		int				nsamples;
+
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+
+		if (ConfigReloadPending)
+		{
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		oldctx = MemoryContextSwitchTo(AQOLearnMemCtx);
+		nsamples = learn_queue_pop(samples, LEARN_QUEUE_BATCH);
+		if (nsamples > 0)
+			learn_samples(samples, nsamples);
+		MemoryContextSwitchTo(oldctx);
+		MemoryContextReset(AQOLearnMemCtx);
+
+		/* Queue may still have samples if the batch was filled up */
+		if (nsamples == LEARN_QUEUE_BATCH)
+			continue;
+
+		(void) WaitLatch(MyLatch,
+						 WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 LEARN_QUEUE_NAPTIME, PG_WAIT_EXTENSION);
+	}
+}
+
+/*
+ * Return counters of the learning queue.
+ */
+Datum
+aqo_learn_queue_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupDesc;
+	HeapTuple	tuple;
+	Datum		values[4];
+	bool		nulls[4] = {0, 0, 0, 0};
+
+	if (get_call_result_type(fcinfo, NULL, &tupDesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	Assert(tupDesc->natts == 4);
+
+	if (learn_queue == NULL)
+		PG_RETURN_NULL();
+
+	values[0] = Int64GetDatum((int64) pg_atomic_read_u64(&learn_queue->nenqueued));
+	values[1] = Int64GetDatum((int64) pg_atomic_read_u64(&learn_queue->ndropped));
+	values[2] = Int64GetDatum((int64) pg_atomic_read_u64(&learn_queue->nlearned));
+
+	LWLockAcquire(&learn_queue->lock, LW_SHARED);
+	values[3] = Int64GetDatum((int64) (learn_queue->tail - learn_queue->head));
+	LWLockRelease(&learn_queue->lock);
+
+	tuple = heap_form_tuple(tupDesc, values, nulls);
+	PG_RETURN_DATUM(HeapTupleGetDatum(tuple));
+}
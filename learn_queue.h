@@ -0,0 +1,18 @@
+#ifndef LEARN_QUEUE_H
+#define LEARN_QUEUE_H
+
+#include "nodes/pg_list.h"
+
+extern int	learn_queue_size;
+extern bool	aqo_async_learning;
+
+extern Size learn_queue_memsize(void);
+extern void learn_queue_init_shmem(void);
+extern void learn_queue_register_worker(void);
+
+extern bool learn_queue_push(uint64 fs, int64 fss, int ncols, double *features,
+							 double target, double rfactor, List *reloids);
+
+PGDLLEXPORT void aqo_learn_worker_main(Datum main_arg);
+
+#endif /* LEARN_QUEUE_H */
@@ -6,9 +6,9 @@
  * This module does not know anything about DBMS, cardinalities and all other
  * stuff. It learns matrices, predicts values and is quite happy.
  * The proposed method is designed for working with limited number of objects.
- * It is guaranteed that number of rows in the matrix will not exceed aqo_K
- * setting after learning procedure. This property also allows to adapt to
- * workloads which properties are slowly changed.
+ * It is guaranteed that number of rows in the matrix will not exceed its
+ * capacity (aqo_K setting by default) after learning procedure. This property
+ * also allows to adapt to workloads which properties are slowly changed.
  *
  *******************************************************************************
  *
@@ -22,8 +22,18 @@
 #include "postgres.h"
 
 #include "aqo.h"
+#include "knn_topk.h"
 #include "machine_learning.h"
 
+/*
+ * On x86-64 the distance kernel has SSE2 (always present on this platform),
+ * AVX2 and AVX-512 implementations. The choice is made at runtime.
+ */
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define AQO_X86_DISTANCE_KERNELS
+#include <immintrin.h>
+#endif
+
 
 /*
  * This parameter tell us that the new learning sample object has very small
@@ -36,34 +46,113 @@ const double	object_selection_threshold = 0.1;
 const double	learning_rate = 1e-1;
 
 
-static double fs_distance(double *a, double *b, int len);
+typedef void (*fs_distances_fn) (const double *matrix, int nrows, int ncols,
+								 const double *features, double *distances);
+
+static double fs_distance(const double *a, const double *b, int len);
+static void fs_distances_scalar(const double *matrix, int nrows, int ncols,
+								const double *features, double *distances);
+static void fs_distances_choose(const double *matrix, int nrows, int ncols,
+								const double *features, double *distances);
+static void compute_distances(OkNNrdata *data, const double *features,
+							  double *distances);
 static double fs_similarity(double dist);
-static double compute_weights(double *distances, int nrows, double *w, int *idx);
+static double compute_weights(double *distances, int nrows, double *w, int *idx,
+							  int *nneighbors);
+
+/*
+ * Scratch arrays of the kNN routines. They live in the TopMemoryContext, grow
+ * on demand and never shrink, so prediction doesn't allocate memory.
+ */
+static double  *knn_distances = NULL;
+static double  *knn_weights = NULL;
+static int	   *knn_idx = NULL;
+static int		knn_scratch_size = 0;
+
+static void
+knn_scratch_reserve(int nrows)
+{
+	int		newsize;
+
+	if (nrows <= knn_scratch_size)
+		return;
+
+	newsize = Max(nrows, Max(aqo_K, 2 * knn_scratch_size));
+
+	if (knn_scratch_size == 0)
+	{
+		knn_distances = MemoryContextAlloc(TopMemoryContext,
+										   sizeof(double) * newsize);
+		knn_weights = MemoryContextAlloc(TopMemoryContext,
+										 sizeof(double) * newsize);
+		knn_idx = MemoryContextAlloc(TopMemoryContext, sizeof(int) * newsize);
+	}
+	else
+	{
+		knn_distances = repalloc(knn_distances, sizeof(double) * newsize);
+		knn_weights = repalloc(knn_weights, sizeof(double) * newsize);
+		knn_idx = repalloc(knn_idx, sizeof(int) * newsize);
+	}
+	knn_scratch_size = newsize;
+}
 
 
+/*
+ * Allocate kNN data with capacity of aqo_K rows.
+ */
 OkNNrdata*
 OkNNr_allocate(int ncols)
 {
 	OkNNrdata  *data = palloc(sizeof(OkNNrdata));
-	int			i;
 
+	/* The whole matrix is allocated by one chunk */
 	if (ncols > 0)
-		for (i = 0; i < aqo_K; i++)
-			data->matrix[i] = palloc0(ncols * sizeof(double));
+		data->matrix = palloc0(sizeof(double) * aqo_K * ncols);
 	else
-		for (i = 0; i < aqo_K; i++)
-			data->matrix[i] = NULL;
+		data->matrix = NULL;
 
+	data->targets = palloc0(sizeof(double) * aqo_K);
+	data->rfactors = palloc0(sizeof(double) * aqo_K);
+	data->capacity = aqo_K;
 	data->cols = ncols;
 	data->rows  = -1;
 	return data;
 }
 
+/*
+ * Increase capacity of the kNN data, if needed. Contents are preserved.
+ * Feature subspaces learned with another value of aqo_K can have more rows
+ * than the current setting.
+ */
+void
+OkNNr_reserve(OkNNrdata *data, int capacity)
+{
+	if (capacity <= data->capacity)
+		return;
+
+	if (data->cols > 0)
+		data->matrix = repalloc(data->matrix,
+								sizeof(double) * capacity * data->cols);
+	data->targets = repalloc(data->targets, sizeof(double) * capacity);
+	data->rfactors = repalloc(data->rfactors, sizeof(double) * capacity);
+	data->capacity = capacity;
+}
+
+void
+OkNNr_free(OkNNrdata *data)
+{
+	if (data->matrix != NULL)
+		pfree(data->matrix);
+	pfree(data->targets);
+	pfree(data->rfactors);
+	pfree(data);
+}
+
 /*
  * Computes L2-distance between two given vectors.
  */
 static double
-fs_distance(double *a, double *b, int len)
+fs_distance(const double *a, const double *b, int len)
 {
 	double		res = 0;
 	int			i;
@@ -78,6 +167,179 @@ fs_distance(double *a, double *b, int len)
 	return res;
 }
 
+/*
+ * Batched versions of fs_distance(): compute distances between the features
+ * vector and each of nrows rows of the matrix in one pass.
+ * Vectorized variants differ from the scalar one only in order of summation,
+ * so results are equal up to a rounding error.
+ */
+static void
+fs_distances_scalar(const double *matrix, int nrows, int ncols,
+					const double *features, double *distances)
+{
+	int		i;
+
+	for (i = 0; i < nrows; ++i)
+		distances[i] = fs_distance(matrix + (size_t) i * ncols, features, ncols);
+}
+
+#ifdef AQO_X86_DISTANCE_KERNELS
+
+static void
+fs_distances_sse2(const double *matrix, int nrows, int ncols,
+				  const double *features, double *distances)
+{
+	int		i;
+
+	for (i = 0; i < nrows; ++i)
+	{
+		const double   *row = matrix + (size_t) i * ncols;
+		__m128d			acc = _mm_setzero_pd();
+		double			sum[2];
+		double			res;
+		int				j;
+
+		for (j = 0; j + 2 <= ncols; j += 2)
+		{
+			__m128d	diff = _mm_sub_pd(_mm_loadu_pd(&row[j]),
+									  _mm_loadu_pd(&features[j]));
+
+			acc = _mm_add_pd(acc, _mm_mul_pd(diff, diff));
+		}
+		_mm_storeu_pd(sum, acc);
+		res = sum[0] + sum[1];
+
+		for (; j < ncols; ++j)
+			res += (row[j] - features[j]) * (row[j] - features[j]);
+
+		distances[i] = (ncols != 0) ? sqrt(res) : 0.;
+	}
+}
+
+__attribute__((target("avx2")))
+static void
+fs_distances_avx2(const double *matrix, int nrows, int ncols,
+				  const double *features, double *distances)
+{
+	int		i;
+
+	for (i = 0; i < nrows; ++i)
+	{
+		const double   *row = matrix + (size_t) i * ncols;
+		__m256d			acc = _mm256_setzero_pd();
+		double			sum[4];
+		double			res;
+		int				j;
+
+		for (j = 0; j + 4 <= ncols; j += 4)
+		{
+			__m256d	diff = _mm256_sub_pd(_mm256_loadu_pd(&row[j]),
+										 _mm256_loadu_pd(&features[j]));
+
+			acc = _mm256_add_pd(acc, _mm256_mul_pd(diff, diff));
+		}
+		_mm256_storeu_pd(sum, acc);
+		res = (sum[0] + sum[1]) + (sum[2] + sum[3]);
+
+		for (; j < ncols; ++j)
+			res += (row[j] - features[j]) * (row[j] - features[j]);
+
+		distances[i] = (ncols != 0) ? sqrt(res) : 0.;
+	}
+}
+
+__attribute__((target("avx512f")))
+static void
+fs_distances_avx512(const double *matrix, int nrows, int ncols,
+					const double *features, double *distances)
+{
+	int		i;
+
+	for (i = 0; i < nrows; ++i)
+	{
+		const double   *row = matrix + (size_t) i * ncols;
+		__m512d			acc = _mm512_setzero_pd();
+		int				j;
+
+		for (j = 0; j + 8 <= ncols; j += 8)
+		{
+			__m512d	diff = _mm512_sub_pd(_mm512_loadu_pd(&row[j]),
+										 _mm512_loadu_pd(&features[j]));
+
+			acc = _mm512_add_pd(acc, _mm512_mul_pd(diff, diff));
+		}
+
+		if (j < ncols)
+		{
+			/* Masked load of the tail: lanes beyond ncols are zeroed */
+			__mmask8	mask = (__mmask8) ((1U << (ncols - j)) - 1);
+			__m512d		diff = _mm512_sub_pd(_mm512_maskz_loadu_pd(mask, &row[j]),
+											 _mm512_maskz_loadu_pd(mask, &features[j]));
+
+			acc = _mm512_add_pd(acc, _mm512_mul_pd(diff, diff));
+		}
+
+		distances[i] = (ncols != 0) ? sqrt(_mm512_reduce_add_pd(acc)) : 0.;
+	}
+}
+
+#endif							/* AQO_X86_DISTANCE_KERNELS */
+
+/*
+ * Pointer to the chosen implementation. The first call goes through
+ * fs_distances_choose() which detects CPU features and overwrites it.
+ */
+static fs_distances_fn fs_distances = fs_distances_choose;
+
+static void
+fs_distances_choose(const double *matrix, int nrows, int ncols,
+					const double *features, double *distances)
+{
+#ifdef AQO_X86_DISTANCE_KERNELS
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512f"))
+		fs_distances = fs_distances_avx512;
+	else if (__builtin_cpu_supports("avx2"))
+		fs_distances = fs_distances_avx2;
+	else
+		fs_distances = fs_distances_sse2;
+#else
+	fs_distances = fs_distances_scalar;
+#endif
+
+	fs_distances(matrix, nrows, ncols, features, distances);
+}
+
+/*
+ * Compute distances between the features vector and each row of the matrix.
+ */
+static void
+compute_distances(OkNNrdata *data, const double *features, double *distances)
+{
+	/* Vector code doesn't make sense for one-dimensional subspaces */
+	if (data->cols < 2)
+		fs_distances_scalar(data->matrix, data->rows, data->cols,
+							features, distances);
+	else
+		fs_distances(data->matrix, data->rows, data->cols,
+					 features, distances);
+
+#ifdef USE_ASSERT_CHECKING
+	{
+		int		i;
+
+		/* Check the vectorized kernel against the reference implementation */
+		for (i = 0; i < data->rows; ++i)
+		{
+			double	ref = fs_distance(OkNNr_row(data, i), features, data->cols);
+
+			Assert(fabs(distances[i] - ref) <= 1e-9 * (1. + ref));
+		}
+	}
+#endif
+}
+
 /*
  * Returns similarity between objects based on distance between them.
  */
@@ -90,43 +352,31 @@ fs_similarity(double dist)
 /*
  * Compute weights necessary for both prediction and learning.
  * Creates and returns w, w_sum and idx based on given distances ad matrix_rows.
+ * Number of the nearest neighbors found is returned in nneighbors. It may be
+ * less than aqo_k if the matrix has less rows.
  *
  * Appeared as a separate function because of "don't repeat your code"
  * principle.
  */
 static double
-compute_weights(double *distances, int nrows, double *w, int *idx)
+compute_weights(double *distances, int nrows, double *w, int *idx,
+				int *nneighbors)
 {
-	int		i,
-			j;
-	int		to_insert,
-			tmp;
+	int		j;
+	int		n;
 	double	w_sum = 0;
 
-	for (i = 0; i < aqo_k; ++i)
-		idx[i] = -1;
-
 	/* Choose from all neighbors only several nearest objects */
-	for (i = 0; i < nrows; ++i)
-		for (j = 0; j < aqo_k; ++j)
-			if (idx[j] == -1 || distances[i] < distances[idx[j]])
-			{
-				to_insert = i;
-				for (; j < aqo_k; ++j)
-				{
-					tmp = idx[j];
-					idx[j] = to_insert;
-					to_insert = tmp;
-				}
-				break;
-			}
+	n = knn_select_nearest(distances, nrows, aqo_k, idx);
 
 	/* Compute weights by the nearest neighbors distances */
-	for (j = 0; j < aqo_k && idx[j] != -1; ++j)
+	for (j = 0; j < n; ++j)
 	{
 		w[j] = fs_similarity(distances[idx[j]]);
 		w_sum += w[j];
 	}
+
+	*nneighbors = n;
 	return w_sum;
 }
 
@@ -139,11 +389,12 @@ compute_weights(double *distances, int nrows, double *w, int *idx)
 double
 OkNNr_predict(OkNNrdata *data, double *features)
 {
-	double	distances[aqo_K];
+	double *distances;
 	int		i;
-	int		idx[aqo_K]; /* indexes of nearest neighbors */
-	double	w[aqo_K];
+	int	   *idx; /* indexes of nearest neighbors */
+	double *w;
 	double	w_sum;
+	int		nneighbors;
 	double	result = 0.;
 
 	Assert(data != NULL);
@@ -151,20 +402,23 @@ OkNNr_predict(OkNNrdata *data, double *features)
 	if (!aqo_predict_with_few_neighbors && data->rows < aqo_k)
 		return -1.;
 
-	for (i = 0; i < data->rows; ++i)
-		distances[i] = fs_distance(data->matrix[i], features, data->cols);
+	knn_scratch_reserve(data->rows);
+	distances = knn_distances;
+	idx = knn_idx;
+	w = knn_weights;
+
+	compute_distances(data, features, distances);
 
-	w_sum = compute_weights(distances, data->rows, w, idx);
+	w_sum = compute_weights(distances, data->rows, w, idx, &nneighbors);
 
-	for (i = 0; i < aqo_k; ++i)
-		if (idx[i] != -1)
-			result += data->targets[idx[i]] * w[i] / w_sum;
+	for (i = 0; i < nneighbors; ++i)
+		result += data->targets[idx[i]] * w[i] / w_sum;
 
 	if (result < 0.)
 		result = 0.;
 
 	/* this should never happen */
-	if (idx[0] == -1)
+	if (nneighbors == 0)
 		result = -1.;
 
 	return result;
@@ -184,18 +438,22 @@ OkNNr_predict(OkNNrdata *data, double *features)
 int
 OkNNr_learn(OkNNrdata *data, double *features, double target, double rfactor)
 {
-	double	distances[aqo_K];
+	double *distances;
 	int		i;
 	int		j;
 	int		mid = 0; /* index of row with minimum distance value */
-	int		idx[aqo_K];
+	double *feature;
+	int		result;
+
+	knn_scratch_reserve(data->rows);
+	distances = knn_distances;
 
 	/*
 	 * For each neighbor compute distance and search for nearest object.
 	 */
-	for (i = 0; i < data->rows; ++i)
+	compute_distances(data, features, distances);
+	for (i = 1; i < data->rows; ++i)
 	{
-		distances[i] = fs_distance(data->matrix[i], features, data->cols);
 		if (distances[i] < distances[mid])
 			mid = i;
 	}
@@ -218,36 +476,39 @@ OkNNr_learn(OkNNrdata *data, double *features, double target, double rfactor)
 		Assert(lr > 0.);
 		Assert(data->rfactors[mid] > 0. && data->rfactors[mid] <= 1.);
 
+		feature = OkNNr_row(data, mid);
 		for (j = 0; j < data->cols; ++j)
-			data->matrix[mid][j] += lr * (features[j] - data->matrix[mid][j]);
+			feature[j] += lr * (features[j] - feature[j]);
 		data->targets[mid] += lr * (target - data->targets[mid]);
 		data->rfactors[mid] += lr * (rfactor - data->rfactors[mid]);
 
-		return data->rows;
+		result = data->rows;
 	}
-	else if (data->rows < aqo_K)
+	else if (data->rows < data->capacity)
 	{
 		/* We don't reach a limit of stored neighbors */
 
 		/*
 		 * Add new line into the matrix. We can do this because data->rows
-		 * is not the boundary of matrix. Matrix has aqo_K free lines
+		 * is not the boundary of matrix. Matrix has 'capacity' lines.
 		 */
-		for (j = 0; j < data->cols; ++j)
-			data->matrix[data->rows][j] = features[j];
+		if (data->cols > 0)
+			memcpy(OkNNr_row(data, data->rows), features,
+				   sizeof(double) * data->cols);
 		data->targets[data->rows] = target;
 		data->rfactors[data->rows] = rfactor;
 
-		return data->rows + 1;
+		result = data->rows + 1;
 	}
 	else
 	{
-		double *feature;
 		double	avg_target = 0;
 		double	tc_coef; /* Target correction coefficient */
 		double	fc_coef; /* Feature correction coefficient */
-		double	w[aqo_K];
+		double *w;
+		int	   *idx;
 		double	w_sum;
+		int		nneighbors;
 
 		/*
 		 * We reaches limit of stored neighbors and can't simply add new line
@@ -260,22 +521,23 @@ OkNNr_learn(OkNNrdata *data, double *features, double target, double rfactor)
 		 * idx array. Compute weight for each nearest neighbor and total weight
 		 * of all nearest neighbor.
 		 */
-		w_sum = compute_weights(distances, data->rows, w, idx);
+		w = knn_weights;
+		idx = knn_idx;
+		w_sum = compute_weights(distances, data->rows, w, idx, &nneighbors);
 
 		/*
-		 * Compute average value for target by nearest neighbors. We need to
-		 * check idx[i] != -1 because we may have smaller value of nearest
-		 * neighbors than aqo_k.
+		 * Compute average value for target by nearest neighbors. We may have
+		 * smaller value of nearest neighbors than aqo_k.
 		 * Semantics of tc_coef: it is defined distance between new object and
 		 * this superposition value (with linear smoothing).
 		 * fc_coef - feature changing rate.
 		 * */
-		for (i = 0; i < aqo_k && idx[i] != -1; ++i)
+		for (i = 0; i < nneighbors; ++i)
 			avg_target += data->targets[idx[i]] * w[i] / w_sum;
 		tc_coef = learning_rate * (avg_target - target);
 
 		/* Modify targets and features of each nearest neighbor row. */
-		for (i = 0; i < aqo_k && idx[i] != -1; ++i)
+		for (i = 0; i < nneighbors; ++i)
 		{
 			double lr = learning_rate * rfactor / data->rfactors[mid];
 
@@ -292,13 +554,14 @@ OkNNr_learn(OkNNrdata *data, double *features, double target, double rfactor)
 										w[i] * w[i] / sqrt(data->cols) / w_sum;
 
 			data->targets[idx[i]] -= tc_coef * lr * w[i] / w_sum;
+			feature = OkNNr_row(data, idx[i]);
 			for (j = 0; j < data->cols; ++j)
-			{
-				feature = data->matrix[idx[i]];
 				feature[j] -= fc_coef * (features[j] - feature[j]) /
 					distances[idx[i]];
-			}
 		}
+
+		result = data->rows;
 	}
-	return data->rows;
+
+	return result;
 }
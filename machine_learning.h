@@ -1,8 +1,13 @@
 #ifndef MACHINE_LEARNING_H
 #define MACHINE_LEARNING_H
 
-/* Max number of matrix rows - max number of possible neighbors. */
-#define	aqo_K	(30)
+/*
+ * Max number of matrix rows - max number of possible neighbors. It is used as
+ * a capacity of each new feature subspace and can be changed on restart.
+ */
+#define AQO_K_DEFAULT	(30)
+#define AQO_K_MAX		(1000)
+extern int aqo_K;
 
 extern const double object_selection_threshold;
 extern const double learning_rate;
@@ -14,13 +19,18 @@ typedef struct OkNNrdata
 {
 	int		rows; /* Number of filled rows in the matrix */
 	int		cols; /* Number of columns in the matrix */
+	int		capacity; /* Max number of rows in the matrix */
 
-	double *matrix[aqo_K]; /* Contains the matrix - learning data for the same
-							* value of (fs, fss), but different features. */
-	double	targets[aqo_K]; /* Right side of the equations system */
-	double	rfactors[aqo_K];
+	double *matrix; /* Contains the matrix - learning data for the same
+					 * value of (fs, fss), but different features. It is one
+					 * row-major block of 'capacity' rows with stride 'cols'. */
+	double *targets; /* Right side of the equations system */
+	double *rfactors;
 } OkNNrdata;
 
+/* Address of the i-th row of the matrix */
+#define OkNNr_row(data, i)	((data)->matrix + (size_t) (i) * (data)->cols)
+
 /*
  * Auxiliary struct, used for passing arguments
  * to aqo_data_store() function.
@@ -30,14 +40,16 @@ typedef struct AqoDataArgs
 	int		rows;	/* Number of filled rows in the matrix */
 	int		cols;	/* Number of columns in the matrix */
 	int		nrels;	/* Number of oids */
+	int		capacity; /* Max number of rows for the feature subspace */
 
-	double	**matrix;	/* Pointer ot matrix array */
+	double	*matrix;	/* Row-major matrix: rows x cols elements */
 	double	*targets;	/* Pointer to array of 'targets' */
 	double	*rfactors;	/* Pointer to array of 'rfactors' */
 	Oid		*oids;		/* Array of relation OIDs */
 } AqoDataArgs;
 
 extern OkNNrdata* OkNNr_allocate(int ncols);
+extern void OkNNr_reserve(OkNNrdata *data, int capacity);
 extern void OkNNr_free(OkNNrdata *data);
 
 /* Machine learning techniques */
@@ -17,6 +17,7 @@
 #include "nodes/readfuncs.h"
 #include "optimizer/optimizer.h"
 #include "path_utils.h"
+#include "utils/inval.h"
 #include "utils/syscache.h"
 #include "utils/lsyscache.h"
 
@@ -33,6 +34,9 @@ create_plan_hook_type prev_create_plan_hook = NULL;
 
 create_upper_paths_hook_type prev_create_upper_paths_hook = NULL;
 
+static List *collect_path_clauses(Path *path, PlannerInfo *root,
+								  List **selectivities);
+
 static AQOPlanNode DefaultAQOPlanNode =
 {
 	.node.type = T_ExtensibleNode,
@@ -177,6 +181,173 @@ hashTempTupleDesc(TupleDesc desc)
 
 #include "storage/lmgr.h"
 
+/*
+ * Backend-local cache of relation signatures. Computation of a signature needs
+ * a few syscache lookups and, for a temporary table, opening of the relation,
+ * but it is made for each relation of each plan node. So keep signatures until
+ * the relation is changed, what is reported by a relcache invalidation.
+ */
+typedef struct RelSignatureEntry
+{
+	Oid			relid;			/* hash key */
+
+	int			signature;
+	char		relpersistence;
+
+	/* The relation is permanent and its oid goes into the list of reloids */
+	bool		permanent;
+} RelSignatureEntry;
+
+static HTAB *relsig_cache = NULL;
+
+/*
+ * Counts invalidations of the cache to don't store a signature, computed
+ * while an invalidation came in.
+ */
+static uint64 relsig_cache_invals = 0;
+
+static void
+relsig_cache_reset(void)
+{
+	HASH_SEQ_STATUS		status;
+	RelSignatureEntry  *entry;
+
+	hash_seq_init(&status, relsig_cache);
+	while ((entry = (RelSignatureEntry *) hash_seq_search(&status)) != NULL)
+		(void) hash_search(relsig_cache, &entry->relid, HASH_REMOVE, NULL);
+}
+
+static void
+relsig_relcache_callback(Datum arg, Oid relid)
+{
+	relsig_cache_invals++;
+
+	if (OidIsValid(relid))
+		(void) hash_search(relsig_cache, &relid, HASH_REMOVE, NULL);
+	else
+		relsig_cache_reset();
+}
+
+/*
+ * The signature includes name of the schema, which can be renamed without
+ * invalidation of its relations.
+ */
+static void
+relsig_namespace_callback(Datum arg, int cacheid, uint32 hashvalue)
+{
+	relsig_cache_invals++;
+	relsig_cache_reset();
+}
+
+static void
+relsig_cache_init(void)
+{
+	HASHCTL		hash_ctl;
+
+	MemSet(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(Oid);
+	hash_ctl.entrysize = sizeof(RelSignatureEntry);
+	relsig_cache = hash_create("AQO relation signatures",
+							   128,		/* start small and extend */
+							   &hash_ctl,
+							   HASH_ELEM | HASH_BLOBS);
+
+	CacheRegisterRelcacheCallback(relsig_relcache_callback, (Datum) 0);
+	CacheRegisterSyscacheCallback(NAMESPACEOID, relsig_namespace_callback,
+								  (Datum) 0);
+}
+
+/*
+ * Compute signature of the relation: hash of its qualified name for a regular
+ * table and hash of its TupleDesc for a temporary one, because temporary table
+ * gets new name and oid in each session.
+ */
+static void
+compute_relation_signature(Oid relid, RelSignatureEntry *sig, bool *cacheable)
+{
+	HeapTuple		htup;
+	Form_pg_class	classForm;
+	char		   *relname = NULL;
+	Oid				relrewrite;
+
+	htup = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+	if (!HeapTupleIsValid(htup))
+		elog(PANIC, "cache lookup failed for reloid %u", relid);
+
+	/* Copy the fields from syscache and release the slot as quickly as possible. */
+	classForm = (Form_pg_class) GETSTRUCT(htup);
+	sig->relpersistence = classForm->relpersistence;
+	relrewrite = classForm->relrewrite;
+	relname = pstrdup(NameStr(classForm->relname));
+	ReleaseSysCache(htup);
+
+	/*
+	 * Signature of a transient table of a rewrite depends on another relation,
+	 * changes of which don't invalidate this one. Such tables live for a short
+	 * time, so don't cache them at all.
+	 */
+	*cacheable = !OidIsValid(relrewrite);
+
+	if (sig->relpersistence == RELPERSISTENCE_TEMP)
+	{
+		/* The case of temporary table */
+
+		Relation	trel;
+		TupleDesc	tdesc;
+
+		trel = relation_open(relid, NoLock);
+		tdesc = RelationGetDescr(trel);
+		Assert(CheckRelationLockedByMe(trel, AccessShareLock, true));
+		sig->signature = hashTempTupleDesc(tdesc);
+		sig->permanent = false;
+		relation_close(trel, NoLock);
+	}
+	else
+	{
+		/* The case of regular table */
+		relname = quote_qualified_identifier(
+					get_namespace_name(get_rel_namespace(relid)),
+						relrewrite ? get_rel_name(relrewrite) : relname);
+
+		sig->signature = DatumGetInt32(hash_any((unsigned char *) relname,
+												strlen(relname)));
+		sig->permanent = true;
+	}
+}
+
+/*
+ * Find signature of the relation in the cache or compute and remember it.
+ */
+static RelSignatureEntry *
+get_relation_signature(Oid relid, RelSignatureEntry *sig)
+{
+	RelSignatureEntry  *entry;
+	uint64				invals;
+	bool				cacheable;
+	bool				found;
+
+	if (relsig_cache == NULL)
+		relsig_cache_init();
+
+	entry = (RelSignatureEntry *) hash_search(relsig_cache, &relid,
+											  HASH_FIND, NULL);
+	if (entry != NULL)
+		return entry;
+
+	invals = relsig_cache_invals;
+	sig->relid = relid;
+	compute_relation_signature(relid, sig, &cacheable);
+
+	if (!cacheable || invals != relsig_cache_invals)
+		return sig;
+
+	entry = (RelSignatureEntry *) hash_search(relsig_cache, &relid,
+											  HASH_ENTER, &found);
+	Assert(!found);
+	*entry = *sig;
+	return entry;
+}
+
 /*
  * Get list of relation indexes and prepare list of permanent table reloids,
  * list of temporary table reloids (can be changed between query launches) and
@@ -196,11 +367,8 @@ get_list_of_relids(PlannerInfo *root, Relids relids, RelSortOut *rels)
 	index = -1;
 	while ((index = bms_next_member(relids, index)) >= 0)
 	{
-		HeapTuple		htup;
-		Form_pg_class	classForm;
-		char		   *relname = NULL;
-		Oid				relrewrite;
-		char			relpersistence;
+		RelSignatureEntry	sigdata;
+		RelSignatureEntry  *sig;
 
 		entry = planner_rt_fetch(index, root);
 
@@ -211,43 +379,10 @@ get_list_of_relids(PlannerInfo *root, Relids relids, RelSortOut *rels)
 			continue;
 		}
 
-		htup = SearchSysCache1(RELOID, ObjectIdGetDatum(entry->relid));
-		if (!HeapTupleIsValid(htup))
-			elog(PANIC, "cache lookup failed for reloid %u", entry->relid);
-
-		/* Copy the fields from syscache and release the slot as quickly as possible. */
-		classForm = (Form_pg_class) GETSTRUCT(htup);
-		relpersistence = classForm->relpersistence;
-		relrewrite = classForm->relrewrite;
-		relname = pstrdup(NameStr(classForm->relname));
-		ReleaseSysCache(htup);
-
-		if (relpersistence == RELPERSISTENCE_TEMP)
-		{
-			/* The case of temporary table */
-
-			Relation	trel;
-			TupleDesc	tdesc;
-
-			trel = relation_open(entry->relid, NoLock);
-			tdesc = RelationGetDescr(trel);
-			Assert(CheckRelationLockedByMe(trel, AccessShareLock, true));
-			hashes = lappend_int(hashes, hashTempTupleDesc(tdesc));
-			relation_close(trel, NoLock);
-		}
-		else
-		{
-			/* The case of regular table */
-			relname = quote_qualified_identifier(
-						get_namespace_name(get_rel_namespace(entry->relid)),
-							relrewrite ? get_rel_name(relrewrite) : relname);
-
-			hashes = lappend_int(hashes, DatumGetInt32(hash_any(
-											(unsigned char *) relname,
-											strlen(relname))));
-
+		sig = get_relation_signature(entry->relid, &sigdata);
+		hashes = lappend_int(hashes, sig->signature);
+		if (sig->permanent)
 			hrels = lappend_oid(hrels, entry->relid);
-		}
 	}
 
 	rels->hrels = list_concat(rels->hrels, hrels);
@@ -291,6 +426,7 @@ subplan_hunter(Node *node, void *context)
  * Get independent copy of the clauses list.
  * During this operation clauses could be changed and we couldn't walk across
  * this list next.
+ * Copies of the clauses are shared during the planning, so don't change them.
  */
 List *
 aqo_get_clauses(PlannerInfo *root, List *restrictlist)
@@ -300,13 +436,24 @@ aqo_get_clauses(PlannerInfo *root, List *restrictlist)
 
 	foreach(lc, restrictlist)
 	{
-		RestrictInfo *rinfo = lfirst_node(RestrictInfo, lc);
+		RestrictInfo   *rinfo = lfirst_node(RestrictInfo, lc);
+		RestrictInfo   *copy;
+		MemoryContext	copycxt;
 
-		rinfo = copyObject(rinfo);
-		rinfo->clause = (Expr *) expression_tree_mutator((Node *) rinfo->clause,
-														 subplan_hunter,
-														 (void *) root);
-		clauses = lappend(clauses, (void *) rinfo);
+		/* The same clause is requested for each join it participates in */
+		copy = clause_cache_get_copy(rinfo, &copycxt);
+		if (copy == NULL)
+		{
+			MemoryContext oldctx = MemoryContextSwitchTo(copycxt);
+
+			copy = copyObject(rinfo);
+			copy->clause = (Expr *) expression_tree_mutator((Node *) copy->clause,
+															subplan_hunter,
+															(void *) root);
+			MemoryContextSwitchTo(oldctx);
+			clause_cache_set_copy(rinfo, copy);
+		}
+		clauses = lappend(clauses, (void *) copy);
 	}
 	return clauses;
 }
@@ -316,9 +463,33 @@ aqo_get_clauses(PlannerInfo *root, List *restrictlist)
  * Also returns selectivities for the clauses throw the selectivities variable.
  * Both clauses and selectivities returned lists are copies and therefore
  * may be modified without corruption of the input data.
+ *
+ * During the join search clauses of the cheapest path of each scan or join
+ * relation are gathered once: a joinrel estimation just appends its own
+ * restrictlist to the lists of its children.
  */
 List *
 get_path_clauses(Path *path, PlannerInfo *root, List **selectivities)
+{
+	List	   *clauses;
+	bool		cacheable;
+
+	cacheable = (path != NULL && path == path->parent->cheapest_total_path &&
+				 (IS_SIMPLE_REL(path->parent) || IS_JOIN_REL(path->parent)));
+
+	if (cacheable &&
+		clause_cache_get_rel(path->parent, path, &clauses, selectivities))
+		return clauses;
+
+	clauses = collect_path_clauses(path, root, selectivities);
+
+	if (cacheable)
+		clause_cache_set_rel(path->parent, path, clauses, *selectivities);
+	return clauses;
+}
+
+static List *
+collect_path_clauses(Path *path, PlannerInfo *root, List **selectivities)
 {
 	List	   *inner;
 	List	   *inner_sel = NIL;
@@ -649,8 +820,9 @@ AQOnodeEqual(const struct ExtensibleNode *a, const struct ExtensibleNode *b)
 	return false;
 }
 
-#define WRITE_INT_FIELD(fldname) \
-	appendStringInfo(str, " :" CppAsString(fldname) " %d", node->fldname)
+#define WRITE_INT64_FIELD(fldname) \
+	appendStringInfo(str, " :" CppAsString(fldname) " " INT64_FORMAT, \
+					 node->fldname)
 
 /* Write a boolean field */
 #define WRITE_BOOL_FIELD(fldname) \
@@ -685,15 +857,15 @@ AQOnodeOut(struct StringInfoData *str, const struct ExtensibleNode *enode)
 	AQOPlanNode *node = (AQOPlanNode *) enode;
 
 	/* For Adaptive optimization DEBUG purposes */
-	WRITE_INT_FIELD(fss);
+	WRITE_INT64_FIELD(fss);
 	WRITE_FLOAT_FIELD(prediction, "%.0f");
 }
 
-/* Read an integer field (anything written as ":fldname %d") */
-#define READ_INT_FIELD(fldname) \
+/* Read a 64-bit integer field */
+#define READ_INT64_FIELD(fldname) \
 	token = pg_strtok(&length);		/* skip :fldname */ \
 	token = pg_strtok(&length);		/* get field value */ \
-	local_node->fldname = atoi(token)
+	local_node->fldname = strtoi64(token, NULL, 10)
 
 /* Read an enumerated-type field that was written as an integer code */
 #define READ_ENUM_FIELD(fldname, enumtype) \
@@ -742,7 +914,7 @@ AQOnodeRead(struct ExtensibleNode *enode)
 	local_node->grouping_exprs = NIL;
 
 	/* For Adaptive optimization DEBUG purposes */
-	READ_INT_FIELD(fss);
+	READ_INT64_FIELD(fss);
 	READ_FLOAT_FIELD(prediction);
 }
 
@@ -778,6 +950,7 @@ aqo_store_upper_signature_hook(PlannerInfo *root,
 	RelSortOut	rels = {NIL, NIL};
 	List	   *clauses;
 	List	   *selectivities;
+	int64		fss;
 
 	if (prev_create_upper_paths_hook)
 		(*prev_create_upper_paths_hook)(root, stage, input_rel, output_rel, extra);
@@ -793,9 +966,11 @@ aqo_store_upper_signature_hook(PlannerInfo *root,
 	clauses = get_path_clauses(input_rel->cheapest_total_path,
 													root, &selectivities);
 	get_list_of_relids(root, input_rel->relids, &rels);
-	fss_node->val.ival.type = T_Integer;
+	fss = get_fss_for_object(rels.signatures, clauses, NIL, NULL, NULL);
+
+	/* Like the parser, store an integer out of the int4 range as a Float */
+	fss_node->val.fval.type = T_Float;
+	fss_node->val.fval.fval = psprintf(INT64_FORMAT, fss);
 	fss_node->location = -1;
-	fss_node->val.ival.ival = get_fss_for_object(rels.signatures, clauses, NIL,
-												NULL, NULL);
 	output_rel->ext_nodes = lappend(output_rel->ext_nodes, (void *) fss_node);
 }
@@ -40,7 +40,7 @@ typedef struct AQOPlanNode
 	bool		was_parametrized;
 
 	/* For Adaptive optimization DEBUG purposes */
-	int		fss;
+	int64	fss;
 	double	prediction;
 } AQOPlanNode;
 
@@ -25,6 +25,7 @@
 
 #include "aqo.h"
 #include "hash.h"
+#include "learn_queue.h"
 #include "path_utils.h"
 #include "machine_learning.h"
 #include "preprocessing.h"
@@ -60,7 +61,7 @@ static char *PlanStateInfo = "PlanStateInfo";
 
 
 /* Query execution statistics collecting utilities */
-static void atomic_fss_learn_step(uint64 fhash, int fss, OkNNrdata *data,
+static void atomic_fss_learn_step(uint64 fhash, int64 fss, OkNNrdata *data,
 								  double *features, double target,
 								  double rfactor, List *reloids);
 static bool learnOnPlanState(PlanState *p, void *context);
@@ -83,12 +84,17 @@ static bool ExtractFromQueryEnv(QueryDesc *queryDesc);
  * This is the critical section: only one runner is allowed to be inside this
  * function for one feature subspace.
  * matrix and targets are just preallocated memory for computations.
+ * In the asynchronous mode the sample is passed to the learner.
  */
 static void
-atomic_fss_learn_step(uint64 fs, int fss, OkNNrdata *data,
+atomic_fss_learn_step(uint64 fs, int64 fss, OkNNrdata *data,
 					  double *features, double target, double rfactor,
 					  List *reloids)
 {
+	if (learn_queue_push(fs, fss, data->cols, features, target, rfactor,
+						 reloids))
+		return;
+
 	if (!load_fss_ext(fs, fss, data, NULL))
 		data->rows = 0;
 
@@ -102,10 +108,10 @@ learn_agg_sample(aqo_obj_stat *ctx, RelSortOut *rels,
 {
 	AQOPlanNode	   *aqo_node = get_aqo_plan_node(plan, false);
 	uint64			fs = query_context.fspace_hash;
-	int				child_fss;
+	int64			child_fss;
 	double			target;
 	OkNNrdata	   *data = OkNNr_allocate(0);
-	int				fss;
+	int64			fss;
 
 	/*
 	 * Learn 'not executed' nodes only once, if no one another knowledge exists
@@ -139,7 +145,7 @@ learn_sample(aqo_obj_stat *ctx, RelSortOut *rels,
 	double		   *features;
 	double			target;
 	OkNNrdata	   *data;
-	int				fss;
+	int64			fss;
 	int				ncols;
 
 	target = log(learned);
@@ -310,7 +316,7 @@ should_learn(PlanState *ps, AQOPlanNode *node, aqo_obj_stat *ctx,
 			/* This node s*/
 			if (aqo_show_details)
 				elog(NOTICE,
-					 "[AQO] Learn on a plan node ("UINT64_FORMAT", %d), "
+					 "[AQO] Learn on a plan node ("UINT64_FORMAT", "INT64_FORMAT"), "
 					"predicted rows: %.0lf, updated prediction: %.0lf",
 					 query_context.query_hash, node->fss, predicted, nrows);
 
@@ -326,7 +332,7 @@ should_learn(PlanState *ps, AQOPlanNode *node, aqo_obj_stat *ctx,
 			if (ctx->learn && aqo_show_details &&
 				fabs(nrows - predicted) / predicted > 0.2)
 				elog(NOTICE,
-					 "[AQO] Learn on a finished plan node ("UINT64_FORMAT", %d), "
+					 "[AQO] Learn on a finished plan node ("UINT64_FORMAT", "INT64_FORMAT"), "
 					 "predicted rows: %.0lf, updated prediction: %.0lf",
 					 query_context.query_hash, node->fss, predicted, nrows);
 
@@ -1039,7 +1045,7 @@ explain_print:
 explain_end:
 	/* XXX: Do we really have situations when the plan is a NULL pointer? */
 	if (plan && aqo_show_hash)
-		appendStringInfo(es->str, ", fss=%d", aqo_node->fss);
+		appendStringInfo(es->str, ", fss="INT64_FORMAT, aqo_node->fss);
 }
 
 /*
@@ -154,6 +154,9 @@ aqo_planner(Query *parse,
 
 	selectivity_cache_clear();
 
+	/* Forget the predictions of a planning interrupted by an error */
+	MemoryContextReset(AQOPredictMemCtx);
+
 	/* Check unlucky case (get a hash of zero) */
 	if (parse->queryId == UINT64CONST(0))
 		JumbleQuery(parse, query_string);
@@ -302,8 +305,11 @@ ignore_query_settings:
 		 * Add query into the AQO knowledge base. To process an error with
 		 * concurrent addition from another backend we will try to restart
 		 * preprocessing routine.
+		 * If the knowledge base is full, the class can displace cold ones
+		 * (see aqo_queries_admit()).
 		 */
-		if (aqo_queries_store(query_context.query_hash, query_context.fspace_hash,
+		if (aqo_queries_admit(query_context.query_hash) &&
+			aqo_queries_store(query_context.query_hash, query_context.fspace_hash,
 						  query_context.learn_aqo, query_context.use_aqo,
 						  query_context.auto_tuning, &aqo_queries_nulls))
 		{
@@ -318,19 +324,12 @@ ignore_query_settings:
 			}
 		}
 		else
-		{
 			/*
 			 * In the case of problems (shmem overflow, as a typical issue) -
-			 * disable AQO for the query class.
+			 * disable AQO for this query only. The class may be admitted
+			 * next time, so don't switch the backend into controlled mode.
 			 */
 			disable_aqo_for_query();
-
-			/*
-			 * Switch AQO to controlled mode. In this mode we wouldn't add new
-			 * query classes, just use and learn on existed set.
-			 */
-			aqo_mode = AQO_MODE_CONTROLLED;
-		}
 	}
 
 	if (force_collect_stat)
@@ -346,11 +345,20 @@ ignore_query_settings:
 	{
 		PlannedStmt *stmt;
 
-		stmt = call_default_planner(parse, query_string,
-												 cursorOptions, boundParams);
+		clause_cache_init();
+		PG_TRY();
+		{
+			stmt = call_default_planner(parse, query_string,
+										cursorOptions, boundParams);
+		}
+		PG_FINALLY();
+		{
+			/* Release the memory, allocated for AQO predictions */
+			MemoryContextReset(AQOPredictMemCtx);
+			clause_cache_reset();
+		}
+		PG_END_TRY();
 
-		/* Release the memory, allocated for AQO predictions */
-		MemoryContextReset(AQOPredictMemCtx);
 		return stmt;
 	}
 }
@@ -0,0 +1,82 @@
+-- Preliminaries
+CREATE EXTENSION IF NOT EXISTS aqo;
+SELECT true AS success FROM aqo_reset();
+
+SET aqo.mode = 'learn';
+SET aqo.join_threshold = 0;
+SET aqo.show_details = 'on';
+SET aqo.show_hash = 'off';
+
+-- Correlated columns make the planner estimations wrong
+CREATE TABLE cs_a AS SELECT gs % 100 AS x, gs % 50 AS y
+FROM generate_series(1, 10000) AS gs;
+CREATE TABLE cs_b AS SELECT * FROM cs_a;
+ANALYZE cs_a, cs_b;
+
+CREATE TABLE cs_predictions (id serial, compact boolean, str text);
+
+CREATE FUNCTION cs_expln(query_string text) RETURNS SETOF text AS $$
+BEGIN
+    RETURN QUERY
+        EXECUTE format('EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF, SUMMARY OFF) %s', query_string);
+    RETURN;
+END;
+$$ LANGUAGE PLPGSQL;
+
+-- Learn on the queries from scratch with learning data in double precision
+SET aqo.compact_storage = 'off';
+SELECT true AS success FROM aqo_reset();
+SELECT count(*) > 0 AS learned FROM cs_expln('
+SELECT count(*) FROM cs_a WHERE x < 10 AND y < 10') AS str;
+SELECT count(*) > 0 AS learned FROM cs_expln('
+SELECT count(*) FROM cs_a JOIN cs_b ON (cs_a.x = cs_b.y)
+WHERE cs_a.x < 20 AND cs_b.x < 20') AS str;
+
+INSERT INTO cs_predictions (compact, str)
+SELECT false, str FROM cs_expln('
+SELECT count(*) FROM cs_a WHERE x < 10 AND y < 10') AS str
+WHERE str LIKE '%AQO: rows=%';
+INSERT INTO cs_predictions (compact, str)
+SELECT false, str FROM cs_expln('
+SELECT count(*) FROM cs_a JOIN cs_b ON (cs_a.x = cs_b.y)
+WHERE cs_a.x < 20 AND cs_b.x < 20') AS str
+WHERE str LIKE '%AQO: rows=%';
+SELECT used_bytes AS used_double FROM aqo_data_memory_stats() \gset
+
+-- The same in single precision
+SET aqo.compact_storage = 'on';
+SELECT true AS success FROM aqo_reset();
+SELECT count(*) > 0 AS learned FROM cs_expln('
+SELECT count(*) FROM cs_a WHERE x < 10 AND y < 10') AS str;
+SELECT count(*) > 0 AS learned FROM cs_expln('
+SELECT count(*) FROM cs_a JOIN cs_b ON (cs_a.x = cs_b.y)
+WHERE cs_a.x < 20 AND cs_b.x < 20') AS str;
+
+INSERT INTO cs_predictions (compact, str)
+SELECT true, str FROM cs_expln('
+SELECT count(*) FROM cs_a WHERE x < 10 AND y < 10') AS str
+WHERE str LIKE '%AQO: rows=%';
+INSERT INTO cs_predictions (compact, str)
+SELECT true, str FROM cs_expln('
+SELECT count(*) FROM cs_a JOIN cs_b ON (cs_a.x = cs_b.y)
+WHERE cs_a.x < 20 AND cs_b.x < 20') AS str
+WHERE str LIKE '%AQO: rows=%';
+SELECT used_bytes < :used_double AS compact FROM aqo_data_memory_stats();
+
+-- Rounding to float4 doesn't change the predictions
+SET aqo.mode = 'disabled';
+WITH d AS (
+	SELECT row_number() OVER (ORDER BY id) AS n, str
+	FROM cs_predictions WHERE NOT compact),
+f AS (
+	SELECT row_number() OVER (ORDER BY id) AS n, str
+	FROM cs_predictions WHERE compact)
+SELECT count(*) > 0 AS predicted,
+	   count(*) FILTER (WHERE d.str IS DISTINCT FROM f.str) AS differences
+FROM d FULL JOIN f USING (n);
+
+RESET aqo.compact_storage;
+DROP FUNCTION cs_expln;
+DROP TABLE cs_a, cs_b, cs_predictions;
+SELECT true AS success FROM aqo_reset();
+DROP EXTENSION aqo;
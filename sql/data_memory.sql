@@ -0,0 +1,46 @@
+-- Preliminaries
+CREATE EXTENSION IF NOT EXISTS aqo;
+SELECT true AS success FROM aqo_reset();
+
+SET aqo.mode = 'learn';
+
+CREATE TABLE dm_a AS SELECT gs AS x, gs % 10 AS y FROM generate_series(1, 1000) AS gs;
+ANALYZE dm_a;
+
+SELECT reallocations AS reallocs0, inplace_updates AS inplace0
+FROM aqo_data_memory_stats() \gset
+
+-- Each execution adds a row into the subspaces of the query
+SELECT count(*) FROM dm_a WHERE x < 100 AND y < 1;
+SELECT count(*) FROM dm_a WHERE x < 200 AND y < 2;
+SELECT count(*) FROM dm_a WHERE x < 300 AND y < 3;
+SELECT count(*) FROM dm_a WHERE x < 400 AND y < 4;
+SELECT count(*) FROM dm_a WHERE x < 500 AND y < 5;
+SELECT count(*) FROM dm_a WHERE x < 600 AND y < 6;
+SELECT count(*) FROM dm_a WHERE x < 700 AND y < 7;
+SELECT count(*) FROM dm_a WHERE x < 800 AND y < 8;
+SELECT count(*) FROM dm_a WHERE x < 900 AND y < 9;
+SELECT count(*) FROM dm_a WHERE x < 1000 AND y < 10;
+SELECT count(*) FROM dm_a WHERE x < 1100 AND y < 11;
+SELECT count(*) FROM dm_a WHERE x < 1200 AND y < 12;
+
+-- Most of the new rows are stored without reallocation of the chunks
+SELECT inplace_updates - :inplace0 > reallocations - :reallocs0 AS inplace,
+	   used_bytes <= allocated_bytes AS allocated,
+	   allocated_bytes <= dsa_bytes AS in_dsa
+FROM aqo_data_memory_stats();
+
+-- Query texts and ML data are stored in separate DSA areas
+SET aqo.mode = 'disabled';
+SELECT name, used_size <= allocated_size AS used, size_limit
+FROM aqo_dsa_usage() ORDER BY name;
+
+-- Removal of the query texts doesn't touch the ML data
+SELECT count(*) AS nfss FROM aqo_data \gset
+SELECT aqo_query_texts_reset() > 0 AS removed;
+SELECT count(*) AS ntexts FROM aqo_query_texts;
+SELECT count(*) = :nfss AS kept FROM aqo_data;
+
+DROP TABLE dm_a;
+SELECT true AS success FROM aqo_reset();
+DROP EXTENSION aqo;
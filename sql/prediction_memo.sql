@@ -0,0 +1,27 @@
+-- Preliminaries
+CREATE EXTENSION IF NOT EXISTS aqo;
+SELECT true AS success FROM aqo_reset();
+
+SET aqo.mode = 'learn';
+SET aqo.join_threshold = 0;
+
+CREATE TABLE pm_a AS SELECT gs AS x, gs % 10 AS y FROM generate_series(1, 1000) AS gs;
+CREATE TABLE pm_b AS SELECT * FROM pm_a;
+CREATE INDEX pm_b_x_idx ON pm_b (x);
+ANALYZE pm_a, pm_b;
+
+SELECT hits AS hits0, misses AS misses0 FROM aqo_prediction_memo_stats() \gset
+
+-- Planning of a join asks for predictions of the same objects many times
+SELECT count(*) FROM pm_a, pm_b WHERE pm_a.x = pm_b.x AND pm_a.y = 1;
+SELECT count(*) FROM pm_a, pm_b WHERE pm_a.x = pm_b.x AND pm_a.y = 1;
+
+-- Grouping of an unknown relation asks for its prediction once more
+SELECT count(*) FROM (SELECT y FROM pm_a WHERE x < 100 GROUP BY y) AS q;
+
+SELECT misses > :misses0 AS predicted, hits > :hits0 AS memoized
+FROM aqo_prediction_memo_stats();
+
+DROP TABLE pm_a, pm_b;
+SELECT true AS success FROM aqo_reset();
+DROP EXTENSION aqo;
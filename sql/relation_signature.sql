@@ -0,0 +1,36 @@
+-- Signatures of relations are cached by a backend until the relation is changed
+CREATE EXTENSION IF NOT EXISTS aqo;
+SELECT true AS success FROM aqo_reset();
+
+SET aqo.mode = 'learn';
+SET aqo.join_threshold = 0;
+
+CREATE SCHEMA rs_schema;
+CREATE TABLE rs_schema.rs_a AS SELECT gs AS x FROM generate_series(1, 100) AS gs;
+ANALYZE rs_schema.rs_a;
+SELECT 'rs_schema.rs_a'::regclass::oid AS relid \gset
+
+SELECT count(*) FROM rs_schema.rs_a WHERE x < 10;
+SELECT count(DISTINCT fss) AS nfss FROM aqo_data WHERE :relid = ANY (oids) \gset
+
+-- The same relation has the same signature
+SELECT count(*) FROM rs_schema.rs_a WHERE x < 10;
+SELECT count(DISTINCT fss) = :nfss AS same
+FROM aqo_data WHERE :relid = ANY (oids);
+
+-- Name of the relation is changed, so feature subspaces are changed too
+ALTER TABLE rs_schema.rs_a RENAME TO rs_b;
+SELECT count(*) FROM rs_schema.rs_b WHERE x < 10;
+SELECT count(DISTINCT fss) > :nfss AS changed
+FROM aqo_data WHERE :relid = ANY (oids);
+SELECT count(DISTINCT fss) AS nfss FROM aqo_data WHERE :relid = ANY (oids) \gset
+
+-- Renaming of the schema doesn't invalidate its relations, but changes them
+ALTER SCHEMA rs_schema RENAME TO rs_schema2;
+SELECT count(*) FROM rs_schema2.rs_b WHERE x < 10;
+SELECT count(DISTINCT fss) > :nfss AS changed
+FROM aqo_data WHERE :relid = ANY (oids);
+
+DROP SCHEMA rs_schema2 CASCADE;
+SELECT true AS success FROM aqo_reset();
+DROP EXTENSION aqo;
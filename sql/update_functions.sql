@@ -202,6 +202,14 @@ SELECT aqo_data_update(1, 1, 1, '{{1}}', '{1, 1}', '{1}', '{1, 2, 3}');
 SELECT aqo_data_update(1, 1, 1, '{{1}}', '{1}', '{1, 1}', '{1, 2, 3}');
 SELECT aqo_data_update(1, 1, 1, '{{1}, {2}}', '{1}', '{1}', '{1, 2, 3}');
 
+-- Subspace can contain more rows than aqo.fss_max_rows allows to learn: it
+-- keeps own capacity, which it had on an instance the data was dumped from.
+SELECT aqo_data_update(1, 1, 1,
+  (SELECT array_agg(ARRAY[-x::double precision]) FROM generate_series(1, 40) x),
+  array_fill(1::double precision, ARRAY[40]),
+  array_fill(1::double precision, ARRAY[40]), '{1, 2, 3}');
+SELECT array_length(targets, 1) AS nrows FROM aqo_data WHERE fs = 1 AND fss = 1;
+
 SET aqo.mode='disabled';
 
 DROP EXTENSION aqo CASCADE;
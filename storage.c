@@ -17,14 +17,21 @@
 
 #include "postgres.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "funcapi.h"
+#include "lib/stringinfo.h"
 #include "miscadmin.h"
 #include "pgstat.h"
+#include "port/pg_crc32c.h"
+#include "storage/fd.h"
 
 #include "aqo.h"
 #include "aqo_shared.h"
+#include "checkpointer.h"
 #include "machine_learning.h"
 #include "preprocessing.h"
 #include "storage.h"
@@ -34,6 +41,7 @@
 #define PGAQO_STAT_FILE	PGSTAT_STAT_PERMANENT_DIRECTORY "/pgaqo_statistics.stat"
 #define PGAQO_TEXT_FILE	PGSTAT_STAT_PERMANENT_DIRECTORY "/pgaqo_query_texts.stat"
 #define PGAQO_DATA_FILE	PGSTAT_STAT_PERMANENT_DIRECTORY "/pgaqo_data.stat"
+#define PGAQO_DATA_DELTA_FILE	PGSTAT_STAT_PERMANENT_DIRECTORY "/pgaqo_data.delta"
 #define PGAQO_QUERIES_FILE	PGSTAT_STAT_PERMANENT_DIRECTORY "/pgaqo_queries.stat"
 
 #define AQO_DATA_COLUMNS			(7)
@@ -65,19 +73,107 @@ typedef bool (*deform_record_t) (void *data, size_t size);
 
 int querytext_max_size = 1000;
 int dsm_size_max = 100; /* in MB */
+/* In MB. Fits aqo.fs_max_items texts of the 1kB size class of DSA */
+int dsm_qtexts_size_max = 20;
+bool aqo_compact_storage = false;
 
 HTAB *stat_htab = NULL;
 HTAB *queries_htab = NULL;
 HTAB *qtexts_htab = NULL;
 dsa_area *qtext_dsa = NULL;
 HTAB *data_htab = NULL;
+HTAB *fss_index_htab = NULL;
 dsa_area *data_dsa = NULL;
 HTAB *deactivated_queries = NULL;
 
 /* Used to check data file consistency */
-static const uint32 PGAQO_FILE_HEADER = 123467589;
+static const uint32 PGAQO_FILE_HEADER = 123467597;
 static const uint32 PGAQO_PG_MAJOR_VERSION = PG_VERSION_NUM / 100;
 
+/*
+ * Files of AQO 1.6. They are read and converted into the current format on
+ * the next flush. See data_load().
+ */
+static const uint32 PGAQO_FILE_HEADER_1_6 = 123467589;
+
+/*
+ * Format of the ML data file is changed more often than the others. Change
+ * this value on each change of DataEntry or the DSA chunk layout.
+ */
+static const uint32 PGAQO_DATA_FILE_HEADER = 123467598;
+static const uint32 PGAQO_DATA_DELTA_HEADER = 123467599;
+
+/*
+ * Fixed part of a record of the ML data file of AQO 1.6. The 32-bit feature
+ * subspace hash is stored sign-extended in the same 64-bit key, so the records
+ * can be used in the aqo.legacy_clause_hash mode.
+ */
+typedef struct DataEntry_1_6
+{
+	data_key	key;
+	int			cols;
+	int			rows;
+	int			nrels;
+	dsa_pointer	data_dp;
+} DataEntry_1_6;
+
+/*
+ * Records of the storage files are grouped into blocks. Each block has its
+ * own checksum, so a corrupted block is skipped on load instead of the whole
+ * file. The header of a block is checksummed separately: without it, the next
+ * block can't be found.
+ */
+typedef struct StorageBlockHeader
+{
+	uint32		len;		/* size of the records of the block */
+	uint32		nrecs;
+	pg_crc32c	crc;		/* CRC of the records */
+	pg_crc32c	hdr_crc;	/* CRC of the fields above */
+} StorageBlockHeader;
+
+/* Block is closed when its records exceed this size */
+#define STORAGE_BLOCK_SIZE	(64 * 1024)
+
+/*
+ * Layout of the ML data file. It is mapped into memory, and entries are moved
+ * into the hash table on the first lookup. Records are MAXALIGN'ed, so they
+ * are used right in the mapping. The index at the end of the file is sorted by
+ * (fss, fs): entries of a subspace are adjacent for the wide search.
+ */
+typedef struct DataFileHeader
+{
+	uint32		magic;
+	uint32		pgver;
+	int64		nrecs;
+	uint64		index_offset;
+	pg_crc32c	index_crc;
+	uint32		generation;	/* see _aqo_data_compact() */
+} DataFileHeader;
+
+typedef struct DataFileIndexEntry
+{
+	data_key	key;
+	uint64		offset;
+	uint64		size;
+	pg_crc32c	crc;		/* CRC of the record */
+	uint32		reserved;
+} DataFileIndexEntry;
+
+/*
+ * The delta log isn't compacted into the ML data file until it grows larger
+ * than the file itself or this size.
+ *
+ * Header of the log is the magic, the version of PostgreSQL and the generation
+ * of the ML data file the log was started for.
+ */
+#define PGAQO_DATA_DELTA_MIN_SIZE	(1024 * 1024)
+
+/* Keys of the ML data removed since the last flush, see _data_tombstone_add() */
+#define DataTombstones() \
+	((data_key *) dsa_get_address(data_dsa, aqo_state->data_tombstones))
+#define DATA_TOMBSTONES_MAX	\
+	((int) (PGAQO_DATA_DELTA_MIN_SIZE / sizeof(data_key)))
+
 /*
  * Used for internal aqo_queries_store() calls.
  * No NULL arguments expected in this case.
@@ -87,16 +183,32 @@ AqoQueriesNullArgs aqo_queries_nulls = { false, false, false, false };
 
 static ArrayType *form_matrix(double *matrix, int nrows, int ncols);
 static void dsa_init(void);
-static int data_store(const char *filename, form_record_t callback,
-					  long nrecs, void *ctx);
-static void data_load(const char *filename, deform_record_t callback, void *ctx);
+static int data_store(const char *filename, uint32 header,
+					  form_record_t callback, long nrecs, void *ctx);
+static bool data_load(const char *filename, uint32 header,
+					  deform_record_t callback, void *ctx);
+static void storage_file_set_aside(const char *filename);
 static size_t _compute_data_dsa(const DataEntry *entry);
+static size_t _data_chunk_size(const DataEntry *entry, int rows);
+static int _data_alloc_rows(int rows, int capacity);
+static int _aqo_data_write_file(uint32 generation);
+static bool _data_file_check_crc(const void *data, size_t size,
+								 pg_crc32c expected);
+static bool _data_file_forget(const data_key *key);
+static bool _data_file_materialize_key(const data_key *key, uint32 hashcode);
+static void _data_file_materialize_fss(int64 fss);
+static void _data_file_materialize_all(void);
+static long _data_file_discard(void);
+static void _aqo_data_load_pending(void);
+static char *_data_read_doubles(double *dst, char *src, int n, bool compact);
+static char *_data_write_doubles(char *dst, const double *src, int n,
+								 bool compact);
 
 static bool _aqo_stat_remove(uint64 queryid);
 static bool _aqo_queries_remove(uint64 queryid);
 static bool _aqo_qtexts_remove(uint64 queryid);
 static bool _aqo_data_remove(data_key *key);
-static bool neirest_neighbor(double **matrix, int old_rows, double *neighbor, int cols);
+static bool neirest_neighbor(const double *matrix, int old_rows, double *neighbor, int cols);
 static double fs_distance(double *a, double *b, int len);
 
 PG_FUNCTION_INFO_V1(aqo_query_stat);
@@ -114,16 +226,27 @@ PG_FUNCTION_INFO_V1(aqo_execution_time);
 PG_FUNCTION_INFO_V1(aqo_query_texts_update);
 PG_FUNCTION_INFO_V1(aqo_query_stat_update);
 PG_FUNCTION_INFO_V1(aqo_data_update);
+PG_FUNCTION_INFO_V1(aqo_eviction_stats);
+PG_FUNCTION_INFO_V1(aqo_data_memory_stats);
+PG_FUNCTION_INFO_V1(aqo_query_texts_reset);
+PG_FUNCTION_INFO_V1(aqo_dsa_usage);
 
 
 bool
-load_fss_ext(uint64 fs, int fss, OkNNrdata *data, List **reloids)
+load_fss_ext(uint64 fs, int64 fss, OkNNrdata *data, List **reloids)
 {
 	return load_aqo_data(fs, fss, data, reloids, false, NULL);
 }
 
 bool
-update_fss_ext(uint64 fs, int fss, OkNNrdata *data, List *reloids)
+predict_fss_ext(uint64 fs, int64 fss, int ncols, double *features,
+				double *result)
+{
+	return aqo_data_predict(fs, fss, ncols, features, result);
+}
+
+bool
+update_fss_ext(uint64 fs, int64 fss, OkNNrdata *data, List *reloids)
 {
 	/*
 	 * 'reloids' explictly passed to aqo_data_store().
@@ -131,7 +254,7 @@ update_fss_ext(uint64 fs, int fss, OkNNrdata *data, List *reloids)
 	 * set to 0 and NULL repectively.
 	 */
 	AqoDataArgs data_arg =
-			{data->rows, data->cols, 0, data->matrix,
+			{data->rows, data->cols, 0, data->capacity, data->matrix,
 			 data->targets, data->rfactors, NULL};
 	return aqo_data_store(fs, fss, &data_arg, reloids);
 }
@@ -306,6 +429,7 @@ aqo_stat_store(uint64 queryid, bool use_aqo, AqoStatArgs *stat_arg,
 
 		aqo_state->stat_changed = true;
 		LWLockRelease(&aqo_state->stat_lock);
+		checkpointer_note_dirty(sizeof(StatEntry));
 		return entry;
 	}
 
@@ -357,6 +481,7 @@ aqo_stat_store(uint64 queryid, bool use_aqo, AqoStatArgs *stat_arg,
 	entry = memcpy(palloc(sizeof(StatEntry)), entry, sizeof(StatEntry));
 	aqo_state->stat_changed = true;
 	LWLockRelease(&aqo_state->stat_lock);
+	checkpointer_note_dirty(sizeof(StatEntry));
 	return entry;
 }
 
@@ -486,7 +611,8 @@ aqo_stat_flush(void)
 
 	entries = hash_get_num_entries(stat_htab);
 	hash_seq_init(&hash_seq, stat_htab);
-	ret = data_store(PGAQO_STAT_FILE, _form_stat_record_cb, entries,
+	ret = data_store(PGAQO_STAT_FILE, PGAQO_FILE_HEADER,
+					 _form_stat_record_cb, entries,
 					 (void *) &hash_seq);
 	if (ret != 0)
 		hash_seq_term(&hash_seq);
@@ -539,7 +665,8 @@ aqo_qtexts_flush(void)
 
 	entries = hash_get_num_entries(qtexts_htab);
 	hash_seq_init(&hash_seq, qtexts_htab);
-	ret = data_store(PGAQO_TEXT_FILE, _form_qtext_record_cb, entries,
+	ret = data_store(PGAQO_TEXT_FILE, PGAQO_FILE_HEADER,
+					 _form_qtext_record_cb, entries,
 					 (void *) &hash_seq);
 	if (ret != 0)
 		hash_seq_term(&hash_seq);
@@ -552,22 +679,16 @@ end:
 }
 
 /*
- * Getting a hash table iterator, return a newly allocated memory chunk and its
- * size for subsequent writing into storage.
+ * Return a newly allocated memory chunk with the entry and its ML data and the
+ * size of the chunk for subsequent writing into storage.
  */
 static void *
-_form_data_record_cb(void *ctx, size_t *size)
+_form_data_record(DataEntry *entry, size_t *size)
 {
-	HASH_SEQ_STATUS	   *hash_seq = (HASH_SEQ_STATUS *) ctx;
-	DataEntry		   *entry;
-	char			   *data;
-	char			   *ptr,
-					   *dsa_ptr;
-	size_t				sz;
-
-	entry = hash_seq_search(hash_seq);
-	if (entry == NULL)
-		return NULL;
+	char	   *data;
+	char	   *ptr,
+			   *dsa_ptr;
+	size_t		sz;
 
 	/* Size of data is DataEntry (without DSA pointer) plus size of DSA chunk */
 	sz = offsetof(DataEntry, data_dp) + _compute_data_dsa(entry);
@@ -587,35 +708,277 @@ _form_data_record_cb(void *ctx, size_t *size)
 	return data;
 }
 
-void
-aqo_data_flush(void)
+/*
+ * The ML data hash table is partitioned the same way as the buffer mapping
+ * table: an entry is protected by the lock of its partition, chosen by the
+ * hash code of the key. Operations on the whole table take all the partition
+ * locks in the order of their numbers. The data_lock protects the fss index
+ * and the tombstones and is always taken after the partition locks.
+ */
+#define DataPartitionLock(hashcode) \
+	(&aqo_state->data_partition_locks[(hashcode) % AQO_DATA_PARTITIONS].lock)
+
+static void
+data_lock_all(LWLockMode mode)
+{
+	int		i;
+
+	for (i = 0; i < AQO_DATA_PARTITIONS; i++)
+		LWLockAcquire(&aqo_state->data_partition_locks[i].lock, mode);
+}
+
+static void
+data_unlock_all(void)
+{
+	int		i;
+
+	for (i = AQO_DATA_PARTITIONS - 1; i >= 0; i--)
+		LWLockRelease(&aqo_state->data_partition_locks[i].lock);
+}
+
+#ifdef USE_ASSERT_CHECKING
+static bool
+data_lock_held_by_me(const data_key *key, LWLockMode mode)
+{
+	uint32	hashcode = get_hash_value(data_htab, key);
+
+	return LWLockHeldByMeInMode(DataPartitionLock(hashcode), mode);
+}
+#endif
+
+/*
+ * Entries of the ML data table are evicted by a clock sweep when the table is
+ * full, like shared buffers: each use of an entry bumps its usage count up to
+ * the limit, the sweep decrements it and evicts entries with zero count. So
+ * an entry survives as many sweeps as it was used recently.
+ *
+ * The count is bumped without a lock, by readers too. It is just a hint: a
+ * lost or extra increment doesn't matter.
+ */
+#define DATA_USAGE_MAX			(5)
+
+/* Part of the table freed by one run of the sweep */
+#define DATA_EVICT_FRACTION		(64)
+
+static inline void
+data_entry_touch(DataEntry *entry)
+{
+	/* Don't dirty the cache line of a hot entry */
+	if (pg_atomic_read_u32(&entry->usage_count) < DATA_USAGE_MAX)
+		(void) pg_atomic_fetch_add_u32(&entry->usage_count, 1);
+}
+
+/*
+ * Reserve room for a new entry of the ML data table.
+ *
+ * Inserts into different partitions run concurrently, so the number of entries
+ * in the hash table can't be checked against the limit: each inserter could see
+ * the last free item. Caller must call data_entry_release() on removal of the
+ * entry or if it isn't inserted after all.
+ */
+static bool
+data_entry_reserve(void)
+{
+	uint32	nentries = pg_atomic_read_u32(&aqo_state->data_nentries);
+
+	while (nentries < (uint32) fss_max_items)
+	{
+		if (pg_atomic_compare_exchange_u32(&aqo_state->data_nentries,
+										   &nentries, nentries + 1))
+			return true;
+	}
+	return false;
+}
+
+static inline void
+data_entry_release(void)
+{
+	Assert(pg_atomic_read_u32(&aqo_state->data_nentries) > 0);
+	(void) pg_atomic_fetch_sub_u32(&aqo_state->data_nentries, 1);
+}
+
+/*
+ * Rewrite the ML data file with all the entries and drop the delta log.
+ * Caller must hold all the partition locks exclusively.
+ *
+ * The new file gets the next generation number. The delta log belongs to the
+ * generation it was started for, so the log is stale as soon as the new file
+ * is renamed into place: if we crash before the log is removed, it is ignored
+ * on load (see _aqo_data_load_delta()).
+ */
+static void
+_aqo_data_compact(void)
 {
 	HASH_SEQ_STATUS	hash_seq;
-	int				ret;
-	long			entries;
+	DataEntry	   *entry;
+	struct stat		st;
+
+	/* The new file replaces the old one, so read everything from it */
+	_data_file_materialize_all();
+
+	if (_aqo_data_write_file(aqo_state->data_generation + 1) != 0)
+		return;
+	aqo_state->data_generation++;
+
+	/* The next flush starts a new log anyway, see _aqo_data_append_delta() */
+	aqo_state->data_delta_size = 0;
+	if (unlink(PGAQO_DATA_DELTA_FILE) < 0 && errno != ENOENT)
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not remove file \"%s\": %m",
+						PGAQO_DATA_DELTA_FILE)));
+
+	/* Hash table and disk storage are now consistent */
+	hash_seq_init(&hash_seq, data_htab);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		entry->dirty = false;
+
+	aqo_state->data_base_size = (stat(PGAQO_DATA_FILE, &st) == 0) ?
+															st.st_size : 0;
+	pg_atomic_write_u32(&aqo_state->data_removed, 0);
+	pg_atomic_write_u32(&aqo_state->data_changed, 0);
+	aqo_state->data_ntombstones = 0;
+}
+
+/*
+ * Append the entries changed since the last flush to the delta log.
+ * Caller must hold all the partition locks exclusively.
+ */
+static void
+_aqo_data_append_delta(void)
+{
+	HASH_SEQ_STATUS	hash_seq;
+	DataEntry	   *entry;
+	FILE		   *file;
+	void		   *data = NULL;
+	long			size = aqo_state->data_delta_size;
+	int				counter = 0;
+	int				i;
+
+	/* A stale log of the previous generation may still exist */
+	file = AllocateFile(PGAQO_DATA_DELTA_FILE,
+						(size == 0) ? PG_BINARY_W : PG_BINARY_A);
+	if (file == NULL)
+		goto error;
+
+	if (size == 0)
+	{
+		if (fwrite(&PGAQO_DATA_DELTA_HEADER, sizeof(uint32), 1, file) != 1 ||
+			fwrite(&PGAQO_PG_MAJOR_VERSION, sizeof(uint32), 1, file) != 1 ||
+			fwrite(&aqo_state->data_generation, sizeof(uint32), 1, file) != 1)
+			goto error;
+		size += 3 * sizeof(uint32);
+	}
+
+	/*
+	 * Removals go first: an entry could be removed and added again since the
+	 * last flush. Nobody adds a tombstone, all the partitions are locked.
+	 */
+	for (i = 0; i < aqo_state->data_ntombstones; i++)
+	{
+		data_key   *key = &DataTombstones()[i];
+		size_t		sz = sizeof(data_key);
+		pg_crc32c	crc;
+
+		INIT_CRC32C(crc);
+		COMP_CRC32C(crc, key, sz);
+		FIN_CRC32C(crc);
+		if (fwrite(&sz, sizeof(sz), 1, file) != 1 ||
+			fwrite(&crc, sizeof(crc), 1, file) != 1 ||
+			fwrite(key, sz, 1, file) != 1)
+			goto error;
+
+		size += sizeof(sz) + sizeof(crc) + sz;
+	}
+
+	hash_seq_init(&hash_seq, data_htab);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		size_t		sz;
+		pg_crc32c	crc;
+
+		if (!entry->dirty)
+			continue;
+
+		data = _form_data_record(entry, &sz);
+		INIT_CRC32C(crc);
+		COMP_CRC32C(crc, data, sz);
+		FIN_CRC32C(crc);
+		if (fwrite(&sz, sizeof(sz), 1, file) != 1 ||
+			fwrite(&crc, sizeof(crc), 1, file) != 1 ||
+			fwrite(data, sz, 1, file) != 1)
+		{
+			hash_seq_term(&hash_seq);
+			goto error;
+		}
+		pfree(data);
+		data = NULL;
+
+		entry->dirty = false;
+		size += sizeof(sz) + sizeof(crc) + sz;
+		counter++;
+	}
+
+	if (fflush(file) != 0 || pg_fsync(fileno(file)) != 0)
+		goto error;
+
+	if (FreeFile(file))
+	{
+		file = NULL;
+		goto error;
+	}
+
+	aqo_state->data_delta_size = size;
+	pg_atomic_write_u32(&aqo_state->data_changed, 0);
+	elog(DEBUG1, "[AQO] %d records and %d removals appended to file %s.",
+		 counter, aqo_state->data_ntombstones, PGAQO_DATA_DELTA_FILE);
+	aqo_state->data_ntombstones = 0;
+	return;
+
+error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not write AQO file \"%s\": %m",
+					PGAQO_DATA_DELTA_FILE)));
+
+	if (file)
+		FreeFile(file);
+	if (data)
+		pfree(data);
+
+	/*
+	 * The log may have a torn tail now, and some entries aren't dirty anymore.
+	 * Rewrite everything on the next flush.
+	 */
+	pg_atomic_write_u32(&aqo_state->data_removed, 1);
+}
 
+/*
+ * Write changes of the ML data to the disk.
+ *
+ * Usually, only entries changed or removed since the last flush are appended
+ * to the delta log. The whole ML data file is rewritten (and the log is
+ * dropped) if the log became too large or can't describe the changes.
+ */
+void
+aqo_data_flush(void)
+{
 	dsa_init();
-	LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
+	data_lock_all(LW_EXCLUSIVE);
 
-	if (!aqo_state->data_changed)
+	if (!pg_atomic_read_u32(&aqo_state->data_changed))
 		/* XXX: mull over forced mode. */
 		goto end;
 
-	entries = hash_get_num_entries(data_htab);
-	hash_seq_init(&hash_seq, data_htab);
-	ret = data_store(PGAQO_DATA_FILE, _form_data_record_cb, entries,
-					 (void *) &hash_seq);
-	if (ret != 0)
-		/*
-		 * Something happened and storing procedure hasn't finished walking
-		 * along all records of the hash table.
-		 */
-		hash_seq_term(&hash_seq);
+	if (pg_atomic_read_u32(&aqo_state->data_removed) ||
+		aqo_state->data_delta_size > Max(aqo_state->data_base_size,
+										 PGAQO_DATA_DELTA_MIN_SIZE))
+		_aqo_data_compact();
 	else
-		/* Hash table and disk storage are now consistent */
-		aqo_state->data_changed = false;
+		_aqo_data_append_delta();
+
 end:
-	LWLockRelease(&aqo_state->data_lock);
+	data_unlock_all();
 }
 
 static void *
@@ -646,7 +1009,8 @@ aqo_queries_flush(void)
 
 	entries = hash_get_num_entries(queries_htab);
 	hash_seq_init(&hash_seq, queries_htab);
-	ret = data_store(PGAQO_QUERIES_FILE, _form_queries_record_cb, entries,
+	ret = data_store(PGAQO_QUERIES_FILE, PGAQO_FILE_HEADER,
+					 _form_queries_record_cb, entries,
 					 (void *) &hash_seq);
 	if (ret != 0)
 		hash_seq_term(&hash_seq);
@@ -658,35 +1022,75 @@ end:
 	LWLockRelease(&aqo_state->queries_lock);
 }
 
+/*
+ * Write the block of records with its header into the file.
+ */
+static bool
+_data_store_block(FILE *file, StringInfo buf, uint32 nrecs)
+{
+	StorageBlockHeader	hdr;
+
+	if (nrecs == 0)
+		return true;
+
+	hdr.len = buf->len;
+	hdr.nrecs = nrecs;
+	INIT_CRC32C(hdr.crc);
+	COMP_CRC32C(hdr.crc, buf->data, buf->len);
+	FIN_CRC32C(hdr.crc);
+	INIT_CRC32C(hdr.hdr_crc);
+	COMP_CRC32C(hdr.hdr_crc, &hdr, offsetof(StorageBlockHeader, hdr_crc));
+	FIN_CRC32C(hdr.hdr_crc);
+
+	if (fwrite(&hdr, sizeof(hdr), 1, file) != 1 ||
+		fwrite(buf->data, buf->len, 1, file) != 1)
+		return false;
+
+	resetStringInfo(buf);
+	return true;
+}
+
 static int
-data_store(const char *filename, form_record_t callback,
+data_store(const char *filename, uint32 header, form_record_t callback,
 		   long nrecs, void *ctx)
 {
-	FILE   *file;
-	size_t	size;
-	uint32	counter = 0;
-	void   *data;
-	char   *tmpfile;
-
+	FILE		   *file;
+	size_t			size;
+	uint32			counter = 0;
+	uint32			nblock = 0;
+	void		   *data;
+	char		   *tmpfile;
+	StringInfoData	buf;
+
+	initStringInfo(&buf);
 	tmpfile = psprintf("%s.tmp", filename);
 	file = AllocateFile(tmpfile, PG_BINARY_W);
 	if (file == NULL)
 		goto error;
 
-	if (fwrite(&PGAQO_FILE_HEADER, sizeof(uint32), 1, file) != 1 ||
+	if (fwrite(&header, sizeof(uint32), 1, file) != 1 ||
 		fwrite(&PGAQO_PG_MAJOR_VERSION, sizeof(uint32), 1, file) != 1 ||
 		fwrite(&nrecs, sizeof(long), 1, file) != 1)
 		goto error;
 
 	while ((data = callback(ctx, &size)) != NULL)
 	{
-		/* TODO: Add CRC code ? */
-		if (fwrite(&size, sizeof(size), 1, file) != 1 ||
-			fwrite(data, size, 1, file) != 1)
-			goto error;
+		appendBinaryStringInfo(&buf, (char *) &size, sizeof(size));
+		appendBinaryStringInfo(&buf, data, size);
+		nblock++;
 		counter++;
+
+		if (buf.len >= STORAGE_BLOCK_SIZE)
+		{
+			if (!_data_store_block(file, &buf, nblock))
+				goto error;
+			nblock = 0;
+		}
 	}
 
+	if (!_data_store_block(file, &buf, nblock))
+		goto error;
+
 	Assert(counter == nrecs);
 	if (FreeFile(file))
 	{
@@ -697,6 +1101,7 @@ data_store(const char *filename, form_record_t callback,
 	/* Parallel (re)writing into a file haven't happen. */
 	(void) durable_rename(tmpfile, filename, PANIC);
 	elog(LOG, "[AQO] %d records stored in file %s.", counter, filename);
+	pfree(buf.data);
 	return 0;
 
 error:
@@ -708,6 +1113,7 @@ error:
 		FreeFile(file);
 	unlink(tmpfile);
 	pfree(tmpfile);
+	pfree(buf.data);
 	return -1;
 }
 
@@ -719,12 +1125,17 @@ _deform_stat_record_cb(void *data, size_t size)
 	uint64		queryid;
 
 	Assert(LWLockHeldByMeInMode(&aqo_state->stat_lock, LW_EXCLUSIVE));
-	Assert(size == sizeof(StatEntry));
+
+	/* AQO 1.6 didn't have the fields starting from execs_at_sweep */
+	if (size != sizeof(StatEntry) &&
+		size != offsetof(StatEntry, execs_at_sweep))
+		return false;
 
 	queryid = ((StatEntry *) data)->queryid;
 	entry = (StatEntry *) hash_search(stat_htab, &queryid, HASH_ENTER, &found);
 	Assert(!found && entry);
-	memcpy(entry, data, sizeof(StatEntry));
+	memset(entry, 0, sizeof(StatEntry));
+	memcpy(entry, data, size);
 	return true;
 }
 
@@ -738,7 +1149,9 @@ aqo_stat_load(void)
 	/* Load on postmaster sturtup. So no any concurrent actions possible here. */
 	Assert(hash_get_num_entries(stat_htab) == 0);
 
-	data_load(PGAQO_STAT_FILE, _deform_stat_record_cb, NULL);
+	if (data_load(PGAQO_STAT_FILE, PGAQO_FILE_HEADER, _deform_stat_record_cb,
+				  NULL))
+		aqo_state->stat_changed = true;
 
 	LWLockRelease(&aqo_state->stat_lock);
 }
@@ -769,7 +1182,7 @@ _deform_qtexts_record_cb(void *data, size_t size)
 										   HASH_ENTER, &found);
 	Assert(!found);
 
-	entry->qtext_dp = dsa_allocate(qtext_dsa, len);
+	entry->qtext_dp = dsa_allocate_extended(qtext_dsa, len, DSA_ALLOC_NO_OOM);
 	if (!_check_dsa_validity(entry->qtext_dp))
 	{
 		/*
@@ -804,12 +1217,13 @@ aqo_qtexts_load(void)
 		return;
 	}
 
-	data_load(PGAQO_TEXT_FILE, _deform_qtexts_record_cb, NULL);
+	/* mem data is consistent with disk, unless the file is converted */
+	aqo_state->qtexts_changed = data_load(PGAQO_TEXT_FILE, PGAQO_FILE_HEADER,
+										  _deform_qtexts_record_cb, NULL);
 
 	/* Check existence of default feature space */
 	(void) hash_search(qtexts_htab, &queryid, HASH_FIND, &found);
 
-	aqo_state->qtexts_changed = false; /* mem data consistent with disk */
 	LWLockRelease(&aqo_state->qtexts_lock);
 
 	if (!found)
@@ -820,76 +1234,1092 @@ aqo_qtexts_load(void)
 }
 
 /*
- * Getting a data chunk from a caller, add a record into the 'ML data'
- * shmem hash table. Allocate and fill DSA chunk for variadic part of the data.
+ * Include the new entry of the ML data into the secondary index.
+ * Caller must hold the lock of the entry's partition exclusively.
  */
-static bool
-_deform_data_record_cb(void *data, size_t size)
+static void
+_fss_index_add(DataEntry *entry)
 {
-	bool		found;
-	DataEntry  *fentry = (DataEntry *) data; /*Depends on a platform? */
-	DataEntry  *entry;
-	size_t		sz;
-	char	   *ptr = (char *) data,
-			   *dsa_ptr;
-
-	Assert(ptr != NULL);
-	Assert(LWLockHeldByMeInMode(&aqo_state->data_lock, LW_EXCLUSIVE));
-
-	entry = (DataEntry *) hash_search(data_htab, &fentry->key,
-									  HASH_ENTER, &found);
-	Assert(!found);
-
-	/* Copy fixed-size part of entry byte-by-byte even with caves */
-	memcpy(entry, fentry, offsetof(DataEntry, data_dp));
-	ptr += offsetof(DataEntry, data_dp);
+	FssIndexEntry  *ientry;
+	bool			found;
 
-	sz = _compute_data_dsa(entry);
-	Assert(sz + offsetof(DataEntry, data_dp) == size);
-	entry->data_dp = dsa_allocate(data_dsa, sz);
+	Assert(data_lock_held_by_me(&entry->key, LW_EXCLUSIVE));
+	LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
 
-	if (!_check_dsa_validity(entry->data_dp))
+	/*
+	 * The index has the same number of elements as the data table at most,
+	 * so it can't overflow.
+	 */
+	ientry = (FssIndexEntry *) hash_search(fss_index_htab, &entry->key.fss,
+										   HASH_ENTER, &found);
+	if (!found)
 	{
-		/*
-		 * DSA stuck into problems. Rollback changes. Return false in belief
-		 * that caller recognize it and don't try to call us more.
-		 */
-		(void) hash_search(data_htab, &fentry->key, HASH_REMOVE, NULL);
-		return false;
+		ientry->nentries = 0;
+		dlist_init(&ientry->entries);
 	}
 
-	dsa_ptr = (char *) dsa_get_address(data_dsa, entry->data_dp);
-	Assert(dsa_ptr != NULL);
-	memcpy(dsa_ptr, ptr, sz);
-	return true;
+	dlist_push_tail(&ientry->entries, &entry->fss_node);
+	ientry->nentries++;
+
+	LWLockRelease(&aqo_state->data_lock);
 }
 
-void
-aqo_data_load(void)
+/*
+ * Exclude the entry of the ML data from the secondary index.
+ * Caller must hold the lock of the entry's partition and the data_lock
+ * exclusively: removals usually come in batches.
+ */
+static void
+_fss_index_remove(DataEntry *entry)
 {
-	Assert(!LWLockHeldByMe(&aqo_state->data_lock));
-	Assert(data_dsa != NULL);
-
-	LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
+	FssIndexEntry  *ientry;
 
-	if (hash_get_num_entries(data_htab) != 0)
-	{
-		/* Someone have done it concurrently. */
-		elog(LOG, "[AQO] Another backend have loaded query data concurrently.");
-		LWLockRelease(&aqo_state->data_lock);
-		return;
-	}
+	Assert(data_lock_held_by_me(&entry->key, LW_EXCLUSIVE));
+	Assert(LWLockHeldByMeInMode(&aqo_state->data_lock, LW_EXCLUSIVE));
 
-	data_load(PGAQO_DATA_FILE, _deform_data_record_cb, NULL);
+	ientry = (FssIndexEntry *) hash_search(fss_index_htab, &entry->key.fss,
+										   HASH_FIND, NULL);
+	if (ientry == NULL)
+		elog(PANIC, "[AQO] Inconsistent index of the data hash table");
 
-	aqo_state->data_changed = false; /* mem data is consistent with disk */
-	LWLockRelease(&aqo_state->data_lock);
+	dlist_delete(&entry->fss_node);
+	if (--ientry->nentries == 0)
+		(void) hash_search(fss_index_htab, &entry->key.fss, HASH_REMOVE, NULL);
 }
 
-static bool
-_deform_queries_record_cb(void *data, size_t size)
+/*
+ * Removals of the ML data are written into the delta log as tombstones: the
+ * records with the key only. Keys of the entries removed since the last flush
+ * are kept in a DSA array, protected by aqo_state->data_lock.
+ *
+ * If there are too many of them, or the array can't be allocated, the next
+ * flush just rewrites the whole ML data file.
+ *
+ * Caller must hold the lock of the entry's partition and the data_lock
+ * exclusively.
+ */
+static void
+_data_tombstone_add(const data_key *key)
 {
-	bool			found;
+	Assert(data_lock_held_by_me(key, LW_EXCLUSIVE));
+	Assert(LWLockHeldByMeInMode(&aqo_state->data_lock, LW_EXCLUSIVE));
+
+	/* The file is rewritten on the next flush anyway */
+	if (pg_atomic_read_u32(&aqo_state->data_removed))
+		goto end;
+
+	if (aqo_state->data_ntombstones == aqo_state->data_maxtombstones)
+	{
+		int			newmax = Max(aqo_state->data_maxtombstones * 2, 64);
+		dsa_pointer	dp = InvalidDsaPointer;
+
+		if (newmax <= DATA_TOMBSTONES_MAX)
+			dp = dsa_allocate_extended(data_dsa, newmax * sizeof(data_key),
+									   DSA_ALLOC_HUGE | DSA_ALLOC_NO_OOM);
+
+		if (!DsaPointerIsValid(dp))
+		{
+			pg_atomic_write_u32(&aqo_state->data_removed, 1);
+			goto end;
+		}
+
+		if (DsaPointerIsValid(aqo_state->data_tombstones))
+		{
+			memcpy(dsa_get_address(data_dsa, dp), DataTombstones(),
+				   aqo_state->data_ntombstones * sizeof(data_key));
+			dsa_free(data_dsa, aqo_state->data_tombstones);
+		}
+		aqo_state->data_tombstones = dp;
+		aqo_state->data_maxtombstones = newmax;
+	}
+
+	DataTombstones()[aqo_state->data_ntombstones++] = *key;
+
+end:
+	pg_atomic_write_u32(&aqo_state->data_changed, 1);
+}
+
+/*
+ * Remove the entry from the ML data table and free its DSA chunk.
+ * Caller must hold the lock of the entry's partition and the data_lock
+ * exclusively, so a batch of removals takes the data_lock only once.
+ */
+static void
+_data_entry_drop(DataEntry *entry)
+{
+	data_key	key = entry->key;
+
+	Assert(DsaPointerIsValid(entry->data_dp));
+	dsa_free(data_dsa, entry->data_dp);
+	entry->data_dp = InvalidDsaPointer;
+	_fss_index_remove(entry);
+
+	if (!hash_search(data_htab, &key, HASH_REMOVE, NULL))
+		elog(PANIC, "[AQO] hash table corrupted");
+	data_entry_release();
+
+	_data_tombstone_add(&key);
+}
+
+/*
+ * Evict cold entries of the ML data table to make room for new subspaces.
+ * Caller must not hold any partition lock.
+ *
+ * The sweep continues from the position where the previous one stopped. The
+ * position is just a number of entries in the order of the sequential scan,
+ * so it is approximate after changes of the table, that is enough for the
+ * clock.
+ *
+ * Return the number of evicted entries.
+ */
+static long
+_aqo_data_evict(void)
+{
+	HASH_SEQ_STATUS	hash_seq;
+	DataEntry	   *entry = NULL;
+	long			target;
+	long			nevicted = 0;
+	long			hand = 0;
+	long			skip;
+	int				nwraps = 0;
+
+	data_lock_all(LW_EXCLUSIVE);
+
+	/* Somebody could make the room meanwhile */
+	if (hash_get_num_entries(data_htab) < fss_max_items ||
+		hash_get_num_entries(data_htab) == 0)
+	{
+		data_unlock_all();
+		return 0;
+	}
+
+	target = hash_get_num_entries(data_htab) - fss_max_items +
+			 Max(fss_max_items / DATA_EVICT_FRACTION, 1);
+
+	/* For the fss index and the tombstones of all the victims */
+	LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
+
+	skip = aqo_state->data_clock_hand;
+	hash_seq_init(&hash_seq, data_htab);
+	while (nevicted < target)
+	{
+		uint32	usage;
+
+		entry = (DataEntry *) hash_seq_search(&hash_seq);
+		if (entry == NULL)
+		{
+			/*
+			 * Each full turn decrements all the counts, so the victims are
+			 * found in a few turns. Just for the case of readers bumping the
+			 * counts concurrently, the number of turns is limited.
+			 */
+			if (skip == 0 && ++nwraps > DATA_USAGE_MAX)
+				break;
+
+			skip = 0;
+			hand = 0;
+			hash_seq_init(&hash_seq, data_htab);
+			continue;
+		}
+
+		hand++;
+		if (skip > 0)
+		{
+			skip--;
+			continue;
+		}
+
+		usage = pg_atomic_read_u32(&entry->usage_count);
+		if (usage > 0)
+		{
+			pg_atomic_write_u32(&entry->usage_count,
+								Min(usage, DATA_USAGE_MAX) - 1);
+			continue;
+		}
+
+		/* Removal of the current element doesn't break the scan */
+		_data_entry_drop(entry);
+		hand--;
+		nevicted++;
+	}
+
+	if (entry != NULL)
+		hash_seq_term(&hash_seq);
+	LWLockRelease(&aqo_state->data_lock);
+
+	aqo_state->data_clock_hand = hand;
+	pg_atomic_fetch_add_u64(&aqo_state->data_sweeps, 1);
+	pg_atomic_fetch_add_u64(&aqo_state->data_evicted, nevicted);
+	data_unlock_all();
+
+	elog(DEBUG1, "[AQO] %ld entries of the ML data are evicted.", nevicted);
+	return nevicted;
+}
+
+/*
+ * Getting a data chunk from a caller, add a record into the 'ML data'
+ * shmem hash table. Allocate and fill DSA chunk for variadic part of the data.
+ */
+static bool
+_deform_data_record_cb(void *data, size_t size)
+{
+	bool		found;
+	DataEntry  *fentry = (DataEntry *) data; /*Depends on a platform? */
+	DataEntry  *entry;
+	size_t		sz;
+	char	   *ptr = (char *) data,
+			   *dsa_ptr;
+
+	Assert(ptr != NULL);
+	Assert(data_lock_held_by_me(&fentry->key, LW_EXCLUSIVE));
+
+	if (!data_entry_reserve())
+	{
+		elog(LOG, "[AQO] Data storage is full. Skip record (fs: "UINT64_FORMAT
+			 ", fss: "INT64_FORMAT").", fentry->key.fs, fentry->key.fss);
+		return false;
+	}
+
+	entry = (DataEntry *) hash_search(data_htab, &fentry->key,
+									  HASH_ENTER, &found);
+	Assert(!found);
+
+	/* Copy fixed-size part of entry byte-by-byte even with caves */
+	memcpy(entry, fentry, offsetof(DataEntry, data_dp));
+	ptr += offsetof(DataEntry, data_dp);
+
+	sz = _compute_data_dsa(entry);
+	Assert(sz + offsetof(DataEntry, data_dp) == size);
+	entry->alloc_rows = _data_alloc_rows(entry->rows, entry->capacity);
+	entry->data_dp = dsa_allocate(data_dsa,
+								  _data_chunk_size(entry, entry->alloc_rows));
+
+	if (!_check_dsa_validity(entry->data_dp))
+	{
+		/*
+		 * DSA stuck into problems. Rollback changes. Return false in belief
+		 * that caller recognize it and don't try to call us more.
+		 */
+		(void) hash_search(data_htab, &fentry->key, HASH_REMOVE, NULL);
+		data_entry_release();
+		return false;
+	}
+
+	dsa_ptr = (char *) dsa_get_address(data_dsa, entry->data_dp);
+	Assert(dsa_ptr != NULL);
+	memcpy(dsa_ptr, ptr, sz);
+	_fss_index_add(entry);
+	entry->dirty = false;
+	/* Not used since the start yet */
+	pg_atomic_write_u32(&entry->usage_count, 0);
+	return true;
+}
+
+/*
+ * Convert a record of the ML data file of AQO 1.6. Its DSA chunk has the same
+ * layout as a chunk of double precision.
+ */
+static bool
+_deform_data_record_1_6_cb(void *data, size_t size)
+{
+	DataEntry_1_6  *fentry = (DataEntry_1_6 *) data;
+	DataEntry		entry;
+	size_t			sz;
+	char		   *record;
+	bool			res;
+
+	if (size < offsetof(DataEntry_1_6, data_dp) ||
+		fentry->rows <= 0 || fentry->rows > AQO_K_MAX ||
+		fentry->cols < 0 || fentry->nrels < 0)
+		return false;
+
+	memset(&entry, 0, sizeof(DataEntry));
+	entry.key = fentry->key;
+	entry.cols = fentry->cols;
+	entry.rows = fentry->rows;
+	entry.nrels = fentry->nrels;
+	entry.capacity = Max(fentry->rows, aqo_K);
+	entry.compact = false;
+
+	sz = _compute_data_dsa(&entry);
+	if (size != offsetof(DataEntry_1_6, data_dp) + sz)
+		return false;
+
+	record = palloc(offsetof(DataEntry, data_dp) + sz);
+	memcpy(record, &entry, offsetof(DataEntry, data_dp));
+	memcpy(record + offsetof(DataEntry, data_dp),
+		   (char *) data + offsetof(DataEntry_1_6, data_dp), sz);
+	res = _deform_data_record_cb(record, offsetof(DataEntry, data_dp) + sz);
+	pfree(record);
+	return res;
+}
+
+/*
+ * Apply a record of the delta log: it replaces or removes the entry loaded
+ * before.
+ */
+static bool
+_deform_data_delta_cb(void *data, size_t size)
+{
+	DataEntry  *fentry = (DataEntry *) data;
+	DataEntry  *entry;
+	bool		tombstone = (size == sizeof(data_key));
+
+	if (!tombstone &&
+		size != offsetof(DataEntry, data_dp) + _compute_data_dsa(fentry))
+		return false;
+
+	entry = (DataEntry *) hash_search(data_htab, &fentry->key, HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
+		_data_entry_drop(entry);
+		LWLockRelease(&aqo_state->data_lock);
+	}
+	else
+		(void) _data_file_forget(&fentry->key);
+
+	return tombstone || _deform_data_record_cb(data, size);
+}
+
+/*
+ * Replay the delta log over the ML data loaded from the file. A torn or
+ * invalid tail of the log is skipped. A valid record which can't be applied
+ * (e.g., aqo.fss_max_items was lowered) is skipped alone, so the later records
+ * and removals are still replayed. In both cases the next flush rewrites
+ * everything.
+ */
+static void
+_aqo_data_load_delta(void)
+{
+	FILE	   *file;
+	uint32		fheader;
+	uint32		pgver;
+	uint32		generation;
+	long		size;
+	long		num = 0;
+	long		nskipped = 0;
+	struct stat	st;
+	bool		torn;
+
+	file = AllocateFile(PGAQO_DATA_DELTA_FILE, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not read file \"%s\": %m",
+							PGAQO_DATA_DELTA_FILE)));
+		return;
+	}
+
+	if (fread(&fheader, sizeof(uint32), 1, file) != 1 ||
+		fread(&pgver, sizeof(uint32), 1, file) != 1 ||
+		fheader != PGAQO_DATA_DELTA_HEADER ||
+		pgver != PGAQO_PG_MAJOR_VERSION)
+	{
+		ereport(LOG,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("ignoring invalid data in file \"%s\"",
+						PGAQO_DATA_DELTA_FILE)));
+		FreeFile(file);
+		storage_file_set_aside(PGAQO_DATA_DELTA_FILE);
+		return;
+	}
+
+	if (fread(&generation, sizeof(uint32), 1, file) != 1 ||
+		generation != aqo_state->data_generation)
+	{
+		/*
+		 * We crashed after compaction before the log was removed, so the file
+		 * has all its records already. The next flush truncates the log.
+		 */
+		elog(LOG, "[AQO] Ignore stale file %s.", PGAQO_DATA_DELTA_FILE);
+		FreeFile(file);
+		return;
+	}
+	size = 3 * sizeof(uint32);
+
+	for (;;)
+	{
+		void	   *data;
+		size_t		sz;
+		pg_crc32c	crc;
+		bool		res;
+
+		if (fread(&sz, sizeof(sz), 1, file) != 1 ||
+			fread(&crc, sizeof(crc), 1, file) != 1)
+			break;
+		if ((sz != sizeof(data_key) && sz < offsetof(DataEntry, data_dp)) ||
+			!AllocSizeIsValid(sz))
+			break;
+
+		data = palloc(sz);
+		res = (fread(data, sz, 1, file) == 1 &&
+			   _data_file_check_crc(data, sz, crc));
+		if (!res)
+		{
+			pfree(data);
+			break;
+		}
+
+		if (_deform_data_delta_cb(data, sz))
+			num++;
+		else
+			nskipped++;
+		pfree(data);
+
+		size += sizeof(sz) + sizeof(crc) + sz;
+	}
+
+	/* Replayed records are on the disk already */
+	torn = (fstat(fileno(file), &st) != 0 || st.st_size != size);
+	if (torn || nskipped > 0)
+	{
+		pg_atomic_write_u32(&aqo_state->data_removed, 1);
+		pg_atomic_write_u32(&aqo_state->data_changed, 1);
+	}
+	if (torn)
+		elog(LOG, "[AQO] Skip the tail of file %s after %ld records.",
+			 PGAQO_DATA_DELTA_FILE, num + nskipped);
+	if (nskipped > 0)
+		elog(LOG, "[AQO] %ld records of file %s can't be applied.",
+			 nskipped, PGAQO_DATA_DELTA_FILE);
+
+	FreeFile(file);
+	aqo_state->data_delta_size = size;
+	elog(LOG, "[AQO] %ld records loaded from file %s.",
+		 num, PGAQO_DATA_DELTA_FILE);
+}
+
+/*
+ * Mapping of the ML data file into the memory of this backend. It is needed
+ * until all entries of the file are moved into the hash table.
+ */
+static char *data_file_map = NULL;
+static size_t data_file_map_size = 0;
+
+#define DataFileIndex() \
+	((DataFileIndexEntry *) (data_file_map + \
+							 ((DataFileHeader *) data_file_map)->index_offset))
+
+/* Slot of the index is set when the entry is taken from the file */
+#define DataFileSlots() \
+	((char *) dsa_get_address(data_dsa, aqo_state->data_file_slots))
+
+static int
+data_file_key_cmp(const data_key *a, const data_key *b)
+{
+	if (a->fss != b->fss)
+		return (a->fss < b->fss) ? -1 : 1;
+	if (a->fs != b->fs)
+		return (a->fs < b->fs) ? -1 : 1;
+	return 0;
+}
+
+static int
+data_file_index_cmp(const void *a, const void *b)
+{
+	return data_file_key_cmp(&((const DataFileIndexEntry *) a)->key,
+							 &((const DataFileIndexEntry *) b)->key);
+}
+
+static bool
+_data_file_pad(FILE *file, uint64 *offset)
+{
+	static const char	zeros[MAXIMUM_ALIGNOF] = {0};
+	size_t				pad = MAXALIGN(*offset) - *offset;
+
+	if (pad > 0 && fwrite(zeros, pad, 1, file) != 1)
+		return false;
+
+	*offset += pad;
+	return true;
+}
+
+/*
+ * Write all entries of the hash table into the ML data file.
+ * Caller must hold all the partition locks exclusively.
+ */
+static int
+_aqo_data_write_file(uint32 generation)
+{
+	HASH_SEQ_STATUS		hash_seq;
+	DataEntry		   *entry;
+	DataFileHeader		hdr;
+	DataFileIndexEntry *index;
+	int64				nrecs = 0;
+	uint64				offset;
+	FILE			   *file;
+	char			   *tmpfile;
+
+	index = palloc(sizeof(DataFileIndexEntry) *
+				   Max(hash_get_num_entries(data_htab), 1));
+	tmpfile = psprintf("%s.tmp", PGAQO_DATA_FILE);
+	file = AllocateFile(tmpfile, PG_BINARY_W);
+	if (file == NULL)
+		goto error;
+
+	/* Header is written at the end, when the position of the index is known */
+	memset(&hdr, 0, sizeof(hdr));
+	if (fwrite(&hdr, sizeof(hdr), 1, file) != 1)
+		goto error;
+	offset = sizeof(hdr);
+
+	hash_seq_init(&hash_seq, data_htab);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		void   *data;
+		size_t	size;
+
+		data = _form_data_record(entry, &size);
+		if (!_data_file_pad(file, &offset) || fwrite(data, size, 1, file) != 1)
+		{
+			hash_seq_term(&hash_seq);
+			goto error;
+		}
+
+		index[nrecs].key = entry->key;
+		index[nrecs].offset = offset;
+		index[nrecs].size = size;
+		index[nrecs].reserved = 0;
+		INIT_CRC32C(index[nrecs].crc);
+		COMP_CRC32C(index[nrecs].crc, data, size);
+		FIN_CRC32C(index[nrecs].crc);
+		pfree(data);
+		offset += size;
+		nrecs++;
+	}
+
+	qsort(index, nrecs, sizeof(DataFileIndexEntry), data_file_index_cmp);
+	if (!_data_file_pad(file, &offset) ||
+		(nrecs > 0 &&
+		 fwrite(index, sizeof(DataFileIndexEntry), nrecs, file) != nrecs))
+		goto error;
+
+	hdr.magic = PGAQO_DATA_FILE_HEADER;
+	hdr.pgver = PGAQO_PG_MAJOR_VERSION;
+	hdr.nrecs = nrecs;
+	hdr.index_offset = offset;
+	hdr.generation = generation;
+	INIT_CRC32C(hdr.index_crc);
+	COMP_CRC32C(hdr.index_crc, index, sizeof(DataFileIndexEntry) * nrecs);
+	FIN_CRC32C(hdr.index_crc);
+	if (fseek(file, 0, SEEK_SET) != 0 ||
+		fwrite(&hdr, sizeof(hdr), 1, file) != 1)
+		goto error;
+
+	if (FreeFile(file))
+	{
+		file = NULL;
+		goto error;
+	}
+
+	(void) durable_rename(tmpfile, PGAQO_DATA_FILE, PANIC);
+	elog(LOG, "[AQO] "INT64_FORMAT" records stored in file %s.",
+		 nrecs, PGAQO_DATA_FILE);
+	pfree(index);
+	pfree(tmpfile);
+	return 0;
+
+error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not write AQO file \"%s\": %m", tmpfile)));
+
+	if (file)
+		FreeFile(file);
+	unlink(tmpfile);
+	pfree(index);
+	pfree(tmpfile);
+	return -1;
+}
+
+static bool
+_data_file_map(void)
+{
+	int			fd;
+	struct stat	st;
+	void	   *map;
+
+	if (data_file_map != NULL)
+		return true;
+
+	fd = OpenTransientFile(PGAQO_DATA_FILE, O_RDONLY | PG_BINARY);
+	if (fd < 0)
+	{
+		if (errno == ENOENT)
+			return false;
+		goto error;
+	}
+
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		CloseTransientFile(fd);
+		goto error;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	CloseTransientFile(fd);
+	if (map == MAP_FAILED)
+		goto error;
+
+	data_file_map = (char *) map;
+	data_file_map_size = st.st_size;
+	return true;
+
+error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not map file \"%s\": %m", PGAQO_DATA_FILE)));
+	return false;
+}
+
+static bool
+_data_file_check_crc(const void *data, size_t size, pg_crc32c expected)
+{
+	pg_crc32c	crc;
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, data, size);
+	FIN_CRC32C(crc);
+	return EQ_CRC32C(crc, expected);
+}
+
+/*
+ * Check the header of the mapped file and that the index fits into the file.
+ */
+static bool
+_data_file_check_header(void)
+{
+	DataFileHeader *hdr = (DataFileHeader *) data_file_map;
+
+	return data_file_map_size >= sizeof(DataFileHeader) &&
+		hdr->magic == PGAQO_DATA_FILE_HEADER &&
+		hdr->pgver == PGAQO_PG_MAJOR_VERSION &&
+		hdr->nrecs >= 0 &&
+		hdr->index_offset % MAXIMUM_ALIGNOF == 0 &&
+		hdr->index_offset <= data_file_map_size &&
+		(data_file_map_size - hdr->index_offset) /
+							sizeof(DataFileIndexEntry) >= (uint64) hdr->nrecs;
+}
+
+static void
+_data_file_unmap(void)
+{
+	if (data_file_map == NULL)
+		return;
+
+	if (munmap(data_file_map, data_file_map_size) != 0)
+		elog(LOG, "[AQO] could not unmap file %s: %m", PGAQO_DATA_FILE);
+	data_file_map = NULL;
+	data_file_map_size = 0;
+}
+
+/*
+ * Are there entries in the file which aren't moved into the hash table yet?
+ */
+static bool
+data_file_pending(void)
+{
+	if (pg_atomic_read_u64(&aqo_state->data_file_pending) == 0)
+	{
+		/* The file is the same as the hash table now */
+		_data_file_unmap();
+		return false;
+	}
+
+	if (!_data_file_map())
+		return false;
+
+	/*
+	 * The file could be rewritten after all its entries were loaded by someone
+	 * else. Don't look into the new file: the index doesn't describe it.
+	 */
+	if (!_data_file_check_header() ||
+		((DataFileHeader *) data_file_map)->nrecs != aqo_state->data_file_nrecs)
+	{
+		_data_file_unmap();
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Return the first slot of the index with the key not less than the given one.
+ */
+static int64
+_data_file_lower_bound(const data_key *key)
+{
+	DataFileIndexEntry *index = DataFileIndex();
+	int64				lo = 0;
+	int64				hi = aqo_state->data_file_nrecs;
+
+	while (lo < hi)
+	{
+		int64	mid = lo + (hi - lo) / 2;
+
+		if (data_file_key_cmp(&index[mid].key, key) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Take the slot out of the file without loading the entry.
+ * Caller must hold the lock of the entry's partition exclusively.
+ */
+static bool
+_data_file_release_slot(int64 slot)
+{
+	char   *slots = DataFileSlots();
+
+	Assert(data_lock_held_by_me(&DataFileIndex()[slot].key, LW_EXCLUSIVE));
+
+	/* Check the counter as well: the file could be discarded concurrently */
+	if (pg_atomic_read_u64(&aqo_state->data_file_pending) == 0 ||
+		slots[slot] != 0)
+		return false;
+
+	slots[slot] = 1;
+	pg_atomic_fetch_sub_u64(&aqo_state->data_file_pending, 1);
+	return true;
+}
+
+/*
+ * Move the entry of the slot from the file into the hash table.
+ * Caller must hold the lock of the entry's partition exclusively.
+ *
+ * Return true if the entry was added.
+ */
+static bool
+_data_file_materialize_slot(int64 slot)
+{
+	DataFileIndexEntry *ientry = &DataFileIndex()[slot];
+	DataEntry		   *fentry;
+	bool				found;
+
+	if (pg_atomic_read_u64(&aqo_state->data_file_pending) == 0 ||
+		DataFileSlots()[slot] != 0)
+		return false;
+	_data_file_release_slot(slot);
+
+	/* The entry was learned again since it was written into the file */
+	(void) hash_search(data_htab, &ientry->key, HASH_FIND, &found);
+	if (found)
+		return false;
+
+	fentry = (DataEntry *) (data_file_map + ientry->offset);
+	if (ientry->offset % MAXIMUM_ALIGNOF != 0 ||
+		ientry->size < offsetof(DataEntry, data_dp) ||
+		ientry->offset + ientry->size > data_file_map_size ||
+		!_data_file_check_crc(fentry, ientry->size, ientry->crc) ||
+		memcmp(&fentry->key, &ientry->key, sizeof(data_key)) != 0 ||
+		ientry->size != offsetof(DataEntry, data_dp) + _compute_data_dsa(fentry))
+	{
+		elog(LOG, "[AQO] Skip corrupted record (fs: "UINT64_FORMAT", fss: "
+			 INT64_FORMAT") of file %s.",
+			 ientry->key.fs, ientry->key.fss, PGAQO_DATA_FILE);
+		return false;
+	}
+
+	return _deform_data_record_cb(fentry, ientry->size);
+}
+
+/*
+ * Find the slot of the key in the file. Return -1 if the file doesn't have it.
+ */
+static int64
+_data_file_search(const data_key *key)
+{
+	int64	slot = _data_file_lower_bound(key);
+
+	if (slot >= aqo_state->data_file_nrecs ||
+		data_file_key_cmp(&DataFileIndex()[slot].key, key) != 0)
+		return -1;
+
+	return slot;
+}
+
+/*
+ * The entry is created or removed in the hash table, so its version in the
+ * file is out of date.
+ * Caller must hold the lock of the entry's partition exclusively.
+ *
+ * Return true if the entry wasn't loaded from the file yet.
+ */
+static bool
+_data_file_forget(const data_key *key)
+{
+	int64	slot;
+
+	if (!data_file_pending())
+		return false;
+
+	slot = _data_file_search(key);
+	return (slot >= 0 && _data_file_release_slot(slot));
+}
+
+/*
+ * Move the entry from the file into the hash table on a lookup miss.
+ * Return true if the entry was added, so the lookup should be repeated.
+ */
+static bool
+_data_file_materialize_key(const data_key *key, uint32 hashcode)
+{
+	LWLock	   *partition_lock = DataPartitionLock(hashcode);
+	int64		slot;
+	bool		result;
+
+	Assert(!LWLockHeldByMe(partition_lock));
+
+	if (!data_file_pending())
+		return false;
+
+	slot = _data_file_search(key);
+	if (slot < 0)
+		return false;
+
+	LWLockAcquire(partition_lock, LW_EXCLUSIVE);
+	result = _data_file_materialize_slot(slot);
+	LWLockRelease(partition_lock);
+	return result;
+}
+
+/*
+ * Move all entries of the feature subspace from the file into the hash table.
+ */
+static void
+_data_file_materialize_fss(int64 fss)
+{
+	data_key	key = {.fs = 0, .fss = fss};
+	int64		slot;
+
+	if (!data_file_pending())
+		return;
+
+	for (slot = _data_file_lower_bound(&key);
+		 slot < aqo_state->data_file_nrecs && DataFileIndex()[slot].key.fss == fss;
+		 slot++)
+	{
+		LWLock *partition_lock =
+			DataPartitionLock(get_hash_value(data_htab,
+											 &DataFileIndex()[slot].key));
+
+		LWLockAcquire(partition_lock, LW_EXCLUSIVE);
+		(void) _data_file_materialize_slot(slot);
+		LWLockRelease(partition_lock);
+	}
+}
+
+/*
+ * Move all the rest of entries from the file into the hash table.
+ * Caller must hold all the partition locks exclusively.
+ */
+static void
+_data_file_materialize_all(void)
+{
+	int64	slot;
+
+	if (!data_file_pending())
+		return;
+
+	for (slot = 0; slot < aqo_state->data_file_nrecs; slot++)
+		(void) _data_file_materialize_slot(slot);
+
+	Assert(pg_atomic_read_u64(&aqo_state->data_file_pending) == 0);
+	_data_file_unmap();
+}
+
+/*
+ * Forget about the entries of the file which aren't loaded yet.
+ * Caller must hold all the partition locks exclusively.
+ *
+ * Return the number of such entries.
+ */
+static long
+_data_file_discard(void)
+{
+	long	pending = (long) pg_atomic_read_u64(&aqo_state->data_file_pending);
+
+	if (pending == 0)
+		return 0;
+
+	memset(DataFileSlots(), 1, aqo_state->data_file_nrecs);
+	pg_atomic_write_u64(&aqo_state->data_file_pending, 0);
+	_data_file_unmap();
+
+	/* Rewrite the file on the next flush */
+	pg_atomic_write_u32(&aqo_state->data_removed, 1);
+	pg_atomic_write_u32(&aqo_state->data_changed, 1);
+	return pending;
+}
+
+/*
+ * Whole-table operations need all the entries in the hash table.
+ */
+static void
+_aqo_data_load_pending(void)
+{
+	if (pg_atomic_read_u64(&aqo_state->data_file_pending) == 0)
+		return;
+
+	data_lock_all(LW_EXCLUSIVE);
+	_data_file_materialize_all();
+	data_unlock_all();
+}
+
+/*
+ * Load a batch of entries which are still in the ML data file into the hash
+ * table. The checkpointer does it in background, so the first lookups of the
+ * entries find them in memory.
+ *
+ * Return true if some entries may be left in the file.
+ */
+bool
+aqo_data_prefetch(int nentries)
+{
+	static int64	cursor = 0;
+
+	dsa_init();
+
+	if (!data_file_pending())
+		return false;
+
+	for (; cursor < aqo_state->data_file_nrecs && nentries > 0; cursor++)
+	{
+		LWLock *partition_lock;
+
+		/* Just a hint, it is checked again under the lock */
+		if (DataFileSlots()[cursor] != 0)
+			continue;
+
+		partition_lock =
+			DataPartitionLock(get_hash_value(data_htab,
+											 &DataFileIndex()[cursor].key));
+		LWLockAcquire(partition_lock, LW_EXCLUSIVE);
+		(void) _data_file_materialize_slot(cursor);
+		LWLockRelease(partition_lock);
+		nentries--;
+	}
+
+	return cursor < aqo_state->data_file_nrecs;
+}
+
+/*
+ * Open the ML data file. Only the header is checked here: entries are loaded
+ * on demand (see _data_file_materialize_key()).
+ */
+static void
+_aqo_data_open_file(void)
+{
+	DataFileHeader *hdr;
+
+	if (!_data_file_map())
+		return;
+
+	hdr = (DataFileHeader *) data_file_map;
+	if (data_file_map_size >= sizeof(uint32) &&
+		hdr->magic == PGAQO_FILE_HEADER_1_6)
+	{
+		/* The file of AQO 1.6 is read at once and rewritten by the next flush */
+		_data_file_unmap();
+		if (data_load(PGAQO_DATA_FILE, PGAQO_FILE_HEADER_1_6,
+					  _deform_data_record_1_6_cb, NULL))
+		{
+			pg_atomic_write_u32(&aqo_state->data_removed, 1);
+			pg_atomic_write_u32(&aqo_state->data_changed, 1);
+		}
+		return;
+	}
+
+	if (!_data_file_check_header())
+	{
+		ereport(LOG,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("ignoring invalid data in file \"%s\"",
+						PGAQO_DATA_FILE)));
+		_data_file_unmap();
+		storage_file_set_aside(PGAQO_DATA_FILE);
+		return;
+	}
+
+	/*
+	 * Records can't be found without the index. Keep the file for an
+	 * investigation: it will be replaced by the next flush.
+	 */
+	if (!_data_file_check_crc(DataFileIndex(),
+							  sizeof(DataFileIndexEntry) * hdr->nrecs,
+							  hdr->index_crc))
+	{
+		elog(LOG, "[AQO] Corrupted index of file %s. Ignore the file.",
+			 PGAQO_DATA_FILE);
+		_data_file_unmap();
+		return;
+	}
+
+	aqo_state->data_base_size = data_file_map_size;
+	aqo_state->data_generation = hdr->generation;
+
+	if (hdr->nrecs > 0)
+	{
+		aqo_state->data_file_slots =
+			dsa_allocate_extended(data_dsa, hdr->nrecs,
+								  DSA_ALLOC_HUGE | DSA_ALLOC_NO_OOM |
+								  DSA_ALLOC_ZERO);
+		if (_check_dsa_validity(aqo_state->data_file_slots))
+		{
+			aqo_state->data_file_nrecs = hdr->nrecs;
+			pg_atomic_write_u64(&aqo_state->data_file_pending, hdr->nrecs);
+		}
+	}
+
+	elog(LOG, "[AQO] "INT64_FORMAT" records of file %s are loaded on demand.",
+		 hdr->nrecs, PGAQO_DATA_FILE);
+
+	if (pg_atomic_read_u64(&aqo_state->data_file_pending) == 0)
+		_data_file_unmap();
+}
+
+void
+aqo_data_load(void)
+{
+	Assert(!LWLockHeldByMe(&aqo_state->data_lock));
+	Assert(data_dsa != NULL);
+
+	data_lock_all(LW_EXCLUSIVE);
+
+	if (hash_get_num_entries(data_htab) != 0 ||
+		pg_atomic_read_u64(&aqo_state->data_file_pending) != 0)
+	{
+		/* Someone have done it concurrently. */
+		elog(LOG, "[AQO] Another backend have loaded query data concurrently.");
+		data_unlock_all();
+		return;
+	}
+
+	/* mem data is consistent with disk, unless the files say otherwise */
+	pg_atomic_write_u32(&aqo_state->data_changed, 0);
+	pg_atomic_write_u32(&aqo_state->data_removed, 0);
+
+	aqo_state->data_base_size = 0;
+	aqo_state->data_generation = 0;
+	_aqo_data_open_file();
+	_aqo_data_load_delta();
+
+	/* Removals made by the replay are on the disk already */
+	aqo_state->data_ntombstones = 0;
+	data_unlock_all();
+}
+
+static bool
+_deform_queries_record_cb(void *data, size_t size)
+{
+	bool			found;
 	QueriesEntry  	*entry;
 	uint64			queryid;
 
@@ -916,7 +2346,9 @@ aqo_queries_load(void)
 	/* Load on postmaster startup. So no any concurrent actions possible here. */
 	Assert(hash_get_num_entries(queries_htab) == 0);
 
-	data_load(PGAQO_QUERIES_FILE, _deform_queries_record_cb, NULL);
+	if (data_load(PGAQO_QUERIES_FILE, PGAQO_FILE_HEADER,
+				  _deform_queries_record_cb, NULL))
+		aqo_state->queries_changed = true;
 
 	/* Check existence of default feature space */
 	(void) hash_search(queries_htab, &queryid, HASH_FIND, &found);
@@ -929,78 +2361,192 @@ aqo_queries_load(void)
 	}
 }
 
-static void
-data_load(const char *filename, deform_record_t callback, void *ctx)
+/*
+ * Load records of the file. A block with a wrong checksum is skipped. Reading
+ * stops at a block with a corrupted header or an error of the callback, but
+ * everything loaded before is kept. A file of another format is renamed aside.
+ *
+ * Return true if the file has the format of AQO 1.6, so it should be rewritten.
+ */
+static bool
+data_load(const char *filename, uint32 header, deform_record_t callback,
+		  void *ctx)
 {
-	FILE   *file;
-	long	i;
-	uint32	header;
-	int32	pgver;
-	long	num;
+	FILE			   *file;
+	uint32				fheader;
+	int32				pgver;
+	long				num;
+	long				nloaded = 0;
+	long				nskipped = 0;
+	StorageBlockHeader	hdr;
+	bool				legacy = false;
 
 	file = AllocateFile(filename, PG_BINARY_R);
 	if (file == NULL)
 	{
 		if (errno != ENOENT)
 			goto read_error;
-		return;
+		return false;
 	}
 
-	if (fread(&header, sizeof(uint32), 1, file) != 1 ||
+	if (fread(&fheader, sizeof(uint32), 1, file) != 1 ||
 		fread(&pgver, sizeof(uint32), 1, file) != 1 ||
 		fread(&num, sizeof(long), 1, file) != 1)
 		goto read_error;
 
-	if (header != PGAQO_FILE_HEADER || pgver != PGAQO_PG_MAJOR_VERSION)
+	if ((fheader != header && fheader != PGAQO_FILE_HEADER_1_6) ||
+		pgver != PGAQO_PG_MAJOR_VERSION)
 		goto data_error;
 
-	for (i = 0; i < num; i++)
+	if (fheader == PGAQO_FILE_HEADER_1_6)
 	{
-		void   *data;
-		size_t	size;
-		bool	res;
+		/* AQO 1.6 wrote records one by one, without blocks and checksums */
+		legacy = true;
+		for (; nloaded < num; nloaded++)
+		{
+			void   *data;
+			size_t	size;
 
-		if (fread(&size, sizeof(size), 1, file) != 1)
-			goto read_error;
-		data = palloc(size);
-		if (fread(data, size, 1, file) != 1)
-			goto read_error;
-		res = callback(data, size);
+			if (fread(&size, sizeof(size), 1, file) != 1 ||
+				!AllocSizeIsValid(size))
+				goto read_error;
+			data = palloc(size);
+			if (fread(data, size, 1, file) != 1)
+				goto read_error;
 
-		if (!res)
+			if (!callback(data, size))
+			{
+				elog(LOG, "[AQO] Because of an error skip %ld storage records.",
+					 num - nloaded);
+				break;
+			}
+		}
+
+		elog(LOG, "[AQO] File %s of AQO 1.6 is converted into the new format.",
+			 filename);
+		goto end;
+	}
+
+	while (fread(&hdr, sizeof(hdr), 1, file) == 1)
+	{
+		pg_crc32c	crc;
+		char	   *block;
+		char	   *ptr;
+		uint32		i;
+
+		INIT_CRC32C(crc);
+		COMP_CRC32C(crc, &hdr, offsetof(StorageBlockHeader, hdr_crc));
+		FIN_CRC32C(crc);
+		if (!EQ_CRC32C(crc, hdr.hdr_crc) || !AllocSizeIsValid(hdr.len))
 		{
-			/* Error detected. Do not try to read tails of the storage. */
-			elog(LOG, "[AQO] Because of an error skip %ld storage records.",
-				 num - i);
+			elog(LOG, "[AQO] Corrupted block header in file %s. Skip the rest of the file.",
+				 filename);
 			break;
 		}
+
+		block = palloc(hdr.len);
+		if (fread(block, hdr.len, 1, file) != 1)
+		{
+			pfree(block);
+			goto read_error;
+		}
+
+		INIT_CRC32C(crc);
+		COMP_CRC32C(crc, block, hdr.len);
+		FIN_CRC32C(crc);
+		if (!EQ_CRC32C(crc, hdr.crc))
+		{
+			elog(LOG, "[AQO] Skip corrupted block of %u records in file %s.",
+				 hdr.nrecs, filename);
+			nskipped += hdr.nrecs;
+			pfree(block);
+			continue;
+		}
+
+		ptr = block;
+		for (i = 0; i < hdr.nrecs; i++)
+		{
+			void   *data;
+			size_t	size;
+
+			Assert(ptr + sizeof(size) <= block + hdr.len);
+			memcpy(&size, ptr, sizeof(size));
+			ptr += sizeof(size);
+			Assert(ptr + size <= block + hdr.len);
+
+			/* Copy the record: callbacks expect it to be aligned */
+			data = memcpy(palloc(size), ptr, size);
+			ptr += size;
+
+			if (!callback(data, size))
+			{
+				/* Error detected. Do not try to read tails of the storage. */
+				elog(LOG, "[AQO] Because of an error skip %ld storage records.",
+					 num - nloaded);
+				pfree(block);
+				goto end;
+			}
+			nloaded++;
+		}
+
+		pfree(block);
 	}
 
+end:
 	FreeFile(file);
 
-	elog(LOG, "[AQO] %ld records loaded from file %s.", num, filename);
-	return;
+	if (nskipped > 0 || nloaded != num)
+		elog(LOG, "[AQO] %ld of %ld records loaded from file %s.",
+			 nloaded, num, filename);
+	else
+		elog(LOG, "[AQO] %ld records loaded from file %s.", num, filename);
+	return legacy;
 
 read_error:
 	ereport(LOG,
 			(errcode_for_file_access(),
 			 errmsg("could not read file \"%s\": %m", filename)));
-	goto fail;
+	if (file)
+		FreeFile(file);
+	return legacy;
+
 data_error:
 	ereport(LOG,
 			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
 			 errmsg("ignoring invalid data in file \"%s\"", filename)));
-fail:
-	if (file)
-		FreeFile(file);
-	unlink(filename);
+	FreeFile(file);
+	storage_file_set_aside(filename);
+	return false;
+}
+
+/*
+ * A file of an unknown format (or of another PostgreSQL version) could be
+ * written by a newer AQO. Don't remove it: keep it for a manual recovery, the
+ * next flush would overwrite it otherwise.
+ */
+static void
+storage_file_set_aside(const char *filename)
+{
+	char   *badfile = psprintf("%s.bad", filename);
+
+	if (durable_rename(filename, badfile, LOG) == 0)
+		elog(LOG, "[AQO] File %s is renamed to %s.", filename, badfile);
+	pfree(badfile);
 }
 
 static void
 on_shmem_shutdown(int code, Datum arg)
 {
+	/*
+	 * The checkpointer writes changes in background. It is also the last who
+	 * writes at its own exit.
+	 */
+	if (checkpointer_is_active())
+		return;
+
 	/*
 	 * XXX: It can be expensive to rewrite a file on each shutdown of a backend.
+	 * The ML data is cheap: only changed entries are appended to its log.
 	 */
 	aqo_qtexts_flush();
 	aqo_data_flush();
@@ -1011,6 +2557,25 @@ on_shmem_shutdown(int code, Datum arg)
  * On first call, create DSA segments and load data into hash table and DSA
  * from disk.
  */
+static dsa_area *
+_dsa_create(int trancheid, int size_max, dsa_handle *handle)
+{
+	dsa_area   *area = dsa_create(trancheid);
+
+	Assert(area != NULL);
+
+	if (size_max > 0)
+		dsa_set_size_limit(area, (size_t) size_max * 1024 * 1024);
+
+	dsa_pin(area);
+	*handle = dsa_get_handle(area);
+	return area;
+}
+
+/*
+ * Query texts and ML data live in separate DSA areas with their own limits:
+ * a burst of long ad-hoc queries can't starve the learning.
+ */
 static void
 dsa_init()
 {
@@ -1019,7 +2584,7 @@ dsa_init()
 	if (qtext_dsa)
 		return;
 
-	Assert(data_dsa == NULL && data_dsa == NULL);
+	Assert(qtext_dsa == NULL && data_dsa == NULL);
 	old_context = MemoryContextSwitchTo(TopMemoryContext);
 	LWLockAcquire(&aqo_state->lock, LW_EXCLUSIVE);
 
@@ -1027,17 +2592,11 @@ dsa_init()
 	{
 		Assert(aqo_state->data_dsa_handler == DSM_HANDLE_INVALID);
 
-		qtext_dsa = dsa_create(aqo_state->qtext_trancheid);
-		Assert(qtext_dsa != NULL);
-
-		if (dsm_size_max > 0)
-			dsa_set_size_limit(qtext_dsa, dsm_size_max * 1024 * 1024);
-
-		dsa_pin(qtext_dsa);
-		aqo_state->qtexts_dsa_handler = dsa_get_handle(qtext_dsa);
-
-		data_dsa = qtext_dsa;
-		aqo_state->data_dsa_handler = dsa_get_handle(data_dsa);
+		qtext_dsa = _dsa_create(aqo_state->qtext_trancheid,
+								dsm_qtexts_size_max,
+								&aqo_state->qtexts_dsa_handler);
+		data_dsa = _dsa_create(aqo_state->data_trancheid, dsm_size_max,
+							   &aqo_state->data_dsa_handler);
 
 		/* Load and initialize query texts hash table */
 		aqo_qtexts_load();
@@ -1046,10 +2605,11 @@ dsa_init()
 	else
 	{
 		qtext_dsa = dsa_attach(aqo_state->qtexts_dsa_handler);
-		data_dsa = qtext_dsa;
+		data_dsa = dsa_attach(aqo_state->data_dsa_handler);
 	}
 
 	dsa_pin_mapping(qtext_dsa);
+	dsa_pin_mapping(data_dsa);
 	MemoryContextSwitchTo(old_context);
 	LWLockRelease(&aqo_state->lock);
 
@@ -1107,7 +2667,8 @@ aqo_qtext_store(uint64 queryid, const char *query_string)
 
 		entry->queryid = queryid;
 		size = size > querytext_max_size ? querytext_max_size : size;
-		entry->qtext_dp = dsa_allocate(qtext_dsa, size);
+		entry->qtext_dp = dsa_allocate_extended(qtext_dsa, size,
+												DSA_ALLOC_NO_OOM);
 
 		if (!_check_dsa_validity(entry->qtext_dp))
 		{
@@ -1123,6 +2684,7 @@ aqo_qtext_store(uint64 queryid, const char *query_string)
 		strptr = (char *) dsa_get_address(qtext_dsa, entry->qtext_dp);
 		strlcpy(strptr, query_string, size);
 		aqo_state->qtexts_changed = true;
+		checkpointer_note_dirty(sizeof(queryid) + size);
 	}
 	LWLockRelease(&aqo_state->qtexts_lock);
 	return true;
@@ -1263,25 +2825,29 @@ _aqo_data_remove(data_key *key)
 {
 	DataEntry  *entry;
 	bool		found;
+	uint32		hashcode = get_hash_value(data_htab, key);
+	LWLock	   *partition_lock = DataPartitionLock(hashcode);
 
-	Assert(!LWLockHeldByMe(&aqo_state->data_lock));
-	LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
+	Assert(!LWLockHeldByMe(partition_lock));
+	LWLockAcquire(partition_lock, LW_EXCLUSIVE);
 
-	entry = (DataEntry *) hash_search(data_htab, key, HASH_FIND, &found);
+	entry = (DataEntry *) hash_search_with_hash_value(data_htab, key, hashcode,
+													  HASH_FIND, &found);
 	if (found)
 	{
-		/* Free DSA memory, allocated for this record */
-		Assert(DsaPointerIsValid(entry->data_dp));
-		dsa_free(data_dsa, entry->data_dp);
-		entry->data_dp = InvalidDsaPointer;
-
-		if (!hash_search(data_htab, key, HASH_REMOVE, NULL))
-			elog(PANIC, "[AQO] Inconsistent data hash table");
-
-		aqo_state->data_changed = true;
+		LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
+		_data_entry_drop(entry);
+		LWLockRelease(&aqo_state->data_lock);
+	}
+	else if (_data_file_forget(key))
+	{
+		/* Don't load the entry from the file later, even after a restart */
+		LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
+		_data_tombstone_add(key);
+		LWLockRelease(&aqo_state->data_lock);
 	}
 
-	LWLockRelease(&aqo_state->data_lock);
+	LWLockRelease(partition_lock);
 	return found;
 }
 
@@ -1311,6 +2877,9 @@ aqo_qtexts_reset(void)
 		num_remove++;
 	}
 	aqo_state->qtexts_changed = true;
+
+	/* Return the memory of the texts, the area is used by them only */
+	dsa_trim(qtext_dsa);
 	LWLockRelease(&aqo_state->qtexts_lock);
 	if (num_remove != num_entries - 1)
 		elog(ERROR, "[AQO] Query texts memory storage is corrupted or parallel access without a lock was detected.");
@@ -1320,36 +2889,114 @@ aqo_qtexts_reset(void)
 	return num_remove;
 }
 
+/*
+ * Size of an element of the matrix, targets and rfactors in the DSA chunk of
+ * the ML data entry.
+ */
+#define DataEntryElemSize(entry) \
+	((entry)->compact ? sizeof(float4) : sizeof(float8))
+
 static size_t
 _compute_data_dsa(const DataEntry *entry)
+{
+	return _data_chunk_size(entry, entry->rows);
+}
+
+/*
+ * Size of the DSA chunk of the entry with the given number of rows.
+ */
+static size_t
+_data_chunk_size(const DataEntry *entry, int rows)
 {
 	size_t	size = sizeof(data_key); /* header's size */
+	size_t	elemsize = DataEntryElemSize(entry);
 
-	size += sizeof(double) * entry->rows * entry->cols; /* matrix */
-	size += 2 * sizeof(double) * entry->rows; /* targets, rfactors */
+	size += elemsize * rows * entry->cols; /* matrix */
+	size += 2 * elemsize * rows; /* targets, rfactors */
 
 	/* Calculate memory size needed to store relation names */
 	size += entry->nrels * sizeof(Oid);
 	return size;
 }
 
+/*
+ * Number of rows to allocate the DSA chunk for.
+ *
+ * A subspace gains rows one by one while it is learned. To avoid
+ * reallocation of the chunk on each new row, the chunk grows by power-of-two
+ * numbers of rows up to the capacity of the subspace. The layout of the chunk
+ * depends on the actual number of rows only: the tail of the chunk is unused.
+ */
+static int
+_data_alloc_rows(int rows, int capacity)
+{
+	int		alloc_rows = 1;
+
+	while (alloc_rows < rows)
+		alloc_rows <<= 1;
+
+	return Max(Min(alloc_rows, capacity), rows);
+}
+
+/*
+ * Read n values from the DSA chunk (or its on-disk image) into the array of
+ * doubles. Returns pointer to the next byte after the data read.
+ * In compact mode the values are stored as float4: computations are always
+ * made in double precision.
+ */
+static char *
+_data_read_doubles(double *dst, char *src, int n, bool compact)
+{
+	if (compact)
+	{
+		float4	   *fsrc = (float4 *) src;
+		int			i;
+
+		for (i = 0; i < n; i++)
+			dst[i] = (double) fsrc[i];
+		return src + sizeof(float4) * n;
+	}
+
+	memcpy(dst, src, sizeof(float8) * n);
+	return src + sizeof(float8) * n;
+}
+
+/*
+ * Write n doubles into the DSA chunk. Returns pointer to the next byte after
+ * the data written.
+ */
+static char *
+_data_write_doubles(char *dst, const double *src, int n, bool compact)
+{
+	if (compact)
+	{
+		float4	   *fdst = (float4 *) dst;
+		int			i;
+
+		for (i = 0; i < n; i++)
+			fdst[i] = (float4) src[i];
+		return dst + sizeof(float4) * n;
+	}
+
+	memcpy(dst, src, sizeof(float8) * n);
+	return dst + sizeof(float8) * n;
+}
+
 /*
  * Insert new record or update existed in the AQO data storage.
  * Return true if data was changed.
  */
 bool
-aqo_data_store(uint64 fs, int fss, AqoDataArgs *data, List *reloids)
+aqo_data_store(uint64 fs, int64 fss, AqoDataArgs *data, List *reloids)
 {
 	DataEntry  *entry;
 	bool		found;
 	data_key	key = {.fs = fs, .fss = fss};
-	int			i;
 	char	   *ptr;
 	ListCell   *lc;
 	size_t		size;
-	bool		tblOverflow;
-	HASHACTION	action;
 	bool		result;
+	bool		evicted = false;
 	/*
 	 * We should distinguish incoming data between internally
 	 * passed structured data(reloids) and externaly
@@ -1357,30 +3004,42 @@ aqo_data_store(uint64 fs, int fss, AqoDataArgs *data, List *reloids)
 	 */
 	bool		is_raw_data = (reloids == NULL);
 	int			nrels = is_raw_data ? data->nrels : list_length(reloids);
+	uint32		hashcode;
+	LWLock	   *partition_lock;
 
-	Assert(!LWLockHeldByMe(&aqo_state->data_lock));
-	Assert(data->rows > 0);
+	hashcode = get_hash_value(data_htab, &key);
+	partition_lock = DataPartitionLock(hashcode);
 
-	dsa_init();
+	Assert(!LWLockHeldByMe(partition_lock));
+	Assert(data->rows > 0 && data->rows <= data->capacity);
 
-	LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
+	dsa_init();
 
-	/* Check hash table overflow */
-	tblOverflow = hash_get_num_entries(data_htab) < fss_max_items ? false : true;
-	action = tblOverflow ? HASH_FIND : HASH_ENTER;
+retry:
+	LWLockAcquire(partition_lock, LW_EXCLUSIVE);
 
-	entry = (DataEntry *) hash_search(data_htab, &key, action, &found);
+	entry = (DataEntry *) hash_search_with_hash_value(data_htab, &key, hashcode,
+													  HASH_FIND, &found);
 
 	/* Initialize entry on first usage */
 	if (!found)
 	{
-		if (action == HASH_FIND)
+		if (!data_entry_reserve())
 		{
+			LWLockRelease(partition_lock);
+
+			/* Hash table is full. Make room by eviction of cold entries */
+			if (!evicted)
+			{
+				evicted = true;
+				if (_aqo_data_evict() > 0)
+					goto retry;
+			}
+
 			/*
-			 * Hash table is full. To avoid possible problems - don't try to add
-			 * more, just exit
+			 * Nothing can be evicted. To avoid possible problems - don't try to
+			 * add more, just exit
 			 */
-			LWLockRelease(&aqo_state->data_lock);
 			ereport(LOG,
 				(errcode(ERRCODE_OUT_OF_MEMORY),
 				 errmsg("[AQO] Data storage is full. No more data can be added."),
@@ -1388,23 +3047,44 @@ aqo_data_store(uint64 fs, int fss, AqoDataArgs *data, List *reloids)
 			return false;
 		}
 
+		entry = (DataEntry *) hash_search_with_hash_value(data_htab, &key,
+														  hashcode, HASH_ENTER,
+														  &found);
+		Assert(!found);
+
+		/* The file might keep an outdated version of the entry */
+		_data_file_forget(&key);
+
 		entry->cols = data->cols;
 		entry->rows = data->rows;
 		entry->nrels = nrels;
+		entry->capacity = data->capacity;
+		entry->compact = aqo_compact_storage;
+		pg_atomic_write_u32(&entry->usage_count, 0);
+		entry->alloc_rows = _data_alloc_rows(entry->rows, entry->capacity);
 
-		size = _compute_data_dsa(entry);
+		size = _data_chunk_size(entry, entry->alloc_rows);
 		entry->data_dp = dsa_allocate0(data_dsa, size);
 
 		if (!_check_dsa_validity(entry->data_dp))
 		{
 			/*
 			 * DSA stuck into problems. Rollback changes. Return false in belief
-			 * that caller recognize it and don't try to call us more.
+			 * that caller recognize it and don't try to call us more. The
+			 * outdated version of the file is forgotten already, so remove it
+			 * from the disk too.
 			 */
-			(void) hash_search(data_htab, &key, HASH_REMOVE, NULL);
+			(void) hash_search_with_hash_value(data_htab, &key, hashcode,
+											   HASH_REMOVE, NULL);
+			data_entry_release();
+			LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
+			_data_tombstone_add(&key);
 			LWLockRelease(&aqo_state->data_lock);
+			LWLockRelease(partition_lock);
 			return false;
 		}
+
+		_fss_index_add(entry);
 	}
 
 	Assert(DsaPointerIsValid(entry->data_dp));
@@ -1413,15 +3093,28 @@ aqo_data_store(uint64 fs, int fss, AqoDataArgs *data, List *reloids)
 	{
 		/* Collision happened? */
 		elog(LOG, "[AQO] Does a collision happened? Check it if possible (fs: "
-			 UINT64_FORMAT", fss: %d).",
+			 UINT64_FORMAT", fss: "INT64_FORMAT").",
 			 fs, fss);
 		goto end;
 	}
 
-	if (entry->rows < data->rows)
+	data_entry_touch(entry);
+
+	/* Capacity of a subspace can only grow */
+	entry->capacity = Max(entry->capacity, data->capacity);
+
+	/*
+	 * Chunk is re-allocated if the rows don't fit into it anymore or the
+	 * storage precision was changed since the previous update of this
+	 * subspace.
+	 */
+	if (entry->alloc_rows < data->rows || entry->compact != aqo_compact_storage)
 	{
 		entry->rows = data->rows;
-		size = _compute_data_dsa(entry);
+		entry->compact = aqo_compact_storage;
+		entry->alloc_rows = _data_alloc_rows(entry->rows, entry->capacity);
+		size = _data_chunk_size(entry, entry->alloc_rows);
+		pg_atomic_fetch_add_u64(&aqo_state->data_reallocs, 1);
 
 		/* Need to re-allocate DSA chunk */
 		dsa_free(data_dsa, entry->data_dp);
@@ -1431,13 +3124,31 @@ aqo_data_store(uint64 fs, int fss, AqoDataArgs *data, List *reloids)
 		{
 			/*
 			 * DSA stuck into problems. Rollback changes. Return false in belief
-			 * that caller recognize it and don't try to call us more.
+			 * that caller recognize it and don't try to call us more. The
+			 * entry is lost, so remove its previous version from the disk too.
 			 */
-			(void) hash_search(data_htab, &key, HASH_REMOVE, NULL);
+			LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
+			_fss_index_remove(entry);
+			(void) hash_search_with_hash_value(data_htab, &key, hashcode,
+											   HASH_REMOVE, NULL);
+			data_entry_release();
+			_data_tombstone_add(&key);
 			LWLockRelease(&aqo_state->data_lock);
+			LWLockRelease(partition_lock);
 			return false;
 		}
 	}
+	else
+	{
+		/*
+		 * The chunk is large enough. Don't keep more rows than the caller
+		 * passed: arrays of the caller don't contain them.
+		 */
+		entry->rows = data->rows;
+		if (found)
+			pg_atomic_fetch_add_u64(&aqo_state->data_inplace, 1);
+	}
+
 	ptr = (char *) dsa_get_address(data_dsa, entry->data_dp);
 	Assert(ptr != NULL);
 
@@ -1449,19 +3160,14 @@ aqo_data_store(uint64 fs, int fss, AqoDataArgs *data, List *reloids)
 	ptr += sizeof(data_key);
 	if (entry->cols > 0)
 	{
-		for (i = 0; i < entry->rows; i++)
-		{
-			Assert(data->matrix[i]);
-			memcpy(ptr, data->matrix[i], sizeof(double) * data->cols);
-			ptr += sizeof(double) * data->cols;
-		}
+		Assert(data->matrix);
+		ptr = _data_write_doubles(ptr, data->matrix,
+								  entry->rows * data->cols, entry->compact);
 	}
 	/* copy targets into DSM storage */
-	memcpy(ptr, data->targets, sizeof(double) * entry->rows);
-	ptr += sizeof(double) * entry->rows;
+	ptr = _data_write_doubles(ptr, data->targets, entry->rows, entry->compact);
 	/* copy rfactors into DSM storage */
-	memcpy(ptr, data->rfactors, sizeof(double) * entry->rows);
-	ptr += sizeof(double) * entry->rows;
+	ptr = _data_write_doubles(ptr, data->rfactors, entry->rows, entry->compact);
 	/* store list of relations. XXX: optimize ? */
 	if (is_raw_data)
 	{
@@ -1478,11 +3184,14 @@ aqo_data_store(uint64 fs, int fss, AqoDataArgs *data, List *reloids)
 			ptr += sizeof(Oid);
 		}
 	}
-	aqo_state->data_changed = true;
+	entry->dirty = true;
+	pg_atomic_write_u32(&aqo_state->data_changed, 1);
+	checkpointer_note_dirty(offsetof(DataEntry, data_dp) +
+							_compute_data_dsa(entry));
 	Assert(entry->rows > 0);
 end:
-	result = aqo_state->data_changed;
-	LWLockRelease(&aqo_state->data_lock);
+	result = (pg_atomic_read_u32(&aqo_state->data_changed) != 0);
+	LWLockRelease(partition_lock);
 	return result;
 }
 
@@ -1500,12 +3209,12 @@ fs_distance(double *a, double *b, int len)
 }
 
 bool
-neirest_neighbor(double **matrix, int old_rows, double *neibour, int cols)
+neirest_neighbor(const double *matrix, int old_rows, double *neibour, int cols)
 {
 	int i;
 	for (i=0; i<old_rows; i++)
 	{
-		if (fs_distance(neibour, matrix[i], cols) == 0)
+		if (fs_distance(neibour, (double *) matrix + i * cols, cols) == 0)
 			return true;
 	}
 	return false;
@@ -1515,7 +3224,10 @@ static void
 build_knn_matrix(OkNNrdata *data, const OkNNrdata *temp_data, double *features)
 {
 	Assert(data->cols == temp_data->cols);
-	Assert(data->matrix);
+	Assert(data->cols == 0 || data->matrix);
+
+	/* Subspace could be learned with larger capacity than the default one */
+	OkNNr_reserve(data, temp_data->capacity);
 
 	if (features != NULL)
 	{
@@ -1530,11 +3242,12 @@ build_knn_matrix(OkNNrdata *data, const OkNNrdata *temp_data, double *features)
 
 			for (i = 0; i < temp_data->rows; i++)
 			{
-				if (k < aqo_K && !neirest_neighbor(data->matrix, old_rows,
-												   temp_data->matrix[i],
-												   data->cols))
+				if (k < data->capacity &&
+					!neirest_neighbor(data->matrix, old_rows,
+									  OkNNr_row(temp_data, i), data->cols))
 				{
-					memcpy(data->matrix[k], temp_data->matrix[i], data->cols * sizeof(double));
+					memcpy(OkNNr_row(data, k), OkNNr_row(temp_data, i),
+						   data->cols * sizeof(double));
 					data->rfactors[k] = temp_data->rfactors[i];
 					data->targets[k] = temp_data->targets[i];
 					k++;
@@ -1548,17 +3261,16 @@ build_knn_matrix(OkNNrdata *data, const OkNNrdata *temp_data, double *features)
 		if (data->rows > 0)
 			/* trivial strategy - use first suitable record and ignore others */
 			return;
-		memcpy(data, temp_data, sizeof(OkNNrdata));
-		if (data->cols > 0)
-		{
-			int i;
 
-			for (i = 0; i < data->rows; i++)
-			{
-				Assert(data->matrix[i]);
-				memcpy(data->matrix[i], temp_data->matrix[i], data->cols * sizeof(double));
-			}
-		}
+		/* Copy the data, but keep the arrays allocated by the caller */
+		data->rows = temp_data->rows;
+		if (data->cols > 0)
+			memcpy(data->matrix, temp_data->matrix,
+				   sizeof(double) * temp_data->rows * data->cols);
+		memcpy(data->targets, temp_data->targets,
+			   sizeof(double) * temp_data->rows);
+		memcpy(data->rfactors, temp_data->rfactors,
+			   sizeof(double) * temp_data->rows);
 	}
 }
 
@@ -1572,37 +3284,30 @@ _fill_knn_data(const DataEntry *entry, List **reloids)
 	size_t		sz = _compute_data_dsa(entry);
 
 	data = OkNNr_allocate(entry->cols);
+	OkNNr_reserve(data, entry->capacity);
 	data->rows = entry->rows;
 
 	ptr = (char *) dsa_get_address(data_dsa, entry->data_dp);
 
 	/* Check invariants */
-	Assert(entry->rows <= aqo_K);
+	Assert(entry->rows <= entry->capacity);
 	Assert(ptr != NULL);
 	Assert(entry->key.fss == ((data_key *)ptr)->fss);
-	Assert(data->matrix);
+	Assert(data->cols == 0 || data->matrix);
 
 	ptr += sizeof(data_key);
 
 	if (entry->cols > 0)
-	{
-		for (i = 0; i < entry->rows; i++)
-		{
-			Assert(data->matrix[i]);
-			memcpy(data->matrix[i], ptr, sizeof(double) * data->cols);
-			ptr += sizeof(double) * data->cols;
-		}
-	}
+		ptr = _data_read_doubles(data->matrix, ptr, entry->rows * data->cols,
+								 entry->compact);
 
 	/* copy targets from DSM storage */
-	memcpy(data->targets, ptr, sizeof(double) * entry->rows);
-	ptr += sizeof(double) * entry->rows;
+	ptr = _data_read_doubles(data->targets, ptr, entry->rows, entry->compact);
 	offset = ptr - (char *) dsa_get_address(data_dsa, entry->data_dp);
 	Assert(offset < sz);
 
 	/* copy rfactors from DSM storage */
-	memcpy(data->rfactors, ptr, sizeof(double) * entry->rows);
-	ptr += sizeof(double) * entry->rows;
+	ptr = _data_read_doubles(data->rfactors, ptr, entry->rows, entry->compact);
 	offset = ptr - (char *) dsa_get_address(data_dsa, entry->data_dp);
 	Assert(offset <= sz);
 
@@ -1634,7 +3339,7 @@ _fill_knn_data(const DataEntry *entry, List **reloids)
  * Return false if the operation was unsuccessful.
  */
 bool
-load_aqo_data(uint64 fs, int fss, OkNNrdata *data, List **reloids,
+load_aqo_data(uint64 fs, int64 fss, OkNNrdata *data, List **reloids,
 			  bool wideSearch, double *features)
 {
 	DataEntry  *entry;
@@ -1642,18 +3347,30 @@ load_aqo_data(uint64 fs, int fss, OkNNrdata *data, List **reloids,
 	data_key	key = {.fs = fs, .fss = fss};
 	OkNNrdata  *temp_data;
 
-	Assert(!LWLockHeldByMe(&aqo_state->data_lock));
-
 	dsa_init();
 
-	LWLockAcquire(&aqo_state->data_lock, LW_SHARED);
-
 	if (!wideSearch)
 	{
-		entry = (DataEntry *) hash_search(data_htab, &key, HASH_FIND, &found);
+		uint32		hashcode = get_hash_value(data_htab, &key);
+		LWLock	   *partition_lock = DataPartitionLock(hashcode);
+
+		Assert(!LWLockHeldByMe(partition_lock));
+retry:
+		LWLockAcquire(partition_lock, LW_SHARED);
+
+		entry = (DataEntry *) hash_search_with_hash_value(data_htab, &key,
+														  hashcode, HASH_FIND,
+														  &found);
 
 		if (!found)
-			goto end;
+		{
+			LWLockRelease(partition_lock);
+
+			/* The entry may still be in the file */
+			if (_data_file_materialize_key(&key, hashcode))
+				goto retry;
+			return false;
+		}
 
 		/* One entry with all correctly filled fields is found */
 		Assert(entry && entry->rows > 0);
@@ -1663,41 +3380,84 @@ load_aqo_data(uint64 fs, int fss, OkNNrdata *data, List **reloids,
 		{
 			/* Collision happened? */
 			elog(LOG, "[AQO] Does a collision happened? Check it if possible "
-				 "(fs: "UINT64_FORMAT", fss: %d).",
+				 "(fs: "UINT64_FORMAT", fss: "INT64_FORMAT").",
 				 fs, fss);
 			found = false; /* Sign of unsuccessful operation */
 			goto end;
 		}
 
+		data_entry_touch(entry);
 		temp_data = _fill_knn_data(entry, reloids);
 		Assert(temp_data->rows > 0);
 		build_knn_matrix(data, temp_data, features);
 		Assert(data->rows > 0);
+end:
+		LWLockRelease(partition_lock);
 	}
 	else
-	/* Iterate across all elements of the table. XXX: Maybe slow. */
+	/* Iterate across all entries of the subspace in the feature spaces. */
 	{
-		HASH_SEQ_STATUS	hash_seq;
+		FssIndexEntry  *ientry;
+		dlist_iter		iter;
+		data_key	   *keys = NULL;
+		int				nkeys = 0;
 		int				noids = -1;
+		int				i;
 
 		found = false;
-		hash_seq_init(&hash_seq, data_htab);
-		while ((entry = hash_seq_search(&hash_seq)) != NULL)
+
+		_data_file_materialize_fss(fss);
+
+		/*
+		 * Collect keys of the subspace entries under the index lock. Data of
+		 * each entry is read under the lock of its partition then.
+		 */
+		LWLockAcquire(&aqo_state->data_lock, LW_SHARED);
+		ientry = (FssIndexEntry *) hash_search(fss_index_htab, &fss,
+											   HASH_FIND, NULL);
+		if (ientry != NULL)
 		{
-			List *tmp_oids = NIL;
+			keys = palloc(sizeof(data_key) * ientry->nentries);
+			dlist_foreach(iter, &ientry->entries)
+			{
+				entry = dlist_container(DataEntry, fss_node, iter.cur);
+				Assert(entry->key.fss == fss);
+				keys[nkeys++] = entry->key;
+			}
+			Assert(nkeys == ientry->nentries);
+		}
+		LWLockRelease(&aqo_state->data_lock);
 
-			Assert(entry->rows > 0);
+		for (i = 0; i < nkeys; i++)
+		{
+			List	   *tmp_oids = NIL;
+			uint32		hashcode = get_hash_value(data_htab, &keys[i]);
+			LWLock	   *partition_lock = DataPartitionLock(hashcode);
 
-			if (entry->key.fss != fss || entry->cols != data->cols)
+			LWLockAcquire(partition_lock, LW_SHARED);
+
+			entry = (DataEntry *) hash_search_with_hash_value(data_htab,
+															  &keys[i],
+															  hashcode,
+															  HASH_FIND, NULL);
+
+			/* Entry could be removed concurrently */
+			if (entry == NULL || entry->cols != data->cols)
+			{
+				LWLockRelease(partition_lock);
 				continue;
+			}
 
+			Assert(entry->rows > 0);
+			data_entry_touch(entry);
 			temp_data = _fill_knn_data(entry, &tmp_oids);
+			LWLockRelease(partition_lock);
 
 			if (data->rows > 0 && list_length(tmp_oids) != noids)
 			{
 				/* Dubious case. So log it and skip these data */
 				elog(LOG,
-					 "[AQO] different number depended oids for the same fss %d: "
+					 "[AQO] different number depended oids for the same fss "INT64_FORMAT": "
 					 "%d and %d correspondingly.",
 					 fss, list_length(tmp_oids), noids);
 				Assert(noids >= 0);
@@ -1715,11 +3475,102 @@ load_aqo_data(uint64 fs, int fss, OkNNrdata *data, List **reloids,
 			build_knn_matrix(data, temp_data, NULL);
 			found = true;
 		}
+
+		if (keys != NULL)
+			pfree(keys);
+	}
+
+	Assert(!found || (data->rows > 0 && data->rows <= data->capacity));
+
+	return found;
+}
+
+/*
+ * Make a kNN prediction for the given feature subspace.
+ *
+ * Double-precision data is used right in the DSA memory under the shared lock
+ * of its partition, without copying it into the backend memory. Compact
+ * entries have to be converted to doubles, so they are loaded in the usual
+ * way.
+ *
+ * Return false if no data is found. Otherwise, the prediction (or -1 if it
+ * can't be made) is stored into the result.
+ */
+bool
+aqo_data_predict(uint64 fs, int64 fss, int ncols, double *features,
+				 double *result)
+{
+	DataEntry  *entry;
+	bool		found;
+	data_key	key = {.fs = fs, .fss = fss};
+	uint32		hashcode;
+	LWLock	   *partition_lock;
+
+	dsa_init();
+
+	hashcode = get_hash_value(data_htab, &key);
+	partition_lock = DataPartitionLock(hashcode);
+	Assert(!LWLockHeldByMe(partition_lock));
+retry:
+	LWLockAcquire(partition_lock, LW_SHARED);
+
+	entry = (DataEntry *) hash_search_with_hash_value(data_htab, &key, hashcode,
+													  HASH_FIND, &found);
+
+	if (!found)
+	{
+		LWLockRelease(partition_lock);
+
+		/* The entry may still be in the file */
+		if (_data_file_materialize_key(&key, hashcode))
+			goto retry;
+		return false;
+	}
+
+	Assert(entry && entry->rows > 0);
+	Assert(DsaPointerIsValid(entry->data_dp));
+
+	if (entry->cols != ncols)
+	{
+		/* Collision happened? */
+		elog(LOG, "[AQO] Does a collision happened? Check it if possible "
+			 "(fs: "UINT64_FORMAT", fss: "INT64_FORMAT").",
+			 fs, fss);
+		found = false;
+		goto end;
+	}
+
+	data_entry_touch(entry);
+	if (entry->compact)
+	{
+		OkNNrdata  *data = _fill_knn_data(entry, NULL);
+
+		*result = OkNNr_predict(data, features);
+		OkNNr_free(data);
+	}
+	else
+	{
+		OkNNrdata	data;
+		char	   *ptr = (char *) dsa_get_address(data_dsa, entry->data_dp);
+
+		Assert(entry->key.fss == ((data_key *) ptr)->fss);
+		ptr += sizeof(data_key);
+
+		/* Read-only view of the DSA chunk. Nothing is copied */
+		data.rows = entry->rows;
+		data.cols = entry->cols;
+		data.capacity = entry->rows;
+		data.matrix = (entry->cols > 0) ? (double *) ptr : NULL;
+		ptr += sizeof(double) * entry->rows * entry->cols;
+		data.targets = (double *) ptr;
+		ptr += sizeof(double) * entry->rows;
+		data.rfactors = (double *) ptr;
+
+		*result = OkNNr_predict(&data, features);
 	}
 
-	Assert(!found || (data->rows > 0 && data->rows <= aqo_K));
 end:
-	LWLockRelease(&aqo_state->data_lock);
+	LWLockRelease(partition_lock);
 
 	return found;
 }
@@ -1766,16 +3617,18 @@ aqo_data(PG_FUNCTION_ARGS)
 	MemoryContextSwitchTo(oldcontext);
 
 	dsa_init();
-	LWLockAcquire(&aqo_state->data_lock, LW_SHARED);
+	_aqo_data_load_pending();
+	data_lock_all(LW_SHARED);
 	hash_seq_init(&hash_seq, data_htab);
 	while ((entry = hash_seq_search(&hash_seq)) != NULL)
 	{
-		char *ptr;
+		char   *ptr;
+		double *buf;
 
 		memset(nulls, 0, AD_TOTAL_NCOLS);
 
 		values[AD_FS] = Int64GetDatum(entry->key.fs);
-		values[AD_FSS] = Int32GetDatum((int) entry->key.fss);
+		values[AD_FSS] = Int64GetDatum(entry->key.fss);
 		values[AD_NFEATURES] = Int32GetDatum(entry->cols);
 
 		/* Fill values from the DSA data chunk */
@@ -1784,17 +3637,24 @@ aqo_data(PG_FUNCTION_ARGS)
 		Assert(entry->key.fs == ((data_key*)ptr)->fs && entry->key.fss == ((data_key*)ptr)->fss);
 		ptr += sizeof(data_key);
 
+		/* Values are converted to double precision, if stored compactly */
+		buf = palloc(sizeof(double) * entry->rows * Max(entry->cols, 1));
+
 		if (entry->cols > 0)
-			values[AD_FEATURES] = PointerGetDatum(form_matrix((double *) ptr,
+		{
+			ptr = _data_read_doubles(buf, ptr, entry->rows * entry->cols,
+									 entry->compact);
+			values[AD_FEATURES] = PointerGetDatum(form_matrix(buf,
 													entry->rows, entry->cols));
+		}
 		else
 			nulls[AD_FEATURES] = true;
 
-		ptr += sizeof(double) * entry->rows * entry->cols;
-		values[AD_TARGETS] = PointerGetDatum(form_vector((double *)ptr, entry->rows));
-		ptr += sizeof(double) * entry->rows;
-		values[AD_RELIABILITY] = PointerGetDatum(form_vector((double *)ptr, entry->rows));
-		ptr += sizeof(double) * entry->rows;
+		ptr = _data_read_doubles(buf, ptr, entry->rows, entry->compact);
+		values[AD_TARGETS] = PointerGetDatum(form_vector(buf, entry->rows));
+		ptr = _data_read_doubles(buf, ptr, entry->rows, entry->compact);
+		values[AD_RELIABILITY] = PointerGetDatum(form_vector(buf, entry->rows));
+		pfree(buf);
 
 		if (entry->nrels > 0)
 		{
@@ -1819,39 +3679,60 @@ aqo_data(PG_FUNCTION_ARGS)
 		tuplestore_putvalues(tupstore, tupDesc, values, nulls);
 	}
 
-	LWLockRelease(&aqo_state->data_lock);
+	data_unlock_all();
 	tuplestore_donestoring(tupstore);
 	return (Datum) 0;
 }
 
+static int
+fs_cmp(const void *a, const void *b)
+{
+	uint64	fa = *(const uint64 *) a;
+	uint64	fb = *(const uint64 *) b;
+
+	return (fa > fb) ? 1 : ((fa < fb) ? -1 : 0);
+}
+
+/*
+ * Remove ML data of all the given feature spaces by one pass over the table.
+ * The array is sorted in place.
+ */
 static long
-_aqo_data_clean(uint64 fs)
+_aqo_data_clean_fss(uint64 *fss, int nfs)
 {
 	HASH_SEQ_STATUS	hash_seq;
 	DataEntry	   *entry;
 	long			removed = 0;
 
 	Assert(!LWLockHeldByMe(&aqo_state->data_lock));
-	LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
 
+	qsort(fss, nfs, sizeof(uint64), fs_cmp);
+
+	data_lock_all(LW_EXCLUSIVE);
+	_data_file_materialize_all();
+
+	LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
 	hash_seq_init(&hash_seq, data_htab);
 	while ((entry = hash_seq_search(&hash_seq)) != NULL)
 	{
-		if (entry->key.fs != fs)
+		if (bsearch(&entry->key.fs, fss, nfs, sizeof(uint64), fs_cmp) == NULL)
 			continue;
 
-		Assert(DsaPointerIsValid(entry->data_dp));
-		dsa_free(data_dsa, entry->data_dp);
-		entry->data_dp = InvalidDsaPointer;
-		if (!hash_search(data_htab, &entry->key, HASH_REMOVE, NULL))
-			elog(PANIC, "[AQO] hash table corrupted");
+		_data_entry_drop(entry);
 		removed++;
 	}
-
 	LWLockRelease(&aqo_state->data_lock);
+
+	data_unlock_all();
 	return removed;
 }
 
+static long
+_aqo_data_clean(uint64 fs)
+{
+	return _aqo_data_clean_fss(&fs, 1);
+}
+
 static long
 aqo_data_reset(void)
 {
@@ -1859,31 +3740,35 @@ aqo_data_reset(void)
 	DataEntry	   *entry;
 	long			num_remove = 0;
 	long			num_entries;
+	long			num_discarded;
 
 	dsa_init();
 
 	Assert(!LWLockHeldByMe(&aqo_state->data_lock));
-	LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
+	data_lock_all(LW_EXCLUSIVE);
+	num_discarded = _data_file_discard();
 	num_entries = hash_get_num_entries(data_htab);
+
+	/* Just write an empty file instead of the tombstones */
+	if (num_entries > 0)
+		pg_atomic_write_u32(&aqo_state->data_removed, 1);
+	LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
 	hash_seq_init(&hash_seq, data_htab);
 	while ((entry = hash_seq_search(&hash_seq)) != NULL)
 	{
-		Assert(DsaPointerIsValid(entry->data_dp));
-		dsa_free(data_dsa, entry->data_dp);
-		if (!hash_search(data_htab, &entry->key, HASH_REMOVE, NULL))
-			elog(PANIC, "[AQO] hash table corrupted");
+		_data_entry_drop(entry);
 		num_remove++;
 	}
-
-	if (num_remove > 0)
-		aqo_state->data_changed = true;
 	LWLockRelease(&aqo_state->data_lock);
+	dsa_trim(data_dsa);
+
+	data_unlock_all();
 	if (num_remove != num_entries)
 		elog(ERROR, "[AQO] Query ML memory storage is corrupted or parallel access without a lock has detected.");
 
 	aqo_data_flush();
 
-	return num_remove;
+	return num_remove + num_discarded;
 }
 
 Datum
@@ -2008,12 +3893,244 @@ aqo_queries_store(uint64 queryid,
 		/* Remove the class from cache of deactivated queries */
 		hash_search(deactivated_queries, &queryid, HASH_REMOVE, NULL);
 
-	aqo_state->queries_changed = true;
 	aqo_state->queries_changed = true;
 	LWLockRelease(&aqo_state->queries_lock);
+	checkpointer_note_dirty(sizeof(QueriesEntry));
 	return true;
 }
 
+/*
+ * Admission and eviction of query classes when the storage is full.
+ *
+ * Queries, stat and query texts storages keep the same set of classes and
+ * have the same size (aqo.fs_max_items). When the storage is full, a new class
+ * is admitted only if it is planned at least twice recently: the doorkeeper
+ * remembers the last denied class for each slot. So a stream of ad-hoc queries
+ * doesn't wash out the knowledge base.
+ *
+ * The admitted class makes room by eviction of a batch of the least valuable
+ * classes. They are ranked by the number of executions since the previous
+ * eviction, then by the decrease of execution time achieved by AQO and by the
+ * number of executions at all. A class without any statistics is the first
+ * candidate.
+ *
+ * Eviction scans all the storages, so it isn't done by the planner: the
+ * checkpointer is asked for it, and one of the next plannings of the class
+ * finds the room. Only if the checkpointer isn't running, the planner evicts
+ * by itself.
+ */
+
+/* Part of the storage freed by one eviction */
+#define QUERIES_EVICT_FRACTION	(64)
+
+typedef struct QueryClassRank
+{
+	uint64	queryid;
+	int64	recent_execs;	/* executions since the previous eviction */
+	double	benefit;		/* decrease of mean execution time by AQO */
+	int64	execs;
+} QueryClassRank;
+
+static int
+query_class_rank_cmp(const void *a, const void *b)
+{
+	const QueryClassRank *ra = (const QueryClassRank *) a;
+	const QueryClassRank *rb = (const QueryClassRank *) b;
+
+	if (ra->recent_execs != rb->recent_execs)
+		return (ra->recent_execs > rb->recent_execs) ? 1 : -1;
+	if (ra->benefit != rb->benefit)
+		return (ra->benefit > rb->benefit) ? 1 : -1;
+	if (ra->execs != rb->execs)
+		return (ra->execs > rb->execs) ? 1 : -1;
+	return 0;
+}
+
+static double
+_stat_mean(const double *values, int n)
+{
+	double	sum = 0.;
+	int		i;
+
+	for (i = 0; i < n; i++)
+		sum += values[i];
+	return (n > 0) ? sum / n : 0.;
+}
+
+/*
+ * Evict the least valuable query classes with all their data.
+ * Caller must not hold any lock of the storage.
+ *
+ * Return the number of evicted classes.
+ */
+static long
+_aqo_queries_evict(void)
+{
+	HASH_SEQ_STATUS	hash_seq;
+	QueriesEntry   *qentry;
+	StatEntry	   *sentry;
+	QueryClassRank *ranks;
+	uint64		   *victims;
+	uint64		   *shared;
+	int				nranks = 0;
+	int				nshared = 0;
+	int				nvictims;
+	int				i;
+
+	LWLockAcquire(&aqo_state->queries_lock, LW_SHARED);
+	ranks = palloc(sizeof(QueryClassRank) * hash_get_num_entries(queries_htab));
+	shared = palloc(sizeof(uint64) * hash_get_num_entries(queries_htab));
+
+	/* Feature spaces borrowed by other classes */
+	hash_seq_init(&hash_seq, queries_htab);
+	while ((qentry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (qentry->fs != qentry->queryid)
+			shared[nshared++] = qentry->fs;
+	}
+	qsort(shared, nshared, sizeof(uint64), fs_cmp);
+
+	hash_seq_init(&hash_seq, queries_htab);
+	while ((qentry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		/*
+		 * Don't touch the default feature space and classes which share
+		 * a feature space with others, whether they borrow it or own it
+		 * (it can be done only manually).
+		 */
+		if (qentry->queryid == 0 || qentry->fs != qentry->queryid ||
+			bsearch(&qentry->queryid, shared, nshared, sizeof(uint64),
+					fs_cmp) != NULL)
+			continue;
+
+		ranks[nranks].queryid = qentry->queryid;
+		ranks[nranks].recent_execs = 0;
+		ranks[nranks].benefit = 0.;
+		ranks[nranks].execs = 0;
+		nranks++;
+	}
+	LWLockRelease(&aqo_state->queries_lock);
+	pfree(shared);
+
+	if (nranks == 0)
+	{
+		pfree(ranks);
+		return 0;
+	}
+
+	LWLockAcquire(&aqo_state->stat_lock, LW_EXCLUSIVE);
+	for (i = 0; i < nranks; i++)
+	{
+		sentry = (StatEntry *) hash_search(stat_htab, &ranks[i].queryid,
+										   HASH_FIND, NULL);
+		if (sentry == NULL)
+			continue;
+
+		ranks[i].execs = sentry->execs_with_aqo + sentry->execs_without_aqo;
+		ranks[i].recent_execs = ranks[i].execs - sentry->execs_at_sweep;
+		if (sentry->cur_stat_slot > 0 && sentry->cur_stat_slot_aqo > 0)
+			ranks[i].benefit =
+				_stat_mean(sentry->exec_time, sentry->cur_stat_slot) -
+				_stat_mean(sentry->exec_time_aqo, sentry->cur_stat_slot_aqo);
+	}
+
+	/* The next eviction counts executions since now */
+	hash_seq_init(&hash_seq, stat_htab);
+	while ((sentry = hash_seq_search(&hash_seq)) != NULL)
+		sentry->execs_at_sweep = sentry->execs_with_aqo +
+								 sentry->execs_without_aqo;
+	aqo_state->stat_changed = true;
+	LWLockRelease(&aqo_state->stat_lock);
+
+	qsort(ranks, nranks, sizeof(QueryClassRank), query_class_rank_cmp);
+	nvictims = Min(nranks, Max(fs_max_items / QUERIES_EVICT_FRACTION, 1));
+
+	victims = palloc(sizeof(uint64) * nvictims);
+	for (i = 0; i < nvictims; i++)
+	{
+		uint64	queryid = ranks[i].queryid;
+
+		_aqo_queries_remove(queryid);
+		_aqo_stat_remove(queryid);
+		_aqo_qtexts_remove(queryid);
+
+		/* Feature space of the evicted class is the same as its queryid */
+		victims[i] = queryid;
+	}
+	(void) _aqo_data_clean_fss(victims, nvictims);
+
+	pg_atomic_fetch_add_u64(&aqo_state->queries_evicted, nvictims);
+	elog(DEBUG1, "[AQO] %d query classes are evicted.", nvictims);
+
+	pfree(victims);
+	pfree(ranks);
+	return nvictims;
+}
+
+/*
+ * Check that a new query class can be added into the storage. If the storage
+ * is full, the class may be admitted by eviction of others.
+ *
+ * Return false if the class shouldn't be added now.
+ */
+bool
+aqo_queries_admit(uint64 queryid)
+{
+	uint64 *slot = &aqo_state->queries_doorkeeper[queryid % AQO_DOORKEEPER_SIZE];
+
+	LWLockAcquire(&aqo_state->queries_lock, LW_EXCLUSIVE);
+	if (hash_get_num_entries(queries_htab) < fs_max_items)
+	{
+		LWLockRelease(&aqo_state->queries_lock);
+		return true;
+	}
+
+	if (*slot != queryid)
+	{
+		/* First time: just remember the class */
+		*slot = queryid;
+		LWLockRelease(&aqo_state->queries_lock);
+		return false;
+	}
+
+	/* Second time: make room for the class. The slot keeps it until then */
+	pg_atomic_write_u32(&aqo_state->queries_evict_requested, 1);
+	if (checkpointer_wakeup())
+	{
+		LWLockRelease(&aqo_state->queries_lock);
+		return false;
+	}
+
+	*slot = 0;
+	LWLockRelease(&aqo_state->queries_lock);
+
+	return (aqo_queries_evict_pending() > 0);
+}
+
+/*
+ * Evict query classes if a backend has asked for room in the full storage.
+ * Caller must not hold any lock of the storage.
+ *
+ * Return the number of evicted classes.
+ */
+long
+aqo_queries_evict_pending(void)
+{
+	bool	full;
+
+	if (pg_atomic_exchange_u32(&aqo_state->queries_evict_requested, 0) == 0)
+		return 0;
+
+	dsa_init();
+
+	/* Somebody could make the room meanwhile */
+	LWLockAcquire(&aqo_state->queries_lock, LW_SHARED);
+	full = (hash_get_num_entries(queries_htab) >= fs_max_items);
+	LWLockRelease(&aqo_state->queries_lock);
+
+	return full ? _aqo_queries_evict() : 0;
+}
+
 static long
 aqo_queries_reset(void)
 {
@@ -2249,79 +4366,100 @@ cleanup_aqo_database(bool gentle, int *fs_num, int *fss_num)
 {
 	HASH_SEQ_STATUS	hash_seq;
 	QueriesEntry   *entry;
+	QueriesEntry   *classes;
+	long			nclasses = 0;
+	long			j;
 
 	/* Call it because we might touch DSA segments during the cleanup */
 	dsa_init();
+	_aqo_data_load_pending();
 
 	*fs_num = 0;
 	*fss_num = 0;
 
 	/*
-	 * It's a long haul. So, make seq scan without any lock. It is possible
-	 * because only this operation can delete data from hash table.
+	 * It's a long haul, and query classes and ML data can be evicted by any
+	 * backend meanwhile. So, work on a copy of aqo_queries, and scan ML data
+	 * under the locks.
 	 */
+	LWLockAcquire(&aqo_state->queries_lock, LW_SHARED);
+	classes = palloc(sizeof(QueriesEntry) * hash_get_num_entries(queries_htab));
 	hash_seq_init(&hash_seq, queries_htab);
 	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		classes[nclasses++] = *entry;
+	LWLockRelease(&aqo_state->queries_lock);
+
+	for (j = 0; j < nclasses; j++)
 	{
 		HASH_SEQ_STATUS	hash_seq2;
 		DataEntry	   *dentry;
 		List		   *junk_fss = NIL;
 		List		   *actual_fss = NIL;
+		List		   *rel_fss = NIL;
+		List		   *rel_oids = NIL;
 		ListCell	   *lc;
+		ListCell	   *lc2;
 
-		/* Scan aqo_data for any junk records related to this FS */
+		entry = &classes[j];
+
+		/*
+		 * Collect relations of this FS. Entries may be evicted concurrently,
+		 * so don't keep any of them after the locks are released.
+		 */
+		data_lock_all(LW_SHARED);
 		hash_seq_init(&hash_seq2, data_htab);
 		while ((dentry = hash_seq_search(&hash_seq2)) != NULL)
 		{
-			char *ptr;
+			char	   *ptr;
+			int			i;
 
 			if (entry->fs != dentry->key.fs)
 				/* Another FS */
 				continue;
 
-			LWLockAcquire(&aqo_state->data_lock, LW_SHARED);
+			if (dentry->nrels <= 0)
+			{
+				/*
+				 * Impossible case. We don't use AQO for so simple or synthetic
+				 * data. Just detect errors in this logic.
+				 */
+				ereport(PANIC,
+						(errcode(ERRCODE_INTERNAL_ERROR),
+						 errmsg("AQO detected incorrect behaviour: fs="
+						 UINT64_FORMAT" fss="INT64_FORMAT,
+						dentry->key.fs, dentry->key.fss)));
+			}
 
 			Assert(DsaPointerIsValid(dentry->data_dp));
 			ptr = dsa_get_address(data_dsa, dentry->data_dp);
 
 			ptr += sizeof(data_key);
-			ptr += sizeof(double) * dentry->rows * dentry->cols;
-			ptr += sizeof(double) * 2 * dentry->rows;
+			ptr += DataEntryElemSize(dentry) * dentry->rows * dentry->cols;
+			ptr += DataEntryElemSize(dentry) * 2 * dentry->rows;
 
-			if (dentry->nrels > 0)
+			for (i = 0; i < dentry->nrels; i++)
 			{
-				int			i;
-
-				/* Check each OID to be existed. */
-				for(i = 0; i < dentry->nrels; i++)
-				{
-					Oid reloid = ObjectIdGetDatum(*(Oid *)ptr);
+				rel_fss = lappend_uint64(rel_fss, dentry->key.fss);
+				rel_oids = lappend_oid(rel_oids, *(Oid *) ptr);
+				ptr += sizeof(Oid);
+			}
+		}
+		data_unlock_all();
 
-					if (!SearchSysCacheExists1(RELOID, reloid))
-						/* Remember this value */
-						junk_fss = list_append_unique_int(junk_fss,
-														  dentry->key.fss);
-					else
-						actual_fss = list_append_unique_int(actual_fss,
-															dentry->key.fss);
+		/* Check each OID to be existed */
+		forboth(lc, rel_fss, lc2, rel_oids)
+		{
+			uint64	fss = *((uint64 *) lfirst(lc));
+			Oid		reloid = lfirst_oid(lc2);
 
-					ptr += sizeof(Oid);
-				}
-			}
-			else
+			/* Remember this value */
+			if (!SearchSysCacheExists1(RELOID, ObjectIdGetDatum(reloid)))
 			{
-				/*
-				 * Impossible case. We don't use AQO for so simple or synthetic
-				 * data. Just detect errors in this logic.
-				 */
-				ereport(PANIC,
-						(errcode(ERRCODE_INTERNAL_ERROR),
-						 errmsg("AQO detected incorrect behaviour: fs="
-						 UINT64_FORMAT" fss=%d",
-						dentry->key.fs, (int32) dentry->key.fss)));
+				if (!list_member_uint64(junk_fss, fss))
+					junk_fss = lappend_uint64(junk_fss, fss);
 			}
-
-			LWLockRelease(&aqo_state->data_lock);
+			else if (!list_member_uint64(actual_fss, fss))
+				actual_fss = lappend_uint64(actual_fss, fss);
 		}
 
 		/*
@@ -2334,7 +4472,8 @@ cleanup_aqo_database(bool gentle, int *fs_num, int *fss_num)
 		/* Remove junk records from aqo_data */
 		foreach(lc, junk_fss)
 		{
-			data_key	key = {.fs = entry->fs, .fss = lfirst_int(lc)};
+			data_key	key = {.fs = entry->fs,
+							   .fss = (int64) *((uint64 *) lfirst(lc))};
 			(*fss_num) += (int) _aqo_data_remove(&key);
 		}
 
@@ -2354,6 +4493,7 @@ cleanup_aqo_database(bool gentle, int *fs_num, int *fss_num)
 			(*fs_num) += (int) _aqo_queries_remove(entry->queryid);
 		}
 	}
+	pfree(classes);
 
 	/*
 	 * The best place to flush updated AQO storage: calling the routine, user
@@ -2769,8 +4909,7 @@ Datum
 aqo_data_update(PG_FUNCTION_ARGS)
 {
 	uint64		fs;
-	int			fss;
-	double		*features_arr[aqo_K];
+	int64		fss;
 	AqoDataArgs	data_arg;
 
 	ArrayType	*arr;
@@ -2781,17 +4920,18 @@ aqo_data_update(PG_FUNCTION_ARGS)
 		PG_RETURN_BOOL(false);
 
 	fs = PG_GETARG_INT64(AD_FS);
-	fss = PG_GETARG_INT32(AD_FSS);
+	fss = PG_GETARG_INT64(AD_FSS);
 	data_arg.cols = PG_GETARG_INT32(AD_NFEATURES);
 
 	/* Init traget & reliability arrays. */
 	data_arg.rows =
 		init_dbl_array(&data_arg.targets,
 					   PG_GETARG_ARRAYTYPE_P(AD_TARGETS));
-	if (data_arg.rows ==  -1 || data_arg.rows > aqo_K ||
+	if (data_arg.rows ==  -1 || data_arg.rows > AQO_K_MAX ||
 		data_arg.rows != init_dbl_array(&data_arg.rfactors,
 										PG_GETARG_ARRAYTYPE_P(AD_RELIABILITY)))
 		PG_RETURN_BOOL(false);
+	data_arg.capacity = Max(data_arg.rows, aqo_K);
 
 	/* Init matrix array. */
 	if (data_arg.cols == 0 && !PG_ARGISNULL(AD_FEATURES))
@@ -2804,8 +4944,6 @@ aqo_data_update(PG_FUNCTION_ARGS)
 	}
 	else
 	{
-		int		i;
-
 		arr = PG_GETARG_ARRAYTYPE_P(AD_FEATURES);
 		/*
 		 * Features is two dimensional array.
@@ -2817,12 +4955,8 @@ aqo_data_update(PG_FUNCTION_ARGS)
 			data_arg.cols != ARR_DIMS(arr)[1])
 			PG_RETURN_BOOL(false);
 
-		for (i = 0; i < ARR_DIMS(arr)[0]; i++)
-		{
-			features_arr[i] = (double *) ARR_DATA_PTR(arr) +
-				i * ARR_DIMS(arr)[1];
-		}
-		data_arg.matrix = features_arr;
+		/* Array data is already a row-major matrix */
+		data_arg.matrix = (double *) ARR_DATA_PTR(arr);
 	}
 
 	/* Init oids array. */
@@ -2834,3 +4968,163 @@ aqo_data_update(PG_FUNCTION_ARGS)
 
 	PG_RETURN_BOOL(aqo_data_store(fs, fss, &data_arg, NULL));
 }
+
+/*
+ * Return counters of the eviction from the full storage.
+ */
+Datum
+aqo_eviction_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupDesc;
+	HeapTuple	tuple;
+	Datum		values[3];
+	bool		nulls[3] = {0, 0, 0};
+
+	if (get_call_result_type(fcinfo, NULL, &tupDesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	Assert(tupDesc->natts == 3);
+
+	values[0] = Int64GetDatum((int64) pg_atomic_read_u64(&aqo_state->data_evicted));
+	values[1] = Int64GetDatum((int64) pg_atomic_read_u64(&aqo_state->data_sweeps));
+	values[2] = Int64GetDatum((int64) pg_atomic_read_u64(&aqo_state->queries_evicted));
+
+	tuple = heap_form_tuple(tupDesc, values, nulls);
+	PG_RETURN_DATUM(HeapTupleGetDatum(tuple));
+}
+
+/*
+ * Show how DSA memory is used by the ML data: bytes used by the rows of the
+ * subspaces, bytes allocated for their chunks, total size of the DSA area
+ * and the counters of updates of the chunks.
+ */
+Datum
+aqo_data_memory_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc		tupDesc;
+	HeapTuple		tuple;
+	Datum			values[6];
+	bool			nulls[6] = {0, 0, 0, 0, 0, 0};
+	HASH_SEQ_STATUS	hash_seq;
+	DataEntry	   *entry;
+	int64			nentries;
+	int64			used = 0;
+	int64			allocated = 0;
+
+	if (get_call_result_type(fcinfo, NULL, &tupDesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	Assert(tupDesc->natts == 6);
+
+	dsa_init();
+
+	data_lock_all(LW_SHARED);
+	nentries = hash_get_num_entries(data_htab);
+	hash_seq_init(&hash_seq, data_htab);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		used += _compute_data_dsa(entry);
+		allocated += _data_chunk_size(entry, entry->alloc_rows);
+	}
+	data_unlock_all();
+
+	values[0] = Int64GetDatum(nentries);
+	values[1] = Int64GetDatum(used);
+	values[2] = Int64GetDatum(allocated);
+	values[3] = Int64GetDatum((int64) dsa_get_total_size(data_dsa));
+	values[4] = Int64GetDatum((int64) pg_atomic_read_u64(&aqo_state->data_reallocs));
+	values[5] = Int64GetDatum((int64) pg_atomic_read_u64(&aqo_state->data_inplace));
+
+	tuple = heap_form_tuple(tupDesc, values, nulls);
+	PG_RETURN_DATUM(HeapTupleGetDatum(tuple));
+}
+
+/*
+ * Remove all the query texts. Unlike aqo_reset(), the rest of the knowledge
+ * base is kept: texts are used for an analysis only.
+ */
+Datum
+aqo_query_texts_reset(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_INT64(aqo_qtexts_reset());
+}
+
+typedef enum {
+	DU_NAME = 0, DU_ALLOCATED, DU_USED, DU_LIMIT, DU_TOTAL_NCOLS
+} du_output_order;
+
+/*
+ * Show usage of the DSA areas: the size allocated by the area, the size of
+ * its chunks and the limit of the area (NULL if it is unlimited).
+ */
+Datum
+aqo_dsa_usage(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc			tupDesc;
+	MemoryContext		per_query_ctx;
+	MemoryContext		oldcontext;
+	Tuplestorestate	   *tupstore;
+	Datum				values[DU_TOTAL_NCOLS];
+	bool				nulls[DU_TOTAL_NCOLS] = {0, 0, 0, 0};
+	HASH_SEQ_STATUS		hash_seq;
+	QueryTextEntry	   *qentry;
+	DataEntry		   *dentry;
+	int64				used = 0;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupDesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	Assert(tupDesc->natts == DU_TOTAL_NCOLS);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupDesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	dsa_init();
+
+	LWLockAcquire(&aqo_state->qtexts_lock, LW_SHARED);
+	hash_seq_init(&hash_seq, qtexts_htab);
+	while ((qentry = hash_seq_search(&hash_seq)) != NULL)
+		used += strlen((char *) dsa_get_address(qtext_dsa, qentry->qtext_dp)) + 1;
+	values[DU_NAME] = CStringGetTextDatum("AQO Query Texts DSA");
+	values[DU_ALLOCATED] = Int64GetDatum((int64) dsa_get_total_size(qtext_dsa));
+	values[DU_USED] = Int64GetDatum(used);
+	values[DU_LIMIT] = Int64GetDatum((int64) dsm_qtexts_size_max * 1024 * 1024);
+	nulls[DU_LIMIT] = (dsm_qtexts_size_max <= 0);
+	LWLockRelease(&aqo_state->qtexts_lock);
+	tuplestore_putvalues(tupstore, tupDesc, values, nulls);
+
+	used = 0;
+	data_lock_all(LW_SHARED);
+	hash_seq_init(&hash_seq, data_htab);
+	while ((dentry = hash_seq_search(&hash_seq)) != NULL)
+		used += _data_chunk_size(dentry, dentry->alloc_rows);
+	values[DU_NAME] = CStringGetTextDatum("AQO Data DSA");
+	values[DU_ALLOCATED] = Int64GetDatum((int64) dsa_get_total_size(data_dsa));
+	values[DU_USED] = Int64GetDatum(used);
+	values[DU_LIMIT] = Int64GetDatum((int64) dsm_size_max * 1024 * 1024);
+	nulls[DU_LIMIT] = (dsm_size_max <= 0);
+	data_unlock_all();
+	tuplestore_putvalues(tupstore, tupDesc, values, nulls);
+
+	tuplestore_donestoring(tupstore);
+	return (Datum) 0;
+}
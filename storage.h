@@ -1,7 +1,9 @@
 #ifndef STORAGE_H
 #define STORAGE_H
 
+#include "lib/ilist.h"
 #include "nodes/pg_list.h"
+#include "port/atomics.h"
 #include "utils/array.h"
 #include "utils/dsa.h" /* Public structs have links to DSA memory blocks */
 
@@ -34,6 +36,12 @@ typedef struct StatEntry
 	double	exec_time_aqo[STAT_SAMPLE_SIZE];
 	double	plan_time_aqo[STAT_SAMPLE_SIZE];
 	double	est_error_aqo[STAT_SAMPLE_SIZE];
+
+	/*
+	 * Number of executions at the last eviction of query classes. Executions
+	 * since then show that the class is still alive.
+	 */
+	int64	execs_at_sweep;
 } StatEntry;
 
 /*
@@ -72,7 +80,7 @@ typedef struct QueryTextEntry
 typedef struct data_key
 {
 	uint64	fs;
-	int64	fss; /* just for alignment */
+	int64	fss;
 } data_key;
 
 typedef struct DataEntry
@@ -83,15 +91,44 @@ typedef struct DataEntry
 	int cols; /* aka nfeatures */
 	int rows; /* aka number of equations */
 	int nrels;
+	int capacity; /* max number of rows, which can be learned */
+	bool compact; /* matrix, targets and rfactors are stored as float4 */
 
 	/*
 	 * Link to DSA-allocated memory block. Can be shared across backends.
 	 * Contains:
 	 * matrix[][], targets[], reliability[], oids.
+	 * In the compact mode the matrix, targets and reliability are float4.
 	 */
 	dsa_pointer data_dp;
+
+	/*
+	 * Fields below are runtime-only and aren't written to the disk.
+	 */
+	dlist_node	fss_node; /* entry in the list of FssIndexEntry */
+
+	/*
+	 * Usage count of the clock sweep, which evicts cold entries when the table
+	 * is full. Bumped on each use of the entry, decremented by the sweep.
+	 */
+	pg_atomic_uint32 usage_count;
+
+	int			alloc_rows; /* number of rows the DSA chunk has room for */
+	bool		dirty; /* changed since it was written to the disk */
 } DataEntry;
 
+/*
+ * Secondary index of the ML data: all entries of one feature subspace across
+ * feature spaces. Used by the wide search.
+ */
+typedef struct FssIndexEntry
+{
+	int64		fss; /* The key in the hash table */
+
+	int			nentries;
+	dlist_head	entries; /* list of DataEntry */
+} FssIndexEntry;
+
 typedef struct QueriesEntry
 {
 	uint64	queryid;
@@ -127,11 +164,14 @@ extern AqoQueriesNullArgs aqo_queries_nulls;
 
 extern int querytext_max_size;
 extern int dsm_size_max;
+extern int dsm_qtexts_size_max;
+extern bool aqo_compact_storage;
 
 extern HTAB *stat_htab;
 extern HTAB *qtexts_htab;
 extern HTAB *queries_htab; /* TODO */
 extern HTAB *data_htab; /* TODO */
+extern HTAB *fss_index_htab;
 
 extern StatEntry *aqo_stat_store(uint64 queryid, bool use_aqo,
 								 AqoStatArgs *stat_arg, bool append_mode);
@@ -142,17 +182,22 @@ extern bool aqo_qtext_store(uint64 queryid, const char *query_string);
 extern void aqo_qtexts_flush(void);
 extern void aqo_qtexts_load(void);
 
-extern bool aqo_data_store(uint64 fs, int fss, AqoDataArgs *data,
+extern bool aqo_data_store(uint64 fs, int64 fss, AqoDataArgs *data,
 						   List *reloids);
-extern bool load_aqo_data(uint64 fs, int fss, OkNNrdata *data, List **reloids,
-						  bool wideSearch, double *features);
+extern bool load_aqo_data(uint64 fs, int64 fss, OkNNrdata *data,
+						  List **reloids, bool wideSearch, double *features);
+extern bool aqo_data_predict(uint64 fs, int64 fss, int ncols, double *features,
+							 double *result);
 extern void aqo_data_flush(void);
+extern bool aqo_data_prefetch(int nentries);
 extern void aqo_data_load(void);
 
 extern bool aqo_queries_find(uint64 queryid, QueryContextData *ctx);
 extern bool aqo_queries_store(uint64 queryid, uint64 fs, bool learn_aqo,
 							  bool use_aqo, bool auto_tuning,
 							  AqoQueriesNullArgs *null_args);
+extern bool aqo_queries_admit(uint64 queryid);
+extern long aqo_queries_evict_pending(void);
 extern void aqo_queries_flush(void);
 extern void aqo_queries_load(void);
 
@@ -5,7 +5,7 @@ use Config;
 use PostgreSQL::Test::Cluster;
 use PostgreSQL::Test::Utils;
 
-use Test::More tests => 27;
+use Test::More tests => 28;
 
 my $node = PostgreSQL::Test::Cluster->new('aqotest');
 $node->init;
@@ -408,4 +408,49 @@ $node->command_ok([ 'pgbench', '-T',
 					"50", '-c', "$CLIENTS", '-j', "$THREADS" , '-f', "$bank"],
 					'Conflicts with an AQO dropping command.');
 
+# ##############################################################################
+#
+# Throughput with many clients. In the learn mode each backend updates the
+# shared ML data at the end of each query, so the clients compete for locks of
+# the partitioned ML data hash table.
+#
+# ##############################################################################
+
+my $MANY_CLIENTS = 64;
+if (defined $ENV{MANY_CLIENTS})
+{
+	$MANY_CLIENTS = $ENV{MANY_CLIENTS};
+}
+
+$node->append_conf('postgresql.conf', "max_connections = " . ($MANY_CLIENTS + 10));
+$node->restart();
+$node->safe_psql('postgres', "
+	CREATE EXTENSION IF NOT EXISTS aqo;
+	SELECT true FROM aqo_reset();
+");
+
+# Run select-only pgbench and return its TPS
+sub pgbench_tps
+{
+	my ($mode) = @_;
+
+	$node->safe_psql('postgres', "
+		ALTER SYSTEM SET aqo.mode = '$mode';
+		SELECT pg_reload_conf();
+	");
+	my ($stdout, $stderr) = run_command([ 'pgbench', '-n', '-S',
+		'-h', $node->host, '-p', $node->port,
+		'-t', "$TRANSACTIONS", '-c', "$MANY_CLIENTS", '-j', "$THREADS",
+		'postgres' ]);
+	return ($stdout =~ /tps = ([0-9.]+)/) ? $1 : 0;
+}
+
+my $tps_disabled = pgbench_tps('disabled');
+my $tps_learn = pgbench_tps('learn');
+# Throughput depends too much on the machine to be compared here
+note("$MANY_CLIENTS clients, TPS: disabled $tps_disabled, learn $tps_learn");
+
+$fss_count = $node->safe_psql('postgres', "SELECT count(*) FROM aqo_data");
+ok($fss_count > 0, 'many clients have learned on the workload');
+
 $node->stop();
@@ -0,0 +1,100 @@
+use strict;
+use warnings;
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+
+use FindBin;
+use lib $FindBin::RealBin;
+use AqoDataDigest;
+
+use Test::More tests => 5;
+
+# ##############################################################################
+#
+# Learning data stored in single precision (aqo.compact_storage) survives
+# restart of the instance. Accuracy of the predictions is compared by the
+# compact_storage regression test.
+#
+# ##############################################################################
+
+my $node = PostgreSQL::Test::Cluster->new('aqotest');
+$node->init;
+$node->append_conf('postgresql.conf', qq{
+						shared_preload_libraries = 'aqo'
+						aqo.mode = 'learn'
+						aqo.join_threshold = 0
+						log_statement = 'none'
+					});
+
+# Test constants. Default values.
+my $TRANSACTIONS = 100;
+
+# Disable connection default settings, forced by PGOPTIONS in AQO Makefile
+$ENV{PGOPTIONS}="";
+
+if (defined $ENV{TRANSACTIONS})
+{
+	$TRANSACTIONS = $ENV{TRANSACTIONS};
+}
+
+$node->start();
+
+# Correlated columns make the planner estimations wrong, so AQO has something
+# to learn.
+$node->safe_psql('postgres', "
+	CREATE EXTENSION aqo;
+	CREATE TABLE a (x int, y int);
+	INSERT INTO a (x, y)
+		SELECT gs % 100, gs % 50 FROM generate_series(1, 10000) AS gs;
+	CREATE TABLE b AS SELECT * FROM a;
+	ANALYZE a, b;
+");
+
+my $workload = File::Temp->new();
+append_to_file($workload, q{
+	\set border random(1, 100)
+	SELECT count(*) FROM a WHERE x < :border AND y < :border;
+	SELECT count(*) FROM a JOIN b ON (a.x = b.y) WHERE a.x < :border AND b.x < :border;
+	SELECT count(*) FROM a, b WHERE a.x = b.x AND a.y = b.y AND a.y < :border;
+});
+
+# Learn on the workload from scratch
+sub learn_workload
+{
+	my ($compact) = @_;
+
+	$node->safe_psql('postgres', "
+		ALTER SYSTEM SET aqo.compact_storage = '$compact';
+		SELECT pg_reload_conf();
+		SELECT true FROM aqo_reset();
+	");
+	$node->command_ok([ 'pgbench', '-n', '-t', "$TRANSACTIONS", '-c', '1',
+						'-f', "$workload" ],
+						"learn on the workload, aqo.compact_storage = $compact");
+}
+
+# Are all the values of the ML data representable in float4? Queries of the
+# test aren't learned.
+my $float4_query = "
+	SET aqo.mode = 'disabled';
+	SELECT bool_and(targets = targets::real[]::double precision[] AND
+					reliability = reliability::real[]::double precision[] AND
+					(features IS NULL OR
+					 features = features::real[]::double precision[]))
+	FROM aqo_data";
+
+learn_workload('off');
+is($node->safe_psql('postgres', $float4_query), 'f',
+   'learning data is stored in double precision');
+
+learn_workload('on');
+is($node->safe_psql('postgres', $float4_query), 't',
+   'learning data is stored in single precision');
+
+# Compactly stored data survives restart of the instance
+my $digest = data_digest($node);
+$node->restart();
+is(data_digest($node), $digest, 'learning data is restored after restart');
+
+$node->stop();
@@ -0,0 +1,110 @@
+use strict;
+use warnings;
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+
+use Test::More tests => 7;
+
+# ##############################################################################
+#
+# Learning samples are passed to the background learner through the shared
+# queue (aqo.async_learning). Samples are dropped while the queue is full, but
+# learning converges anyway.
+#
+# ##############################################################################
+
+my $node = PostgreSQL::Test::Cluster->new('aqotest');
+$node->init;
+$node->append_conf('postgresql.conf', qq{
+						shared_preload_libraries = 'aqo'
+						aqo.mode = 'learn'
+						aqo.join_threshold = 0
+						aqo.learn_queue_size = '8kB'
+						aqo.async_learning = 'on'
+						log_statement = 'none'
+					});
+
+# Test constants. Default values.
+my $TRANSACTIONS = 100;
+
+# Disable connection default settings, forced by PGOPTIONS in AQO Makefile
+$ENV{PGOPTIONS}="";
+
+if (defined $ENV{TRANSACTIONS})
+{
+	$TRANSACTIONS = $ENV{TRANSACTIONS};
+}
+
+$node->start();
+
+$node->safe_psql('postgres', "
+	CREATE EXTENSION aqo;
+	CREATE TABLE a (x int, y int);
+	INSERT INTO a (x, y)
+		SELECT gs % 100, gs % 50 FROM generate_series(1, 10000) AS gs;
+	CREATE TABLE b AS SELECT * FROM a;
+	ANALYZE a, b;
+	SELECT true FROM aqo_reset();
+");
+
+my $workload = File::Temp->new();
+append_to_file($workload, q{
+	\set border random(1, 100)
+	SELECT count(*) FROM a WHERE x < :border AND y < :border;
+	SELECT count(*) FROM a JOIN b ON (a.x = b.y) WHERE a.x < :border AND b.x < :border;
+});
+
+$node->command_ok([ 'pgbench', '-n', '-t', "$TRANSACTIONS", '-c', '4',
+					'-f', "$workload" ],
+					'workload with asynchronous learning');
+
+# Wait for the learner to drain the queue
+ok($node->poll_query_until('postgres',
+	"SELECT pending_bytes = 0 AND learned = enqueued FROM aqo_learn_queue_stats()"),
+	'learner has drained the queue');
+
+my $enqueued = $node->safe_psql('postgres',
+								"SELECT enqueued FROM aqo_learn_queue_stats()");
+my $stats = $node->safe_psql('postgres',
+	"SELECT dropped >= 0 AND learned <= enqueued FROM aqo_learn_queue_stats()");
+note("Samples passed to the learner: $enqueued");
+ok($enqueued > 0, 'samples are passed through the queue');
+is($stats, 't', 'counters of the queue are consistent');
+
+# Stop the idle learner: the queue overflows and new samples are dropped.
+# Queries of the test itself don't pass samples to the queue.
+my $learner_pid = $node->safe_psql('postgres', "
+	SET aqo.mode = 'disabled';
+	SELECT pid FROM pg_stat_activity WHERE backend_type = 'aqo learner'");
+$node->poll_query_until('postgres', "
+	SET aqo.mode = 'disabled';
+	SELECT pending_bytes = 0 AND learned = enqueued FROM aqo_learn_queue_stats()");
+kill 'STOP', $learner_pid;
+
+$node->command_ok([ 'pgbench', '-n', '-t', "$TRANSACTIONS", '-c', '4',
+					'-f', "$workload" ],
+					'workload with the stopped learner');
+$stats = $node->safe_psql('postgres',
+	"SELECT dropped > 0 AND learned <= enqueued FROM aqo_learn_queue_stats()");
+is($stats, 't', 'samples are dropped while the queue is full');
+
+kill 'CONT', $learner_pid;
+
+# Repeated query learns its cardinalities in spite of the dropped samples
+my $query = "SELECT count(*) FROM a WHERE x < 50 AND y < 50";
+foreach my $i (1 .. 3)
+{
+	$node->safe_psql('postgres', $query);
+	$node->poll_query_until('postgres',
+		"SELECT pending_bytes = 0 AND learned = enqueued FROM aqo_learn_queue_stats()");
+}
+$node->safe_psql('postgres', $query);
+my $error = $node->safe_psql('postgres', "
+	SELECT ce.error FROM aqo_cardinality_error(true) AS ce
+		JOIN aqo_query_texts AS qt ON (ce.id = qt.queryid)
+	WHERE qt.query_text = '$query'");
+note("Cardinality error of the learned query: $error");
+ok($error ne '' && $error < 0.1, 'learning converges');
+
+$node->stop();
@@ -0,0 +1,133 @@
+use strict;
+use warnings;
+
+use File::Copy;
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+
+use FindBin;
+use lib $FindBin::RealBin;
+use AqoDataDigest;
+use Time::HiRes qw(usleep);
+
+use Test::More tests => 9;
+
+# ##############################################################################
+#
+# Changes of the ML data are appended to the delta log by a flush instead of
+# rewriting of the whole data file.
+#
+# ##############################################################################
+
+my $node = PostgreSQL::Test::Cluster->new('aqotest');
+$node->init;
+$node->append_conf('postgresql.conf', qq{
+						shared_preload_libraries = 'aqo'
+						aqo.mode = 'learn'
+						aqo.join_threshold = 0
+						aqo.flush_interval = '1s'
+						log_statement = 'none'
+					});
+
+# Disable connection default settings, forced by PGOPTIONS in AQO Makefile
+$ENV{PGOPTIONS}="";
+
+$node->start();
+
+my $datafile = $node->data_dir . '/pg_stat/pgaqo_data.stat';
+my $deltafile = $node->data_dir . '/pg_stat/pgaqo_data.delta';
+
+$node->safe_psql('postgres', "
+	CREATE EXTENSION aqo;
+	CREATE TABLE a (x int, y int);
+	INSERT INTO a (x, y)
+		SELECT gs % 100, gs % 50 FROM generate_series(1, 10000) AS gs;
+	CREATE TABLE b AS SELECT * FROM a;
+	ANALYZE a, b;
+	SELECT true FROM aqo_reset();
+");
+
+# Removal of the data rewrites the file and drops the log
+ok(!-e $deltafile, 'no delta log after reset');
+
+# Changes are written by the checkpointer in background.
+sub wait_for
+{
+	my ($cond) = @_;
+
+	foreach my $i (1 .. 10 * $PostgreSQL::Test::Utils::timeout_default)
+	{
+		return 1 if ($cond->());
+		usleep(100_000);
+	}
+	return 0;
+}
+
+sub wait_for_size
+{
+	my ($file, $size) = @_;
+
+	return wait_for(sub { -e $file && -s $file > $size });
+}
+
+$node->safe_psql('postgres', "
+	SELECT count(*) FROM a WHERE x < 10 AND y < 10;
+	SELECT count(*) FROM a JOIN b ON (a.x = b.y) WHERE a.x < 10 AND b.x < 10;
+");
+
+ok(wait_for_size($deltafile, 0), 'changes are appended to the delta log');
+my $deltasize = -s $deltafile;
+
+$node->safe_psql('postgres', "
+	SELECT count(*) FROM a WHERE x < 20 AND y < 20;
+");
+ok(wait_for_size($deltafile, $deltasize),
+   'next changes are appended to the same log');
+ok(!-e $datafile, 'data file is not rewritten by a flush');
+
+# The log is replayed on restart
+my $digest = data_digest($node);
+$node->restart();
+is(data_digest($node), $digest, 'learning data is restored from the log');
+
+# Make the log a bit larger than the compaction threshold of 1MB. It isn't
+# compacted by the flushes which make it so.
+$node->safe_psql('postgres', "
+	SELECT count(*) FROM generate_series(1, 800) AS gs,
+		LATERAL aqo_data_update(42, gs, 4,
+			array_fill(gs::double precision, ARRAY[30, 4]),
+			array_fill(1::double precision, ARRAY[30]),
+			array_fill(1::double precision, ARRAY[30]), '{1}') AS ret
+	WHERE ret;
+");
+wait_for_size($deltafile, 1024 * 1024)
+	or die "changes aren't appended to the delta log";
+my $stalefile = $node->basedir . '/pgaqo_data.delta.stale';
+copy($deltafile, $stalefile) or die "copy failed: $!";
+
+# The next flush compacts the log into the data file
+$node->safe_psql('postgres', "
+	SELECT aqo_data_update(42, 1, 4,
+		array_fill(0.5::double precision, ARRAY[30, 4]),
+		array_fill(0.5::double precision, ARRAY[30]),
+		array_fill(1::double precision, ARRAY[30]), '{1}');
+");
+ok(wait_for(sub { -e $datafile }), 'large log is compacted into the data file');
+
+# Crash after renaming of the new data file, before removal of the log
+$digest = data_digest($node);
+$node->stop();
+copy($stalefile, $deltafile) or die "copy failed: $!";
+$node->start();
+is(data_digest($node), $digest, 'stale log of the previous generation is ignored');
+like(slurp_file($node->logfile), qr/Ignore stale file/,
+	 'stale log is reported');
+
+# The next flush starts a new log instead of appending to the stale one
+$node->safe_psql('postgres', "
+	SELECT count(*) FROM a WHERE x < 30 AND y < 30;
+");
+ok(wait_for(sub { -s $deltafile < -s $stalefile }),
+   'stale log is truncated by a flush');
+
+$node->stop();
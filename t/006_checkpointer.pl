@@ -0,0 +1,100 @@
+use strict;
+use warnings;
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+
+use FindBin;
+use lib $FindBin::RealBin;
+use AqoDataDigest;
+use Time::HiRes qw(usleep);
+
+use Test::More tests => 5;
+
+# ##############################################################################
+#
+# The AQO checkpointer writes the storage in background, so learning survives
+# a crash of the instance. Backends don't write the storage themselves.
+#
+# ##############################################################################
+
+my $node = PostgreSQL::Test::Cluster->new('aqotest');
+$node->init;
+$node->append_conf('postgresql.conf', qq{
+						shared_preload_libraries = 'aqo'
+						aqo.mode = 'learn'
+						aqo.join_threshold = 0
+						aqo.flush_interval = '1s'
+						log_statement = 'none'
+					});
+
+# Disable connection default settings, forced by PGOPTIONS in AQO Makefile
+$ENV{PGOPTIONS}="";
+
+$node->start();
+
+$node->safe_psql('postgres', "
+	CREATE EXTENSION aqo;
+	CREATE TABLE a (x int, y int);
+	INSERT INTO a (x, y)
+		SELECT gs % 100, gs % 50 FROM generate_series(1, 10000) AS gs;
+	ANALYZE a;
+	SELECT true FROM aqo_reset();
+");
+
+my $count = $node->safe_psql('postgres', "
+	SELECT count(*) FROM pg_stat_activity
+	WHERE backend_type = 'aqo checkpointer'");
+is($count, '1', 'checkpointer is running');
+
+$node->safe_psql('postgres', "
+	SELECT count(*) FROM a WHERE x < 10 AND y < 10;
+	SELECT count(*) FROM a WHERE x < 20 AND y < 20;
+");
+
+# Statistics were written on shutdown of the instance only before.
+ok($node->poll_query_until('postgres',
+	"SELECT count(*) > 0 FROM pg_ls_dir('pg_stat') AS f
+	 WHERE f = 'pgaqo_statistics.stat'"),
+	'statistics are written in background');
+
+# Contents of all the storage files. Queries of the test aren't learned.
+sub storage_digest
+{
+	return $node->safe_psql('postgres', "
+		SET aqo.mode = 'disabled';
+		SELECT md5(string_agg(f || ':' || md5(pg_read_binary_file('pg_stat/' || f)),
+							  ',' ORDER BY f))
+		FROM pg_ls_dir('pg_stat') AS f WHERE f LIKE 'pgaqo_%'");
+}
+
+# Postpone the flushes. Exit of the backend, which has learned a new query,
+# doesn't write anything.
+$node->append_conf('postgresql.conf', "aqo.flush_interval = '1h'");
+$node->reload();
+sleep(2);
+my $files = storage_digest();
+$node->safe_psql('postgres', "SELECT count(*) FROM a WHERE x > 10 AND y > 10");
+sleep(1);
+is(storage_digest(), $files, 'exit of a backend writes nothing');
+
+# The change is written by the checkpointer
+$node->append_conf('postgresql.conf', "aqo.flush_interval = '1s'");
+$node->reload();
+my $written = 0;
+foreach my $i (1 .. 10 * $PostgreSQL::Test::Utils::timeout_default)
+{
+	$written = (storage_digest() ne $files);
+	last if ($written);
+	usleep(100_000);
+}
+ok($written, 'checkpointer writes the change');
+
+# Wait for one more flush and crash
+my $data = data_digest($node);
+sleep(2);
+$node->stop('immediate');
+$node->start();
+is(data_digest($node), $data, 'learning data survives a crash');
+
+$node->stop();
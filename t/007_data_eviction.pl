@@ -0,0 +1,95 @@
+use strict;
+use warnings;
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+
+use FindBin;
+use lib $FindBin::RealBin;
+use AqoDataDigest;
+
+use Test::More tests => 6;
+
+# ##############################################################################
+#
+# Cold feature subspaces are evicted when the ML data storage is full, so AQO
+# keeps learning new ones within aqo.fss_max_items.
+#
+# ##############################################################################
+
+my $FSS_MAX_ITEMS = 20;
+
+my $node = PostgreSQL::Test::Cluster->new('aqotest');
+$node->init;
+$node->append_conf('postgresql.conf', qq{
+						shared_preload_libraries = 'aqo'
+						aqo.mode = 'learn'
+						aqo.join_threshold = 0
+						aqo.fss_max_items = $FSS_MAX_ITEMS
+						log_statement = 'none'
+					});
+
+# Disable connection default settings, forced by PGOPTIONS in AQO Makefile
+$ENV{PGOPTIONS}="";
+
+$node->start();
+
+$node->safe_psql('postgres', "
+	CREATE EXTENSION aqo;
+	CREATE TABLE a (x int, y int, z int);
+	INSERT INTO a (x, y, z)
+		SELECT gs % 100, gs % 50, gs % 10 FROM generate_series(1, 10000) AS gs;
+	ANALYZE a;
+	SELECT true FROM aqo_reset();
+");
+
+# Each query has its own feature subspaces. Run much more of them than the
+# storage can keep.
+my $query = '';
+foreach my $i (1 .. 4 * $FSS_MAX_ITEMS)
+{
+	$query .= "SELECT count(*) FROM a WHERE x < $i AND y < $i AND z < $i;\n";
+	$query .= "SELECT count(*) FROM a AS a1, a AS a2
+		WHERE a1.x = a2.y AND a1.z < $i AND a2.z > $i;\n";
+}
+$node->safe_psql('postgres', $query);
+
+my $fss_count = $node->safe_psql('postgres', "SELECT count(*) FROM aqo_data");
+my $evicted = $node->safe_psql('postgres',
+							   "SELECT fss_evicted FROM aqo_eviction_stats()");
+note("Feature subspaces: $fss_count, evicted: $evicted");
+ok($evicted > 0, 'cold subspaces are evicted');
+ok($fss_count > 0 && $fss_count <= $FSS_MAX_ITEMS,
+   'storage stays within its limit');
+
+# The last query is learned, although the storage was full before it. Don't
+# learn on the check itself: it could evict the subspace.
+$node->safe_psql('postgres', "
+	SELECT count(*) FROM a WHERE x < 1000 AND y < 1000;
+");
+my $res = $node->safe_psql('postgres', "
+	SET aqo.mode = 'disabled';
+	SELECT count(*) FROM aqo_data d
+		JOIN aqo_queries q ON (d.fs = q.fs)
+		JOIN aqo_query_texts t ON (q.queryid = t.queryid)
+	WHERE t.query_text LIKE '%x < 1000 AND y < 1000%'
+");
+ok($res > 0, 'new subspace is learned by the full storage');
+
+my $stats = $node->safe_psql('postgres',
+	"SELECT fss_sweeps > 0 AND fss_evicted >= fss_sweeps
+	 FROM aqo_eviction_stats()");
+is($stats, 't', 'counters of the eviction are consistent');
+
+# Evicted subspaces are written into the delta log as removals, so the eviction
+# doesn't make each flush rewrite the data file. They don't come back after a
+# restart.
+my $digest = data_digest($node);
+$node->stop();
+ok(-e $node->data_dir . '/pg_stat/pgaqo_data.delta',
+   'removals are appended to the delta log');
+$node->start();
+is(data_digest($node), $digest,
+   'evicted subspaces are removed after restart');
+
+$node->stop();
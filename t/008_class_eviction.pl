@@ -0,0 +1,133 @@
+use strict;
+use warnings;
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+
+use Test::More tests => 8;
+
+# ##############################################################################
+#
+# New query classes displace cold ones when the knowledge base is full
+# (aqo.fs_max_items), instead of switching the backend into controlled mode.
+#
+# ##############################################################################
+
+my $FS_MAX_ITEMS = 10;
+my $NTABLES = 3 * $FS_MAX_ITEMS;
+
+my $node = PostgreSQL::Test::Cluster->new('aqotest');
+$node->init;
+$node->append_conf('postgresql.conf', qq{
+						shared_preload_libraries = 'aqo'
+						aqo.mode = 'learn'
+						aqo.join_threshold = 0
+						aqo.fs_max_items = $FS_MAX_ITEMS
+						log_statement = 'none'
+					});
+
+# Disable connection default settings, forced by PGOPTIONS in AQO Makefile
+$ENV{PGOPTIONS}="";
+
+$node->start();
+
+$node->safe_psql('postgres', "CREATE EXTENSION aqo");
+
+# Each table gives its own query class
+my $query = "SET aqo.mode = 'disabled';\n";
+foreach my $i (1 .. $NTABLES + 1)
+{
+	$query .= "CREATE TABLE t$i AS SELECT gs AS x FROM generate_series(1, 100) AS gs;\n";
+	$query .= "ANALYZE t$i;\n";
+}
+$query .= "RESET aqo.mode;\n";
+$query .= "SELECT true FROM aqo_reset();\n";
+$node->safe_psql('postgres', $query);
+
+# Plan the query of a table and say if its class is in the storage
+sub plan_class
+{
+	my ($table) = @_;
+	my $res = $node->safe_psql('postgres', "
+		SELECT count(*) FROM $table WHERE x < 10;
+		SET aqo.mode = 'disabled';
+		SELECT count(*) FROM aqo_query_texts
+		WHERE query_text LIKE '%FROM $table %';
+	");
+	return (split /\n/, $res)[-1];
+}
+
+# The second planning of a class asks the checkpointer for room in the full
+# storage. Wait for it, then the class is admitted by the next planning.
+sub admit_class
+{
+	my ($table) = @_;
+
+	return if (plan_class($table) || plan_class($table));
+	$node->poll_query_until('postgres', "
+		SET aqo.mode = 'disabled';
+		SELECT count(*) < $FS_MAX_ITEMS FROM aqo_queries");
+	plan_class($table);
+}
+
+admit_class('t1');
+admit_class('t2');
+
+# Class of t1 shares the feature space of t2, so it can't be evicted alone
+$node->safe_psql('postgres', "
+	SET aqo.mode = 'disabled';
+	SELECT aqo_queries_update(q1.queryid, q2.queryid, NULL, NULL, NULL)
+	FROM aqo_query_texts q1, aqo_query_texts q2
+	WHERE q1.query_text LIKE '%FROM t1 %' AND q2.query_text LIKE '%FROM t2 %';
+");
+
+# Fill the storage up and pass it over
+foreach my $i (3 .. $NTABLES)
+{
+	admit_class("t$i");
+}
+
+my $nclasses = $node->safe_psql('postgres', "
+	SET aqo.mode = 'disabled';
+	SELECT count(*) FROM aqo_queries");
+my $evicted = $node->safe_psql('postgres', "
+	SET aqo.mode = 'disabled';
+	SELECT classes_evicted FROM aqo_eviction_stats()");
+note("Query classes: $nclasses, evicted: $evicted");
+ok($evicted >= $NTABLES - $FS_MAX_ITEMS + 1,
+   'each admitted class evicts a cold one');
+ok($nclasses <= $FS_MAX_ITEMS, 'storage stays within its limit');
+
+my $res = $node->safe_psql('postgres', "
+	SET aqo.mode = 'disabled';
+	SELECT count(*) FROM aqo_queries WHERE queryid = 0");
+is($res, '1', 'default class survives eviction');
+
+$res = $node->safe_psql('postgres', "
+	SET aqo.mode = 'disabled';
+	SELECT count(*) FROM aqo_queries q JOIN aqo_query_texts t USING (queryid)
+	WHERE t.query_text LIKE '%FROM t1 %' AND q.fs <> q.queryid");
+is($res, '1', 'class borrowing a feature space survives eviction');
+
+# Owner of the shared feature space keeps its class and ML data
+$res = $node->safe_psql('postgres', "
+	SET aqo.mode = 'disabled';
+	SELECT count(*) FROM aqo_queries q JOIN aqo_query_texts t USING (queryid)
+	WHERE t.query_text LIKE '%FROM t2 %' AND q.fs = q.queryid");
+is($res, '1', 'class owning a shared feature space survives eviction');
+
+$res = $node->safe_psql('postgres', "
+	SET aqo.mode = 'disabled';
+	SELECT count(*) > 0 FROM aqo_data d JOIN aqo_query_texts t
+		ON (d.fs = t.queryid)
+	WHERE t.query_text LIKE '%FROM t2 %'");
+is($res, 't', 'ML data of a shared feature space survives eviction');
+
+# A class planned once isn't admitted, but the backend still adds new classes
+my $newtable = 't' . ($NTABLES + 1);
+is(plan_class($newtable), '0', 'class planned once is not admitted');
+
+admit_class($newtable);
+is(plan_class($newtable), '1', 'class planned again is admitted after eviction');
+
+$node->stop();
@@ -0,0 +1,161 @@
+use strict;
+use warnings;
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+
+use Test::More tests => 11;
+
+# ##############################################################################
+#
+# A damaged storage file loses only the records of the damaged block (or the
+# damaged record of the ML data file). A file of an unknown format is renamed
+# aside instead of removal.
+#
+# ##############################################################################
+
+my $NRECS = 3000;
+
+my $node = PostgreSQL::Test::Cluster->new('aqotest');
+$node->init;
+$node->append_conf('postgresql.conf', qq{
+						shared_preload_libraries = 'aqo'
+						aqo.mode = 'disabled'
+						log_statement = 'none'
+					});
+
+# Disable connection default settings, forced by PGOPTIONS in AQO Makefile
+$ENV{PGOPTIONS}="";
+
+$node->start();
+
+my $dir = $node->data_dir . '/pg_stat';
+my %files = (
+	'aqo_queries' => "$dir/pgaqo_queries.stat",
+	'aqo_query_texts' => "$dir/pgaqo_query_texts.stat",
+	'aqo_query_stat' => "$dir/pgaqo_statistics.stat");
+my $datafile = "$dir/pgaqo_data.stat";
+
+# Records of the default feature space are created on load
+sub count_records
+{
+	my ($view) = @_;
+	my $cond = ($view eq 'aqo_data') ? 'true' : 'queryid <> 0';
+
+	return $node->safe_psql('postgres',
+							"SELECT count(*) FROM $view WHERE $cond");
+}
+
+# Flip a byte in the records of the second block of the file. Return the number
+# of the records in the block.
+sub corrupt_block
+{
+	my ($file) = @_;
+	my $offset = 16;	# magic, version of PostgreSQL and number of records
+	my ($hdr, $len, $nrecs, $byte);
+
+	open(my $fh, '+<:raw', $file) or die "could not open $file: $!";
+	foreach my $i (0 .. 1)
+	{
+		seek($fh, $offset, 0);
+		read($fh, $hdr, 16) == 16 or die "file $file has less than 2 blocks";
+		($len, $nrecs) = unpack('L L', $hdr);
+		$offset += 16 + $len if ($i == 0);
+	}
+
+	$offset += 16 + int($len / 2);
+	seek($fh, $offset, 0);
+	read($fh, $byte, 1);
+	seek($fh, $offset, 0);
+	print $fh chr(ord($byte) ^ 0xFF);
+	close($fh);
+	return $nrecs;
+}
+
+# Flip a byte in the first record of the ML data file. It follows the header.
+sub corrupt_data_record
+{
+	my ($file) = @_;
+	my $byte;
+
+	open(my $fh, '+<:raw', $file) or die "could not open $file: $!";
+	seek($fh, 48, 0);
+	read($fh, $byte, 1);
+	seek($fh, 48, 0);
+	print $fh chr(ord($byte) ^ 0xFF);
+	close($fh);
+}
+
+$node->safe_psql('postgres', "
+	CREATE EXTENSION aqo;
+	SELECT count(*) FROM generate_series(1, $NRECS) AS gs,
+		LATERAL aqo_queries_update(gs, gs, true, true, false) AS ret
+	WHERE ret;
+	SELECT count(*) FROM generate_series(1, $NRECS) AS gs,
+		LATERAL aqo_query_texts_update(gs, 'query number ' || gs) AS ret
+	WHERE ret;
+	SELECT count(*) FROM generate_series(1, $NRECS) AS gs,
+		LATERAL aqo_query_stat_update(gs,
+			array_fill(1::double precision, ARRAY[20]),
+			array_fill(1::double precision, ARRAY[20]),
+			array_fill(1::double precision, ARRAY[20]),
+			array_fill(1::double precision, ARRAY[20]),
+			array_fill(1::double precision, ARRAY[20]),
+			array_fill(1::double precision, ARRAY[20]), gs, gs) AS ret
+	WHERE ret;
+	SELECT count(*) FROM generate_series(1, $NRECS) AS gs,
+		LATERAL aqo_data_update(gs, gs, 4,
+			array_fill(gs::double precision, ARRAY[30, 4]),
+			array_fill(1::double precision, ARRAY[30]),
+			array_fill(1::double precision, ARRAY[30]), '{1}') AS ret
+	WHERE ret;
+");
+
+# The ML data goes into the delta log first. The next flush compacts the large
+# log into the data file.
+$node->restart();
+$node->safe_psql('postgres', "
+	SELECT aqo_data_update(1, 1, 4,
+		array_fill(0::double precision, ARRAY[30, 4]),
+		array_fill(0::double precision, ARRAY[30]),
+		array_fill(1::double precision, ARRAY[30]), '{1}');
+");
+
+my %counts;
+foreach my $view (keys %files, 'aqo_data')
+{
+	$counts{$view} = count_records($view);
+}
+$node->stop();
+ok(-e $datafile, 'ML data file is written');
+
+my %lost;
+foreach my $view (keys %files)
+{
+	$lost{$view} = corrupt_block($files{$view});
+}
+corrupt_data_record($datafile);
+$node->start();
+
+foreach my $view (sort keys %files)
+{
+	note("$view: $counts{$view} records, $lost{$view} in the damaged block");
+	is(count_records($view), $counts{$view} - $lost{$view},
+	   "only the damaged block of $view is lost");
+	ok(-e $files{$view}, "file of $view is kept");
+}
+is(count_records('aqo_data'), $counts{'aqo_data'} - 1,
+   'only the damaged record of aqo_data is lost');
+like(slurp_file($node->logfile), qr/Skip corrupted block/,
+	 'damaged blocks are reported');
+
+# The file of an unknown format isn't removed
+$node->stop();
+open(my $fh, '+<:raw', $files{'aqo_query_stat'}) or die "could not open: $!";
+print $fh pack('L', 0);
+close($fh);
+$node->start();
+is(count_records('aqo_query_stat'), 0, 'file of an unknown format is ignored');
+ok(-e $files{'aqo_query_stat'} . '.bad', 'file of an unknown format is kept');
+
+$node->stop();
@@ -0,0 +1,115 @@
+use strict;
+use warnings;
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+
+use Test::More tests => 9;
+
+# ##############################################################################
+#
+# Storage files of AQO 1.6 are read and rewritten in the current format.
+#
+# ##############################################################################
+
+my $HEADER_1_6 = 123467589;
+
+my $node = PostgreSQL::Test::Cluster->new('aqotest');
+$node->init;
+$node->append_conf('postgresql.conf', qq{
+						shared_preload_libraries = 'aqo'
+						aqo.mode = 'disabled'
+						log_statement = 'none'
+					});
+
+# Disable connection default settings, forced by PGOPTIONS in AQO Makefile
+$ENV{PGOPTIONS}="";
+
+$node->start();
+$node->safe_psql('postgres', "CREATE EXTENSION aqo");
+my $pgver = int($node->safe_psql('postgres', "SHOW server_version_num") / 100);
+$node->stop();
+
+my $dir = $node->data_dir . '/pg_stat';
+my %files = (
+	'queries' => "$dir/pgaqo_queries.stat",
+	'texts' => "$dir/pgaqo_query_texts.stat",
+	'stat' => "$dir/pgaqo_statistics.stat",
+	'data' => "$dir/pgaqo_data.stat");
+
+# AQO 1.6 wrote the header and then each record with its size
+sub write_file_1_6
+{
+	my ($file, @records) = @_;
+
+	open(my $fh, '>:raw', $file) or die "could not open $file: $!";
+	print $fh pack('L L l!', $HEADER_1_6, $pgver, scalar(@records));
+	foreach my $rec (@records)
+	{
+		print $fh pack('Q', length($rec)) . $rec;
+	}
+	close($fh);
+}
+
+# Record of the ML data: fixed part of DataEntry, then its DSA chunk
+sub data_record_1_6
+{
+	my ($fs, $fss, $cols, $matrix, $targets, $rfactors, $oids) = @_;
+	my $rows = scalar(@$targets);
+
+	return pack('Q q l l l x4', $fs, $fss, $cols, $rows, scalar(@$oids)) .
+		   pack('Q q', $fs, $fss) .
+		   pack('d*', @$matrix, @$targets, @$rfactors) .
+		   pack('L*', @$oids);
+}
+
+write_file_1_6($files{'queries'},
+			   pack('Q Q C C C x5 q q', 42, 100, 1, 1, 0, 0, 0));
+write_file_1_6($files{'texts'}, pack('Q Z*', 42, 'SELECT 42'));
+write_file_1_6($files{'stat'},
+			   pack('Q q q l x4 d60 l x4 d60', 42, 5, 7,
+					0, (0) x 60,
+					2, (0) x 40, 0.5, 0.25, (0) x 18));
+# Feature subspace hashes of AQO 1.6 are 32-bit, sign-extended in the key
+write_file_1_6($files{'data'},
+			   data_record_1_6(100, -5, 2, [1, 2, 3, 4], [0.5, 1.5], [1, 1],
+							   [1259]),
+			   data_record_1_6(100, 7, 0, [], [2.5], [1], []));
+
+$node->start();
+
+my $data_query = "
+	SELECT fs, fss, nfeatures, features, targets, oids
+	FROM aqo_data ORDER BY fss";
+my $data_expected = "100|-5|2|{{1,2},{3,4}}|{0.5,1.5}|{1259}\n100|7|0||{2.5}|";
+
+is($node->safe_psql('postgres', $data_query), $data_expected,
+   'ML data of AQO 1.6 is loaded');
+is($node->safe_psql('postgres', "
+	SELECT fs, learn_aqo, use_aqo, auto_tuning FROM aqo_queries
+	WHERE queryid = 42"), '100|t|t|f', 'query classes of AQO 1.6 are loaded');
+is($node->safe_psql('postgres', "
+	SELECT query_text FROM aqo_query_texts WHERE queryid = 42"), 'SELECT 42',
+   'query texts of AQO 1.6 are loaded');
+is($node->safe_psql('postgres', "
+	SELECT executions_with_aqo, executions_without_aqo,
+		   cardinality_error_with_aqo
+	FROM aqo_query_stat WHERE queryid = 42"), '5|7|{0.5,0.25}',
+   'statistics of AQO 1.6 are loaded');
+
+# Files are converted by the flushes
+$node->stop();
+foreach my $name (sort keys %files)
+{
+	my $magic;
+
+	open(my $fh, '<:raw', $files{$name}) or die "could not open: $!";
+	read($fh, $magic, 4);
+	close($fh);
+	isnt(unpack('L', $magic), $HEADER_1_6, "file of $name is rewritten");
+}
+
+$node->start();
+is($node->safe_psql('postgres', $data_query), $data_expected,
+   'converted ML data is loaded');
+$node->stop();
@@ -0,0 +1,142 @@
+use strict;
+use warnings;
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+
+use FindBin;
+use lib $FindBin::RealBin;
+use AqoDataDigest;
+
+use Test::More tests => 10;
+
+# ##############################################################################
+#
+# Entries of the ML data file are moved into the shared memory lazily: on the
+# first lookup or by the checkpointer in background. A change of the entry
+# made before its load takes precedence over the file.
+#
+# ##############################################################################
+
+my $NRECS = 3000;
+
+my $node = PostgreSQL::Test::Cluster->new('aqotest');
+$node->init;
+$node->append_conf('postgresql.conf', qq{
+						shared_preload_libraries = 'aqo'
+						aqo.mode = 'learn'
+						aqo.join_threshold = 0
+						log_statement = 'none'
+					});
+
+# Test constants. Default values.
+my $TRANSACTIONS = 100;
+
+# Disable connection default settings, forced by PGOPTIONS in AQO Makefile
+$ENV{PGOPTIONS}="";
+
+if (defined $ENV{TRANSACTIONS})
+{
+	$TRANSACTIONS = $ENV{TRANSACTIONS};
+}
+
+$node->start();
+
+my $datafile = $node->data_dir . '/pg_stat/pgaqo_data.stat';
+
+# Entries of these feature spaces are changed by the test
+my $unchanged = 'fs NOT IN (1, 77)';
+
+sub count_data
+{
+	return $node->safe_psql('postgres', "SELECT count(*) FROM aqo_data");
+}
+
+$node->safe_psql('postgres', "
+	CREATE EXTENSION aqo;
+	CREATE TABLE a (x int, y int);
+	INSERT INTO a (x, y)
+		SELECT gs % 100, gs % 50 FROM generate_series(1, 10000) AS gs;
+	CREATE TABLE b AS SELECT * FROM a;
+	ANALYZE a, b;
+	SELECT true FROM aqo_reset();
+");
+
+my $workload = File::Temp->new();
+append_to_file($workload, q{
+	\set border random(1, 100)
+	SELECT count(*) FROM a WHERE x < :border AND y < :border;
+	SELECT count(*) FROM a JOIN b ON (a.x = b.y) WHERE a.x < :border AND b.x < :border;
+});
+
+$node->command_ok([ 'pgbench', '-n', '-t', "$TRANSACTIONS", '-c', '4',
+					'-f', "$workload" ],
+					'learning of the workload');
+
+# Enough data to make the delta log large. The class 77 is dropped later.
+$node->safe_psql('postgres', "
+	SELECT count(*) FROM generate_series(1, $NRECS) AS gs,
+		LATERAL aqo_data_update(gs, gs, 4,
+			array_fill(gs::double precision, ARRAY[30, 4]),
+			array_fill(1::double precision, ARRAY[30]),
+			array_fill(1::double precision, ARRAY[30]), '{1}') AS ret
+	WHERE ret;
+	SELECT aqo_queries_update(77, 77, true, true, false);
+	SELECT aqo_data_update(77, 1, 0, NULL, '{1}', '{1}', '{1}');
+");
+
+# The next flush compacts the large log into the data file
+$node->restart();
+$node->safe_psql('postgres', "
+	SELECT aqo_data_update(2, 2, 4,
+		array_fill(2::double precision, ARRAY[30, 4]),
+		array_fill(1::double precision, ARRAY[30]),
+		array_fill(1::double precision, ARRAY[30]), '{1}');
+");
+my $digest = data_digest($node, $unchanged);
+my $count = count_data();
+$node->stop();
+ok(-e $datafile, 'ML data file is written');
+
+# Lookups of the planning load the entries concurrently
+my $frozen = File::Temp->new();
+append_to_file($frozen, q{
+	\set border random(1, 100)
+	SET aqo.mode = 'frozen';
+	SELECT count(*) FROM a WHERE x < :border AND y < :border;
+	SELECT count(*) FROM a JOIN b ON (a.x = b.y) WHERE a.x < :border AND b.x < :border;
+});
+
+$node->start();
+$node->command_ok([ 'pgbench', '-n', '-t', "$TRANSACTIONS", '-c', '8',
+					'-f', "$frozen" ],
+					'lookups of the ML data file');
+
+# Change entries which can still be in the file only
+$node->safe_psql('postgres', "
+	SELECT aqo_data_update(1, 1, 4, array_fill(0::double precision, ARRAY[1, 4]),
+						   '{5}', '{1}', '{1}');
+	SELECT aqo_drop_class(77);
+");
+
+is($node->safe_psql('postgres', "
+	SELECT count(*) = count(DISTINCT (fs, fss)) FROM aqo_data"), 't',
+   'entries are loaded once');
+is(data_digest($node, $unchanged), $digest, 'entries of the file are loaded');
+is($node->safe_psql('postgres', "
+	SELECT targets FROM aqo_data WHERE fs = 1 AND fss = 1"), '{5}',
+   'updated entry takes precedence over the file');
+is(count_data(), $count - 1, 'dropped entry is not loaded from the file');
+
+$digest = data_digest($node);
+$node->restart();
+is(data_digest($node), $digest, 'changes survive a restart');
+
+# Entries which aren't loaded yet are discarded by the reset
+$node->restart();
+$node->safe_psql('postgres', "SELECT true FROM aqo_reset()");
+is(count_data(), 0, 'reset discards the file');
+$node->restart();
+is(count_data(), 0, 'discarded entries are not loaded again');
+
+$node->stop();
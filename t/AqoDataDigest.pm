@@ -0,0 +1,28 @@
+# Digest of the ML data, shared by the TAP tests to compare the learning data
+# before and after a restart or a crash.
+
+package AqoDataDigest;
+
+use strict;
+use warnings;
+
+use Exporter 'import';
+our @EXPORT = qw(data_digest);
+
+# Return the digest of aqo_data rows satisfying an optional condition.
+# Queries of the test itself must not change the data, so AQO is disabled.
+sub data_digest
+{
+	my ($node, $cond) = @_;
+
+	$cond = 'true' unless defined $cond;
+	return $node->safe_psql('postgres', "
+		SET aqo.mode = 'disabled';
+		SELECT md5(string_agg(fs || ':' || fss || ':' ||
+							  coalesce(features::text, '') || ':' ||
+							  targets::text || ':' || reliability::text, ','
+							  ORDER BY fs, fss))
+		FROM aqo_data WHERE $cond");
+}
+
+1;